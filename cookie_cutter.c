@@ -2,13 +2,49 @@
 // SDL2-based cookie cutter tool
 // Controls:
 // - Drag inside      → move crop region
-// - Drag bottom-right corner → resize (keeps square for now)
+// - Drag bottom-right corner → resize (free aspect; L locks the current ratio)
+// - N / Tab / Delete            → new region (copy of the active one) / next region / remove region
+// - Click another region        → make it the active one; Shift+S saves every region
 // - Arrow keys                  → move 1 pixel
 // - Ctrl  + Arrow keys          → jump by current crop size (width/height)
-// - Shift + Arrow keys          → resize by 1 pixel (grow/shrink, center preserved)
-// - +/- keys                    → resize by 16 pixels (centered)
-// - S key                       → save current crop as PNG
+// - Shift + Arrow keys          → resize by 1 pixel (moves the right/bottom edge)
+// - +/- keys                    → resize by 16 pixels (top-left corner stays)
+// - S key                       → save current crop as PNG (encoded in the background)
+// - G key                       → cut the whole image into crop-sized tiles (--grid-overlap N px)
+// - A key                       → suggest the --suggest N (default 8) highest edge-energy crops as regions
+// - Ctrl+Z / Ctrl+Y             → undo / redo crop edits (one step per key press or drag)
+// - --session file.csv          → log every save; replay with --batch file.csv (no image argument)
+// - --ipc /path.sock            → control socket: get / crop / save / batch / grab (pixels via shm)
 // - Real-time X:Y W:H overlay + 1:1 preview in bottom-right
+// - --vram-mb N                 → texture budget for the tiled image pyramid (default 512)
+// - --continuous                → redraw every vsync instead of only when something changed
+// - --low-latency               → no vsync; paced to the refresh rate with input sampled just before drawing
+// - --batch manifest.csv        → headless: save every x,y,w,h[,filename] row, one worker per core
+// - --bench out.json [images]   → headless timings of decode/extract/encode/batch/upload as JSON
+// - --worker DIR [--node name]  → batch farm node: claims manifests from DIR/todo, writes its own shards and metrics
+// - PageUp / PageDown           → previous / next image when several files or a directory are given
+// - Mouse wheel                 → zoom around the cursor; right/middle drag pans; Home = fit window
+// - --prefetch N                → decode the next N images in the background (default 2)
+// - F3 / --profile             → frame-time HUD; --trace file.csv dumps per-frame timings
+// - Binary PGM/PPM inputs are memory-mapped instead of decoded (no heap copy of the pixels)
+// - Large JPEGs with restart markers decode in parallel stripes, with a low-res preview meanwhile
+// - --cache DIR                 → keep decoded pyramids on disk and map them on later launches (GUI and --batch)
+// - --watch                     → reload the current image when its file changes, re-uploading only what differs
+// - --png realtime|fast|default|max → PNG compression profile for saves (default: default)
+// - --png-filter F              → override the row filter (none/sub/up/avg/paeth/adaptive)
+// - --encoder png|sdl           → built-in zlib encoder, or IMG_SavePNG
+// - --encoder qoi|npy|npy-chw|webp → QOI, raw uint8 HWC/CHW NumPy arrays, lossless WebP
+// - Crops keep the source's channels: gray stays 1 byte/pixel, opaque images save as RGB
+// - --scales 256,512,native     → save every crop at these longest-side sizes too (name.256.png, ...)
+// - --shard prefix [--shard-mb N] → append crops to prefix-NNNNNN.tar shards (WebDataset)
+// - --dedup flag|skip           → warn about / drop crops whose dHash is within --dedup-distance bits of an earlier one
+//
+// Build: cc cookie_cutter.c -lSDL2 -lSDL2_image -lSDL2_ttf -lz -lm   (add -lrt on glibc < 2.34)
+//        add -DHAVE_WEBP -lwebp for the webp encoder
+// Check: cc -std=gnu11 -O2 -Wall -Wextra -c -o /dev/null cookie_cutter.c
+//           $(pkg-config --cflags sdl2 SDL2_image SDL2_ttf zlib)   (one line)
+//        must print nothing, with and without -DHAVE_WEBP (-O2 enables the
+//        -Wformat-truncation checks the fixed-size path buffers rely on)
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -16,8 +52,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef HAVE_WEBP
+#include <webp/encode.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #define WINDOW_W            1280
 #define WINDOW_H             900
@@ -25,41 +80,6404 @@
 #define MIN_SQUARE_SIZE       32
 #define PREVIEW_SIZE         256
 
+// What needs a redraw; the idle loop sleeps in SDL_WaitEvent while this is 0
+enum {
+    DIRTY_CROP    = 1 << 0,     // crop rectangle moved or resized
+    DIRTY_VIEW    = 1 << 1,     // window exposed/resized, viewport changed
+    DIRTY_OVERLAY = 1 << 2,     // status text changed (save finished, message expired)
+    DIRTY_ALL     = DIRTY_CROP | DIRTY_VIEW | DIRTY_OVERLAY
+};
+
+typedef struct {
+    int x, y;       // top-left in original image coordinates
+    int w, h;       // width & height, any aspect
+} CropRegion;
+
+// ──────────────────────────────────────────────── Frame profiler ────────────────────────────────────────────────
+// Per-frame section timers and allocation counters. --profile (or F3) shows
+// them in a HUD, --trace file.csv writes one row per rendered frame.
+// Counters are atomic because save and loader threads allocate surfaces too.
+// Input-to-present latency runs from the SDL timestamp of the oldest input
+// event a frame reacts to until its SDL_RenderPresent returns.
+
+enum {
+    PROF_EVENTS,                // event handling incl. image switching
+    PROF_IMAGE,                 // main image tiles
+    PROF_PREVIEW,               // 1:1 preview
+    PROF_TEXT,                  // text overlay layout + draw
+    PROF_PRESENT,               // SDL_RenderPresent
+    PROF_NUM_SECTIONS
+};
+
+enum {
+    PROF_TEX_CREATE,
+    PROF_SURF_ALLOC,
+    PROF_NUM_COUNTERS
+};
+
+static const char* const prof_section_names[PROF_NUM_SECTIONS] = { "events", "image", "preview", "text", "present" };
+static const char* const prof_counter_names[PROF_NUM_COUNTERS] = { "tex_creates", "surf_allocs" };
+
+#define PROF_HUD_REFRESH_MS 500
+
+typedef struct {
+    bool         hud;
+    FILE*        trace;
+    double       to_ms;                         // performance counter ticks → ms
+
+    Uint64       frame;
+    Uint64       frame_start, section_start;
+    double       ms[PROF_NUM_SECTIONS];         // current frame
+    double       frame_ms;
+    Uint64       input_start;                   // oldest input not yet presented, 0 = none
+    double       input_ms;                      // current frame, < 0 without input
+    char         present_mode[32];              // "vsync" or the --low-latency pacing
+    SDL_atomic_t counters[PROF_NUM_COUNTERS];   // running totals
+    int          frame_base[PROF_NUM_COUNTERS]; // totals at the start of the frame
+
+    // HUD values, refreshed every PROF_HUD_REFRESH_MS so they stay readable
+    Uint32       hud_ticks;
+    int          hud_base[PROF_NUM_COUNTERS];
+    Uint64       hud_frames;
+    double       hud_sum_ms[PROF_NUM_SECTIONS], hud_sum_frame_ms;
+    int          hud_inputs;
+    double       hud_sum_input_ms, hud_max_input_ms;
+    char         hud_line[2][256];
+} Profiler;
+
+static Profiler prof;
+
+static void prof_count(int counter)
+{
+    SDL_AtomicAdd(&prof.counters[counter], 1);
+}
+
+static bool prof_init(bool hud, const char* trace_path)
+{
+    prof.hud   = hud;
+    prof.to_ms = 1000.0 / (double)SDL_GetPerformanceFrequency();
+    prof.hud_ticks = SDL_GetTicks();
+    snprintf(prof.present_mode, sizeof(prof.present_mode), "vsync");
+    if (!trace_path) return true;
+
+    prof.trace = fopen(trace_path, "w");
+    if (!prof.trace) return false;
+    fprintf(prof.trace, "frame,ticks_ms");
+    for (int i = 0; i < PROF_NUM_SECTIONS; i++) fprintf(prof.trace, ",%s_ms", prof_section_names[i]);
+    fprintf(prof.trace, ",frame_ms,input_ms");
+    for (int i = 0; i < PROF_NUM_COUNTERS; i++) fprintf(prof.trace, ",%s", prof_counter_names[i]);
+    fprintf(prof.trace, "\n");
+    return true;
+}
+
+static void prof_shutdown(void)
+{
+    if (prof.trace) fclose(prof.trace);
+    prof.trace = NULL;
+}
+
+static bool prof_active(void)
+{
+    return prof.hud || prof.trace;
+}
+
+// An input event whose effect the next rendered frame shows
+static void prof_input(Uint32 timestamp)
+{
+    if (prof.input_start || !prof_active()) return;
+    Uint32 age = SDL_min(SDL_GetTicks() - timestamp, 1000u);   // queued that long ago
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    prof.input_start = SDL_GetPerformanceCounter() - (Uint64)age * freq / 1000;
+}
+
+// Without the HUD or a trace the per-frame work is skipped (frame_start 0)
+static void prof_frame_begin(void)
+{
+    if (!prof_active()) {
+        prof.frame_start = prof.input_start = 0;
+        return;
+    }
+    prof.frame_start = prof.section_start = SDL_GetPerformanceCounter();
+    memset(prof.ms, 0, sizeof(prof.ms));
+    for (int i = 0; i < PROF_NUM_COUNTERS; i++)
+        prof.frame_base[i] = SDL_AtomicGet(&prof.counters[i]);
+}
+
+// Charges the time since the previous mark to `section`
+static void prof_mark(int section)
+{
+    if (!prof.frame_start) return;
+    Uint64 now = SDL_GetPerformanceCounter();
+    prof.ms[section] += (now - prof.section_start) * prof.to_ms;
+    prof.section_start = now;
+}
+
+static void prof_frame_end(void)
+{
+    if (!prof.frame_start) return;
+    Uint64 end = SDL_GetPerformanceCounter();
+    prof.frame_ms = (end - prof.frame_start) * prof.to_ms;
+    prof.input_ms = prof.input_start ? (end - prof.input_start) * prof.to_ms : -1;
+    prof.input_start = 0;
+    prof.frame++;
+
+    if (prof.trace) {
+        fprintf(prof.trace, "%llu,%u", (unsigned long long)prof.frame, SDL_GetTicks());
+        for (int i = 0; i < PROF_NUM_SECTIONS; i++) fprintf(prof.trace, ",%.3f", prof.ms[i]);
+        fprintf(prof.trace, ",%.3f,", prof.frame_ms);
+        if (prof.input_ms >= 0) fprintf(prof.trace, "%.3f", prof.input_ms);
+        for (int i = 0; i < PROF_NUM_COUNTERS; i++)
+            fprintf(prof.trace, ",%d", SDL_AtomicGet(&prof.counters[i]) - prof.frame_base[i]);
+        fprintf(prof.trace, "\n");
+    }
+
+    prof.hud_frames++;
+    prof.hud_sum_frame_ms += prof.frame_ms;
+    for (int i = 0; i < PROF_NUM_SECTIONS; i++) prof.hud_sum_ms[i] += prof.ms[i];
+    if (prof.input_ms >= 0) {
+        prof.hud_inputs++;
+        prof.hud_sum_input_ms += prof.input_ms;
+        prof.hud_max_input_ms = SDL_max(prof.hud_max_input_ms, prof.input_ms);
+    }
+
+    Uint32 now = SDL_GetTicks();
+    Uint32 elapsed = now - prof.hud_ticks;
+    if (elapsed < PROF_HUD_REFRESH_MS) return;
+
+    double n = (double)prof.hud_frames;
+    int len = snprintf(prof.hud_line[0], sizeof(prof.hud_line[0]), "frame %.2f ms  %.1f fps drawn  |",
+                       prof.hud_sum_frame_ms / n, n * 1000.0 / elapsed);
+    for (int i = 0; i < PROF_NUM_SECTIONS && len < (int)sizeof(prof.hud_line[0]); i++)
+        len += snprintf(prof.hud_line[0] + len, sizeof(prof.hud_line[0]) - len, "  %s %.2f",
+                        prof_section_names[i], prof.hud_sum_ms[i] / n);
+
+    if (prof.hud_inputs)
+        len = snprintf(prof.hud_line[1], sizeof(prof.hud_line[1]), "input-to-present %.1f ms (max %.1f, %s)   ",
+                       prof.hud_sum_input_ms / prof.hud_inputs, prof.hud_max_input_ms, prof.present_mode);
+    else
+        len = snprintf(prof.hud_line[1], sizeof(prof.hud_line[1]), "input-to-present -  (%s)   ", prof.present_mode);
+    for (int i = 0; i < PROF_NUM_COUNTERS && len < (int)sizeof(prof.hud_line[1]); i++) {
+        int total = SDL_AtomicGet(&prof.counters[i]);
+        len += snprintf(prof.hud_line[1] + len, sizeof(prof.hud_line[1]) - len, "%s%s/s %.1f",
+                        i ? "   " : "", prof_counter_names[i], (total - prof.hud_base[i]) * 1000.0 / elapsed);
+        prof.hud_base[i] = total;
+    }
+
+    prof.hud_ticks = now;
+    prof.hud_frames = 0;
+    prof.hud_sum_frame_ms = 0;
+    memset(prof.hud_sum_ms, 0, sizeof(prof.hud_sum_ms));
+    prof.hud_inputs = 0;
+    prof.hud_sum_input_ms = prof.hud_max_input_ms = 0;
+}
+
+// ──────────────────────────────────────────────── Frame pacing ────────────────────────────────────────────────
+// --low-latency presents without vsync, where SDL_RenderPresent would block
+// until the flip and the next frame's input would already be a frame old.
+// The loop paces itself to the display's refresh instead: after the first
+// event of a frame wakes it, it sleeps until just before the frame's
+// deadline (minus the recent cost of a frame), then drains the queue and
+// draws, so the input it shows is as fresh as the budget allows.
+
+#define PACE_SPIN_MS    1.0     // the last stretch is spun; SDL_Delay overshoots
+#define PACE_MARGIN_MS  1.0
+
+typedef struct {
+    bool    enabled;
+    double  period_ms;
+    double  to_ms;
+    Uint64  freq;
+    Uint64  deadline;           // performance counter of the next present
+    Uint64  woke;               // when the current frame started collecting input
+    double  frame_ms;           // cost of a frame, rises at once and decays slowly
+} FramePacer;
+
+static void pacer_init(FramePacer* p, SDL_Window* window, bool enabled)
+{
+    SDL_DisplayMode mode;
+    int hz = SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 ? mode.refresh_rate : 0;
+    p->enabled   = enabled;
+    p->period_ms = 1000.0 / (hz > 0 ? hz : 60);
+    p->freq      = SDL_GetPerformanceFrequency();
+    p->to_ms     = 1000.0 / (double)p->freq;
+    p->deadline  = 0;
+    p->woke      = SDL_GetPerformanceCounter();
+    p->frame_ms  = 2.0;
+}
+
+// Before input is collected for a frame
+static void pacer_wait(FramePacer* p)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (p->enabled && p->deadline > now) {
+        double wait = (p->deadline - now) * p->to_ms - p->frame_ms - PACE_MARGIN_MS;
+        if (wait > PACE_SPIN_MS) SDL_Delay((Uint32)(wait - PACE_SPIN_MS));
+        Uint64 until = now + (Uint64)(SDL_max(wait, 0.0) / p->to_ms);
+        while ((now = SDL_GetPerformanceCounter()) < until) {}
+    }
+    p->woke = now;
+}
+
+static void pacer_presented(FramePacer* p)
+{
+    Uint64 now = SDL_GetPerformanceCounter();
+    double cost = (now - p->woke) * p->to_ms;
+    p->frame_ms = cost > p->frame_ms ? cost : p->frame_ms + (cost - p->frame_ms) * 0.05;
+
+    // The next present is one period on; after a miss or an idle spell, from now
+    Uint64 period = (Uint64)(p->period_ms / p->to_ms);
+    p->deadline = p->deadline + period > now ? p->deadline + period : now + period;
+}
+
+// ──────────────────────────────────────────────── Pixel row kernels ────────────────────────────────────────────────
+// Row converters from the packed formats IMG_Load produces into 32-bit
+// RGBA32/BGRA32 (byte order), used for crop extraction and tile uploads,
+// and the vertical pass of the --scales resampler. The best variant is
+// picked once at startup from the CPU features SDL reports; SDL's generic
+// converter remains the fallback for anything else.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PIXELS_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define PIXELS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PIXELS_TARGET(isa)
+#endif
+#elif defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64)
+#define PIXELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+// 3-byte pixels → 4-byte pixels with alpha 255; `swap` exchanges bytes 0 and 2
+typedef void (*Expand24Fn)(Uint8* dst, const Uint8* src, int n, bool swap);
+// 4-byte pixels → 4-byte pixels; `swap` exchanges bytes 0 and 2, `opaque` forces byte 3 to 255
+typedef void (*Shuffle32Fn)(Uint8* dst, const Uint8* src, int n, bool swap, bool opaque);
+// Edge energy of one luma row in groups of 8 pixels: acc[g] += Σ |cur[i+1] - cur[i]| + |cur[i] - prev[i]|
+// over i in [8g, 8g+8). `cur` must have 8·groups + 1 readable bytes.
+typedef void (*Energy8Fn)(Uint32* acc, const Uint8* cur, const Uint8* prev, int groups);
+// Vertical resampling tap sum: dst[i] = clamp((Σ w[k]·rows[k][i] + 2^13) >> 14, 0, 255) for i < n,
+// over an even number of `taps` with Q14 weights
+typedef void (*VFilterFn)(Uint8* dst, const Uint8* const* rows, const Sint16* w, int taps, int n);
+
+static void expand24_scalar(Uint8* dst, const Uint8* src, int n, bool swap)
+{
+    int r = swap ? 2 : 0, b = swap ? 0 : 2;
+    for (int i = 0; i < n; i++, src += 3, dst += 4) {
+        dst[0] = src[r];
+        dst[1] = src[1];
+        dst[2] = src[b];
+        dst[3] = 255;
+    }
+}
+
+static void shuffle32_scalar(Uint8* dst, const Uint8* src, int n, bool swap, bool opaque)
+{
+    int r = swap ? 2 : 0, b = swap ? 0 : 2;
+    for (int i = 0; i < n; i++, src += 4, dst += 4) {
+        Uint8 a = opaque ? 255 : src[3];
+        dst[0] = src[r];
+        dst[1] = src[1];
+        dst[2] = src[b];
+        dst[3] = a;
+    }
+}
+
+static void energy8_scalar(Uint32* acc, const Uint8* cur, const Uint8* prev, int groups)
+{
+    for (int g = 0; g < groups; g++, cur += 8, prev += 8) {
+        Uint32 s = 0;
+        for (int i = 0; i < 8; i++)
+            s += (Uint32)abs(cur[i + 1] - cur[i]) + (Uint32)abs(cur[i] - prev[i]);
+        acc[g] += s;
+    }
+}
+
+static void vfilter_from(Uint8* dst, const Uint8* const* rows, const Sint16* w, int taps, int i, int n)
+{
+    for (; i < n; i++) {
+        int s = 1 << 13;
+        for (int k = 0; k < taps; k++) s += w[k] * rows[k][i];
+        s >>= 14;
+        dst[i] = (Uint8)(s < 0 ? 0 : s > 255 ? 255 : s);
+    }
+}
+
+static void vfilter_scalar(Uint8* dst, const Uint8* const* rows, const Sint16* w, int taps, int n)
+{
+    vfilter_from(dst, rows, w, taps, 0, n);
+}
+
+#ifdef PIXELS_X86
+
+PIXELS_TARGET("sse4.1")
+static void expand24_sse41(Uint8* dst, const Uint8* src, int n, bool swap)
+{
+    const __m128i mask = swap
+        ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+        : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+
+    int i = 0;
+    // Each 16-byte load covers 4 pixels plus 4 bytes of the next one
+    for (; i + 6 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 3 * i));
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_or_si128(_mm_shuffle_epi8(v, mask), alpha));
+    }
+    expand24_scalar(dst + 4 * i, src + 3 * i, n - i, swap);
+}
+
+PIXELS_TARGET("avx2")
+static void expand24_avx2(Uint8* dst, const Uint8* src, int n, bool swap)
+{
+    const __m256i mask = swap
+        ? _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                           2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+        : _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                           0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000u);
+
+    int i = 0;
+    // Two 12-byte groups, one per 128-bit lane (pshufb does not cross lanes)
+    for (; i + 10 <= n; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(src + 3 * i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(src + 3 * i + 12));
+        __m256i v  = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i*)(dst + 4 * i), _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha));
+    }
+    expand24_scalar(dst + 4 * i, src + 3 * i, n - i, swap);
+}
+
+PIXELS_TARGET("sse2")
+static void shuffle32_sse2(Uint8* dst, const Uint8* src, int n, bool swap, bool opaque)
+{
+    const __m128i ga    = _mm_set1_epi32((int)0xFF00FF00u);
+    const __m128i rb    = _mm_set1_epi32(0x00FF00FF);
+    const __m128i alpha = _mm_set1_epi32(opaque ? (int)0xFF000000u : 0);
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+        if (swap) {
+            __m128i c = _mm_and_si128(v, rb);
+            v = _mm_or_si128(_mm_and_si128(v, ga), _mm_or_si128(_mm_slli_epi32(c, 16), _mm_srli_epi32(c, 16)));
+        }
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_or_si128(v, alpha));
+    }
+    shuffle32_scalar(dst + 4 * i, src + 4 * i, n - i, swap, opaque);
+}
+
+PIXELS_TARGET("avx2")
+static void shuffle32_avx2(Uint8* dst, const Uint8* src, int n, bool swap, bool opaque)
+{
+    const __m256i mask = swap
+        ? _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15)
+        : _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                           0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m256i alpha = _mm256_set1_epi32(opaque ? (int)0xFF000000u : 0);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + 4 * i));
+        _mm256_storeu_si256((__m256i*)(dst + 4 * i), _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha));
+    }
+    shuffle32_scalar(dst + 4 * i, src + 4 * i, n - i, swap, opaque);
+}
+
+// psadbw sums |a - b| over each 8-byte half, which is exactly one group
+PIXELS_TARGET("sse2")
+static void energy8_sse2(Uint32* acc, const Uint8* cur, const Uint8* prev, int groups)
+{
+    int g = 0;
+    for (; g + 2 <= groups; g += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(cur + 8 * g));
+        __m128i b = _mm_loadu_si128((const __m128i*)(cur + 8 * g + 1));
+        __m128i p = _mm_loadu_si128((const __m128i*)(prev + 8 * g));
+        __m128i s = _mm_add_epi64(_mm_sad_epu8(a, b), _mm_sad_epu8(a, p));
+        acc[g]     += (Uint32)_mm_cvtsi128_si32(s);
+        acc[g + 1] += (Uint32)_mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+    }
+    energy8_scalar(acc + g, cur + 8 * g, prev + 8 * g, groups - g);
+}
+
+PIXELS_TARGET("avx2")
+static void energy8_avx2(Uint32* acc, const Uint8* cur, const Uint8* prev, int groups)
+{
+    int g = 0;
+    for (; g + 4 <= groups; g += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(cur + 8 * g));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(cur + 8 * g + 1));
+        __m256i p = _mm256_loadu_si256((const __m256i*)(prev + 8 * g));
+        __m256i s = _mm256_add_epi64(_mm256_sad_epu8(a, b), _mm256_sad_epu8(a, p));
+        // the four 64-bit sums are below 2^16; gather their low dwords
+        __m128i lo = _mm256_castsi256_si128(s), hi = _mm256_extracti128_si256(s, 1);
+        __m128i packed = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0)),
+                                            _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0)));
+        __m128i* out = (__m128i*)(acc + g);
+        _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), packed));
+    }
+    energy8_scalar(acc + g, cur + 8 * g, prev + 8 * g, groups - g);
+}
+
+// pmaddwd on interleaved byte pairs of two rows applies two taps per multiply
+PIXELS_TARGET("sse2")
+static void vfilter_sse2(Uint8* dst, const Uint8* const* rows, const Sint16* w, int taps, int n)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << 13);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = round, hi = round;
+        for (int k = 0; k < taps; k += 2) {
+            __m128i a  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k] + i)), zero);
+            __m128i b  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k + 1] + i)), zero);
+            __m128i wk = _mm_set1_epi32((int)((Uint32)(Uint16)w[k] | (Uint32)(Uint16)w[k + 1] << 16));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+        }
+        __m128i v = _mm_packs_epi32(_mm_srai_epi32(lo, 14), _mm_srai_epi32(hi, 14));
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(v, zero));
+    }
+    vfilter_from(dst, rows, w, taps, i, n);
+}
+
+PIXELS_TARGET("avx2")
+static void vfilter_avx2(Uint8* dst, const Uint8* const* rows, const Sint16* w, int taps, int n)
+{
+    const __m256i round = _mm256_set1_epi32(1 << 13);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = round, hi = round;
+        for (int k = 0; k < taps; k += 2) {
+            __m256i a  = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[k] + i)));
+            __m256i b  = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[k + 1] + i)));
+            __m256i wk = _mm256_set1_epi32((int)((Uint32)(Uint16)w[k] | (Uint32)(Uint16)w[k + 1] << 16));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wk));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wk));
+        }
+        // unpack and pack both stay within lanes, so the pixel order comes back
+        // out as bytes 0-7 | 8-15 in the low quadword of each lane
+        __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(lo, 14), _mm256_srai_epi32(hi, 14));
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, _mm256_setzero_si256()), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(v));
+    }
+    vfilter_from(dst, rows, w, taps, i, n);
+}
+
+#endif // PIXELS_X86
+
+#ifdef PIXELS_NEON
+
+static void expand24_neon(Uint8* dst, const Uint8* src, int n, bool swap)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x3_t in = vld3q_u8(src + 3 * i);
+        uint8x16x4_t out;
+        out.val[0] = swap ? in.val[2] : in.val[0];
+        out.val[1] = in.val[1];
+        out.val[2] = swap ? in.val[0] : in.val[2];
+        out.val[3] = vdupq_n_u8(255);
+        vst4q_u8(dst + 4 * i, out);
+    }
+    expand24_scalar(dst + 4 * i, src + 3 * i, n - i, swap);
+}
+
+static void shuffle32_neon(Uint8* dst, const Uint8* src, int n, bool swap, bool opaque)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t v = vld4q_u8(src + 4 * i);
+        if (swap) {
+            uint8x16_t t = v.val[0];
+            v.val[0] = v.val[2];
+            v.val[2] = t;
+        }
+        if (opaque) v.val[3] = vdupq_n_u8(255);
+        vst4q_u8(dst + 4 * i, v);
+    }
+    shuffle32_scalar(dst + 4 * i, src + 4 * i, n - i, swap, opaque);
+}
+
+static void energy8_neon(Uint32* acc, const Uint8* cur, const Uint8* prev, int groups)
+{
+    int g = 0;
+    for (; g + 2 <= groups; g += 2) {
+        uint8x16_t a = vld1q_u8(cur + 8 * g);
+        uint8x16_t b = vld1q_u8(cur + 8 * g + 1);
+        uint8x16_t p = vld1q_u8(prev + 8 * g);
+        uint16x8_t s = vaddq_u16(vpaddlq_u8(vabdq_u8(a, b)), vpaddlq_u8(vabdq_u8(a, p)));
+        uint64x2_t t = vpaddlq_u32(vpaddlq_u16(s));
+        acc[g]     += (Uint32)vgetq_lane_u64(t, 0);
+        acc[g + 1] += (Uint32)vgetq_lane_u64(t, 1);
+    }
+    energy8_scalar(acc + g, cur + 8 * g, prev + 8 * g, groups - g);
+}
+
+static void vfilter_neon(Uint8* dst, const Uint8* const* rows, const Sint16* w, int taps, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int32x4_t lo = vdupq_n_s32(1 << 13), hi = lo;
+        for (int k = 0; k < taps; k++) {
+            int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + i)));
+            lo = vmlal_n_s16(lo, vget_low_s16(v), w[k]);
+            hi = vmlal_n_s16(hi, vget_high_s16(v), w[k]);
+        }
+        vst1_u8(dst + i, vqmovun_s16(vcombine_s16(vshrn_n_s32(lo, 14), vshrn_n_s32(hi, 14))));
+    }
+    vfilter_from(dst, rows, w, taps, i, n);
+}
+
+#endif // PIXELS_NEON
+
+static struct {
+    Expand24Fn  expand24;
+    Shuffle32Fn shuffle32;
+    Energy8Fn   energy8;
+    VFilterFn   vfilter;
+    const char* isa;
+} pixel_kernels = { expand24_scalar, shuffle32_scalar, energy8_scalar, vfilter_scalar, "scalar" };
+
+// Call once before any worker thread starts
+static void pixel_kernels_init(void)
+{
+#ifdef PIXELS_X86
+    if (SDL_HasSSE2()) {
+        pixel_kernels.shuffle32 = shuffle32_sse2;
+        pixel_kernels.energy8   = energy8_sse2;
+        pixel_kernels.vfilter   = vfilter_sse2;
+        pixel_kernels.isa = "sse2";
+    }
+    if (SDL_HasSSE41()) {
+        pixel_kernels.expand24 = expand24_sse41;
+        pixel_kernels.isa = "sse4.1";
+    }
+    if (SDL_HasAVX2()) {
+        pixel_kernels.expand24  = expand24_avx2;
+        pixel_kernels.shuffle32 = shuffle32_avx2;
+        pixel_kernels.energy8   = energy8_avx2;
+        pixel_kernels.vfilter   = vfilter_avx2;
+        pixel_kernels.isa = "avx2";
+    }
+#elif defined(PIXELS_NEON)
+    if (SDL_HasNEON()) {
+        pixel_kernels.expand24  = expand24_neon;
+        pixel_kernels.shuffle32 = shuffle32_neon;
+        pixel_kernels.energy8   = energy8_neon;
+        pixel_kernels.vfilter   = vfilter_neon;
+        pixel_kernels.isa = "neon";
+    }
+#endif
+}
+
+// Byte layout of a packed format: channel order and whether byte 3 is alpha
+typedef struct {
+    int  bpp;                   // 3 or 4
+    bool bgr;                   // bytes 0..2 are B,G,R rather than R,G,B
+    bool alpha;                 // byte 3 carries alpha (4-byte formats)
+} ByteLayout;
+
+static bool byte_layout(Uint32 format, ByteLayout* out)
+{
+    switch (format) {
+        case SDL_PIXELFORMAT_RGB24:  *out = (ByteLayout){3, false, false}; return true;
+        case SDL_PIXELFORMAT_BGR24:  *out = (ByteLayout){3, true,  false}; return true;
+        case SDL_PIXELFORMAT_RGBA32: *out = (ByteLayout){4, false, true};  return true;
+        case SDL_PIXELFORMAT_BGRA32: *out = (ByteLayout){4, true,  true};  return true;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+        case SDL_PIXELFORMAT_XBGR8888: *out = (ByteLayout){4, false, false}; return true;
+        case SDL_PIXELFORMAT_XRGB8888: *out = (ByteLayout){4, true,  false}; return true;
+#endif
+    }
+    return false;
+}
+
+// Converts a w×h pixel block into RGBA32 or BGRA32 (`dst_format`). Returns
+// false, leaving `dst` untouched, when no kernel covers the pair.
+static bool pixels_convert(int w, int h, Uint32 src_format, const void* src, int src_pitch,
+                           Uint32 dst_format, void* dst, int dst_pitch)
+{
+    ByteLayout in;
+    if (!byte_layout(src_format, &in)) return false;
+    if (dst_format != SDL_PIXELFORMAT_RGBA32 && dst_format != SDL_PIXELFORMAT_BGRA32) return false;
+
+    bool swap = in.bgr != (dst_format == SDL_PIXELFORMAT_BGRA32);
+    const Uint8* s = src;
+    Uint8* d = dst;
+
+    for (int y = 0; y < h; y++, s += src_pitch, d += dst_pitch)
+    {
+        if (in.bpp == 3)
+            pixel_kernels.expand24(d, s, w, swap);
+        else if (!swap && in.alpha)
+            memcpy(d, s, (size_t)w * 4);
+        else
+            pixel_kernels.shuffle32(d, s, w, swap, !in.alpha);
+    }
+    return true;
+}
+
+// ──────────────────────────────────────────────── Scratch memory ────────────────────────────────────────────────
+// Saving must not cost a malloc/free per crop. Each save worker owns an
+// Arena: crops it extracts and its encoder scratch bump-allocate from one
+// block, everything is released at once after the job, and the block grows
+// to the largest job seen so it stops allocating after the first few
+// crops; after a run of much smaller jobs it shrinks back to what they
+// used. Snapshots taken on the UI thread outlive the call, so they come
+// from a shared PixelPool that keeps a few freed blocks for reuse, best fit
+// first, up to POOL_MAX_BYTES in total.
+
+#define ARENA_ALIGN         64
+#define ARENA_TRIM_RESETS   16                  // resets under a quarter of the block before it shrinks
+#define POOL_MAX_FREE       16
+#define POOL_MAX_BYTES     ((size_t)256 << 20)  // freed snapshot memory kept for reuse
+
+typedef struct {
+    Uint8* base;
+    size_t cap, used;
+    size_t want;            // bytes asked for since the last reset, spills included
+    Uint8* spill;           // allocations that did not fit, chained, freed on reset
+    size_t peak;            // largest `want` of the current run of small resets
+    int    small;           // length of that run
+} Arena;
+
+static void* arena_alloc(Arena* a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->want += size;
+    if (a->used + size <= a->cap) {
+        void* p = a->base + a->used;
+        a->used += size;
+        return p;
+    }
+    // Too big for this job; the next reset grows the block to fit
+    Uint8* p = malloc(ARENA_ALIGN + size);
+    if (!p) return NULL;
+    memcpy(p, &a->spill, sizeof(a->spill));
+    a->spill = p;
+    return p + ARENA_ALIGN;
+}
+
+static void arena_reset(Arena* a)
+{
+    while (a->spill) {
+        Uint8* next;
+        memcpy(&next, a->spill, sizeof(next));
+        free(a->spill);
+        a->spill = next;
+    }
+    size_t fit = 0;
+    if (a->want > a->cap) {
+        fit = a->want;
+    } else if (a->want < a->cap / 4) {
+        a->peak = SDL_max(a->peak, a->want);
+        if (++a->small >= ARENA_TRIM_RESETS) fit = SDL_max(a->peak, 1);
+    } else {
+        a->peak  = 0;
+        a->small = 0;
+    }
+    if (fit) {
+        free(a->base);
+        a->base  = malloc(fit);
+        a->cap   = a->base ? fit : 0;
+        a->peak  = 0;
+        a->small = 0;
+    }
+    a->used = a->want = 0;
+}
+
+static void arena_free(Arena* a)
+{
+    arena_reset(a);
+    free(a->base);
+    memset(a, 0, sizeof(*a));
+}
+
+typedef struct {
+    void*  mem;
+    size_t size;
+} PoolBlock;
+
+typedef struct {
+    SDL_mutex* lock;
+    PoolBlock  free[POOL_MAX_FREE];
+    int        nfree;
+    size_t     retained;    // bytes in `free`
+} PixelPool;
+
+// Returns a block of at least `size` bytes and its actual size in `*block`:
+// the smallest free one that fits, or a new one of exactly `size`
+static void* pixel_pool_get(PixelPool* p, size_t size, size_t* block)
+{
+    size = SDL_max(size, 1);
+    void* mem = NULL;
+    SDL_LockMutex(p->lock);
+    int best = -1;
+    for (int i = 0; i < p->nfree; i++)
+        if (p->free[i].size >= size && (best < 0 || p->free[i].size < p->free[best].size))
+            best = i;
+    if (best >= 0) {
+        mem   = p->free[best].mem;
+        size  = p->free[best].size;
+        p->retained -= size;
+        p->free[best] = p->free[--p->nfree];
+    }
+    SDL_UnlockMutex(p->lock);
+    *block = size;
+    return mem ? mem : malloc(size);
+}
+
+static void pixel_pool_put(PixelPool* p, void* mem, size_t block)
+{
+    SDL_LockMutex(p->lock);
+    if (p->nfree < POOL_MAX_FREE && p->retained + block <= POOL_MAX_BYTES) {
+        p->free[p->nfree++] = (PoolBlock){ mem, block };
+        p->retained += block;
+        mem = NULL;
+    }
+    SDL_UnlockMutex(p->lock);
+    free(mem);
+}
+
+static void pixel_pool_shutdown(PixelPool* p)
+{
+    while (p->nfree > 0) free(p->free[--p->nfree].mem);
+    if (p->lock) SDL_DestroyMutex(p->lock);
+    memset(p, 0, sizeof(*p));
+}
+
+// ──────────────────────────────────────────────── Crop encoders ────────────────────────────────────────────────
+// Encoders turn an extracted crop into file bytes in memory; the save
+// workers then write the buffer out. "png" is a direct zlib encoder whose
+// compression level and row filter come from a profile, from a stored-only
+// "realtime" mode (not much slower than memcpy) up to "max"; "sdl" keeps
+// IMG_SavePNG for comparison. Crops arrive as 8-bit gray (INDEX8 with a gray
+// ramp), RGB24 or RGBA32, whichever crop_format() picked for the source.
+
+typedef struct {
+    Uint8* data;
+    size_t len, cap;
+} ByteBuf;
+
+static bool bytebuf_reserve(ByteBuf* b, size_t extra)
+{
+    if (b->len + extra <= b->cap) return true;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    Uint8* grown = realloc(b->data, cap);
+    if (!grown) return false;
+    b->data = grown;
+    b->cap  = cap;
+    return true;
+}
+
+static bool bytebuf_append(ByteBuf* b, const void* data, size_t len)
+{
+    if (!bytebuf_reserve(b, len)) return false;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return true;
+}
+
+static void bytebuf_free(ByteBuf* b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+static void put_be32(Uint8* p, Uint32 v)
+{
+    p[0] = (Uint8)(v >> 24); p[1] = (Uint8)(v >> 16); p[2] = (Uint8)(v >> 8); p[3] = (Uint8)v;
+}
+
+#define SCALES_MAX 8
+
+enum {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVG,
+    PNG_FILTER_PAETH,
+    PNG_FILTER_ADAPTIVE         // per row, the filter with the smallest sum of |residual|
+};
+
+typedef struct {
+    const char* encoder;        // name in `encoders`
+    const char* shard_prefix;   // append to tar shards instead of writing files
+    Uint64      shard_limit;    // bytes per shard
+    int         png_level;      // zlib level, 0 = stored blocks only
+    int         png_strategy;   // zlib strategy
+    int         png_filter;     // PNG_FILTER_*
+    int         dedup;          // DEDUP_*: what to do with near-duplicate crops
+    int         dedup_distance; // max Hamming distance between dHashes that counts as a duplicate
+    int         scales[SCALES_MAX]; // --scales: longest side of each variant, 0 = the crop as cut
+    int         nscales;            // 0 = just the crop as cut
+} EncodeOptions;
+
+static const struct {
+    const char* name;
+    int         level, strategy, filter;
+} png_profiles[] = {
+    { "realtime", 0, Z_DEFAULT_STRATEGY, PNG_FILTER_NONE     },
+    { "fast",     1, Z_RLE,              PNG_FILTER_UP       },
+    { "default",  6, Z_DEFAULT_STRATEGY, PNG_FILTER_ADAPTIVE },
+    { "max",      9, Z_FILTERED,         PNG_FILTER_ADAPTIVE },
+};
+
+static const char* const png_filter_names[] = { "none", "sub", "up", "avg", "paeth", "adaptive" };
+
+static bool encode_options_set_profile(EncodeOptions* opt, const char* name)
+{
+    for (size_t i = 0; i < SDL_arraysize(png_profiles); i++)
+        if (strcmp(name, png_profiles[i].name) == 0) {
+            opt->png_level    = png_profiles[i].level;
+            opt->png_strategy = png_profiles[i].strategy;
+            opt->png_filter   = png_profiles[i].filter;
+            return true;
+        }
+    return false;
+}
+
+static bool encode_options_set_filter(EncodeOptions* opt, const char* name)
+{
+    for (int i = 0; i < (int)SDL_arraysize(png_filter_names); i++)
+        if (strcmp(name, png_filter_names[i]) == 0) {
+            opt->png_filter = i;
+            return true;
+        }
+    return false;
+}
+
+// "256,512,native": longest side of every variant saved per crop
+static bool encode_options_set_scales(EncodeOptions* opt, const char* list)
+{
+    opt->nscales = 0;
+    for (const char* p = list; *p; )
+    {
+        const char* end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        char* stop;
+        long v = strtol(p, &stop, 10);
+        if (len == 6 && strncmp(p, "native", 6) == 0) v = 0;
+        else if (stop != p + len || v < 1 || v > 65535) return false;
+        if (opt->nscales == SCALES_MAX) return false;
+        opt->scales[opt->nscales++] = (int)v;
+        p += len + (end != NULL);
+    }
+    return opt->nscales > 0;
+}
+
+static Uint8 paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (Uint8)a;
+    return (Uint8)(pb <= pc ? b : c);
+}
+
+// Writes filter byte + residuals of `row` into `out`; `prev` is NULL on the first row
+static void png_filter_row(Uint8* out, int filter, const Uint8* row, const Uint8* prev, int len, int bpp)
+{
+    out[0] = (Uint8)filter;
+    Uint8* o = out + 1;
+    switch (filter)
+    {
+        case PNG_FILTER_NONE:
+            memcpy(o, row, len);
+            break;
+        case PNG_FILTER_SUB:
+            for (int i = 0; i < bpp; i++) o[i] = row[i];
+            for (int i = bpp; i < len; i++) o[i] = (Uint8)(row[i] - row[i - bpp]);
+            break;
+        case PNG_FILTER_UP:
+            for (int i = 0; i < len; i++) o[i] = (Uint8)(row[i] - (prev ? prev[i] : 0));
+            break;
+        case PNG_FILTER_AVG:
+            for (int i = 0; i < len; i++) {
+                int a = i >= bpp ? row[i - bpp] : 0, b = prev ? prev[i] : 0;
+                o[i] = (Uint8)(row[i] - ((a + b) >> 1));
+            }
+            break;
+        case PNG_FILTER_PAETH:
+            for (int i = 0; i < len; i++) {
+                int a = i >= bpp ? row[i - bpp] : 0, b = prev ? prev[i] : 0;
+                int c = (i >= bpp && prev) ? prev[i - bpp] : 0;
+                o[i] = (Uint8)(row[i] - paeth(a, b, c));
+            }
+            break;
+    }
+}
+
+static Uint64 png_residual_cost(const Uint8* filtered, int len)
+{
+    Uint64 sum = 0;
+    for (int i = 1; i <= len; i++) sum += (Uint64)abs((Sint8)filtered[i]);
+    return sum;
+}
+
+// Appends `len` bytes to the zlib stream, either through deflate or as
+// stored blocks (realtime profile: no LZ77 search at all)
+static bool png_deflate(z_stream* zs, ByteBuf* out, const Uint8* data, size_t len, bool last, Uint32* adler)
+{
+    if (!zs) {
+        *adler = adler32(*adler, data, (uInt)len);
+        do {
+            size_t n = len < 65535 ? len : 65535;
+            if (!bytebuf_reserve(out, n + 5)) return false;
+            Uint8* p = out->data + out->len;
+            p[0] = (last && n == len) ? 1 : 0;
+            p[1] = (Uint8)n; p[2] = (Uint8)(n >> 8);
+            p[3] = (Uint8)~n; p[4] = (Uint8)(~n >> 8);
+            memcpy(p + 5, data, n);
+            out->len += n + 5;
+            data += n;
+            len  -= n;
+        } while (len > 0);
+        return true;
+    }
+
+    zs->next_in  = (Bytef*)data;
+    zs->avail_in = (uInt)len;
+    for (;;) {
+        if (!bytebuf_reserve(out, 64 * 1024)) return false;
+        zs->next_out  = out->data + out->len;
+        zs->avail_out = (uInt)(out->cap - out->len);
+        int rc = deflate(zs, last ? Z_FINISH : Z_NO_FLUSH);
+        out->len = out->cap - zs->avail_out;
+        if (rc == Z_STREAM_END) return true;
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return false;
+        if (!last && zs->avail_in == 0 && zs->avail_out > 0) return true;
+    }
+}
+
+static void png_chunk(ByteBuf* out, const char* type, const Uint8* data, Uint32 len)
+{
+    Uint8 hdr[8];
+    put_be32(hdr, len);
+    memcpy(hdr + 4, type, 4);
+    bytebuf_append(out, hdr, 8);
+    if (len) bytebuf_append(out, data, len);
+    Uint32 crc = crc32(0, (const Bytef*)type, 4);
+    if (len) crc = crc32(crc, data, len);   // crc32(crc, NULL, 0) would reset it
+    Uint8 c[4];
+    put_be32(c, crc);
+    bytebuf_append(out, c, 4);
+}
+
+// Crop surface → 8-bit PNG (gray, RGB or RGBA to match), a single IDAT
+// deflated in place
+static bool encode_png(SDL_Surface* px, const EncodeOptions* opt, Arena* scratch, ByteBuf* out)
+{
+    const int bpp = px->format->BytesPerPixel;
+    static const Uint8 color_type[5] = { 0, 0, 0, 2, 6 };
+    int rowlen = px->w * bpp;
+    int ncand = opt->png_filter == PNG_FILTER_ADAPTIVE ? 5 : 1;
+    Uint8* rows = arena_alloc(scratch, (size_t)ncand * (rowlen + 1));
+    if (!rows) return false;
+
+    static const Uint8 sig[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    Uint8 ihdr[13];
+    put_be32(ihdr, (Uint32)px->w);
+    put_be32(ihdr + 4, (Uint32)px->h);
+    ihdr[8] = 8; ihdr[9] = color_type[bpp]; ihdr[10] = 0; ihdr[11] = 0; ihdr[12] = 0;
+    bytebuf_append(out, sig, 8);
+    png_chunk(out, "IHDR", ihdr, 13);
+
+    // IDAT header now, length and CRC patched once the stream is complete
+    size_t idat = out->len;
+    bool ok = bytebuf_append(out, "\0\0\0\0IDAT", 8);
+
+    z_stream zs_store;
+    z_stream* zs = NULL;
+    Uint32 adler = 1;
+    if (opt->png_level > 0) {
+        memset(&zs_store, 0, sizeof(zs_store));
+        ok = ok && deflateInit2(&zs_store, opt->png_level, Z_DEFLATED, 15, 8, opt->png_strategy) == Z_OK;
+        if (ok) zs = &zs_store;
+    } else {
+        ok = ok && bytebuf_append(out, "\x78\x01", 2);
+    }
+
+    const Uint8* prev = NULL;
+    for (int y = 0; ok && y < px->h; y++)
+    {
+        const Uint8* row = (const Uint8*)px->pixels + (size_t)y * px->pitch;
+        Uint8* best = rows;
+        if (ncand == 1) {
+            png_filter_row(rows, opt->png_filter, row, prev, rowlen, bpp);
+        } else {
+            Uint64 best_cost = UINT64_MAX;
+            for (int f = 0; f < 5; f++) {
+                Uint8* cand = rows + (size_t)f * (rowlen + 1);
+                png_filter_row(cand, f, row, prev, rowlen, bpp);
+                Uint64 cost = png_residual_cost(cand, rowlen);
+                if (cost < best_cost) { best_cost = cost; best = cand; }
+            }
+        }
+        ok = png_deflate(zs, out, best, rowlen + 1, y == px->h - 1, &adler);
+        prev = row;
+    }
+
+    if (zs) {
+        deflateEnd(zs);
+    } else if (ok) {
+        Uint8 a[4];
+        put_be32(a, adler);
+        ok = bytebuf_append(out, a, 4);
+    }
+    if (!ok) return false;
+
+    Uint32 len = (Uint32)(out->len - idat - 8);
+    put_be32(out->data + idat, len);
+    Uint8 c[4];
+    put_be32(c, crc32(0, out->data + idat + 4, len + 4));
+    bytebuf_append(out, c, 4);
+    png_chunk(out, "IEND", NULL, 0);
+    return out->len > idat;
+}
+
+// IMG_SavePNG through an RWops that appends to a ByteBuf
+static size_t SDLCALL bytebuf_rw_write(SDL_RWops* rw, const void* data, size_t size, size_t num)
+{
+    return bytebuf_append(rw->hidden.unknown.data1, data, size * num) ? num : 0;
+}
+
+static Sint64 SDLCALL bytebuf_rw_seek(SDL_RWops* rw, Sint64 offset, int whence)
+{
+    ByteBuf* b = rw->hidden.unknown.data1;
+    return (whence == RW_SEEK_CUR && offset == 0) ? (Sint64)b->len : -1;
+}
+
+static bool encode_png_sdl(SDL_Surface* px, const EncodeOptions* opt, Arena* scratch, ByteBuf* out)
+{
+    (void)opt;
+    (void)scratch;
+    SDL_RWops* rw = SDL_AllocRW();
+    if (!rw) return false;
+    rw->write = bytebuf_rw_write;
+    rw->seek  = bytebuf_rw_seek;
+    rw->hidden.unknown.data1 = out;
+    bool ok = IMG_SavePNG_RW(px, rw, 0) == 0;
+    SDL_FreeRW(rw);
+    return ok;
+}
+
+// QOI (qoiformat.org): lossless, single pass, several times faster than
+// deflate. Decoders are a few hundred lines, so loaders can skip libpng too.
+// QOI has no gray mode, so gray crops are written as RGB.
+static bool encode_qoi(SDL_Surface* px, const EncodeOptions* opt, Arena* scratch, ByteBuf* out)
+{
+    (void)opt;
+    (void)scratch;
+    int bpp = px->format->BytesPerPixel;
+    size_t npx = (size_t)px->w * px->h;
+    // Worst case is one 5-byte QOI_OP_RGBA per pixel
+    if (!bytebuf_reserve(out, 14 + npx * 5 + 8)) return false;
+    Uint8* p = out->data + out->len;
+
+    memcpy(p, "qoif", 4);
+    put_be32(p + 4, (Uint32)px->w);
+    put_be32(p + 8, (Uint32)px->h);
+    p[12] = bpp == 4 ? 4 : 3;
+    p[13] = 0;      // sRGB with linear alpha
+    p += 14;
+
+    Uint8 index[64][4];
+    memset(index, 0, sizeof(index));
+    Uint8 prev[4] = {0, 0, 0, 255};
+    int run = 0;
+
+    for (int y = 0; y < px->h; y++)
+    {
+        const Uint8* row = (const Uint8*)px->pixels + (size_t)y * px->pitch;
+        for (int x = 0; x < px->w; x++)
+        {
+            Uint8 c[4] = { 0, 0, 0, 255 };
+            const Uint8* in = row + x * bpp;
+            if (bpp == 1) c[0] = c[1] = c[2] = in[0];
+            else          memcpy(c, in, bpp);
+            if (memcmp(c, prev, 4) == 0) {
+                if (++run == 62) { *p++ = 0xc0 | (run - 1); run = 0; }
+                continue;
+            }
+            if (run > 0) { *p++ = 0xc0 | (run - 1); run = 0; }
+
+            int h = (c[0] * 3 + c[1] * 5 + c[2] * 7 + c[3] * 11) % 64;
+            if (memcmp(index[h], c, 4) == 0) {
+                *p++ = (Uint8)h;
+            } else {
+                memcpy(index[h], c, 4);
+                if (c[3] == prev[3]) {
+                    Sint8 dr = (Sint8)(c[0] - prev[0]);
+                    Sint8 dg = (Sint8)(c[1] - prev[1]);
+                    Sint8 db = (Sint8)(c[2] - prev[2]);
+                    Sint8 dr_dg = (Sint8)(dr - dg), db_dg = (Sint8)(db - dg);
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                        *p++ = (Uint8)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                    } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                        *p++ = (Uint8)(0x80 | (dg + 32));
+                        *p++ = (Uint8)((dr_dg + 8) << 4 | (db_dg + 8));
+                    } else {
+                        *p++ = 0xfe;
+                        memcpy(p, c, 3);
+                        p += 3;
+                    }
+                } else {
+                    *p++ = 0xff;
+                    memcpy(p, c, 4);
+                    p += 4;
+                }
+            }
+            memcpy(prev, c, 4);
+        }
+    }
+    if (run > 0) *p++ = 0xc0 | (run - 1);
+    static const Uint8 end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    memcpy(p, end, 8);
+    p += 8;
+
+    out->len = (size_t)(p - out->data);
+    return true;
+}
+
+// NumPy .npy v1.0, uint8 in HWC (H, W, C) or CHW (C, H, W) order with the
+// crop's channels (C = 1 gray, 3 RGB, 4 RGBA); np.load() / np.memmap() read
+// it without any image decoder.
+static bool encode_npy(SDL_Surface* px, bool chw, ByteBuf* out)
+{
+    int nc = px->format->BytesPerPixel;
+    char header[128];
+    int hlen = chw ? snprintf(header, sizeof(header), "{'descr': '|u1', 'fortran_order': False, 'shape': (%d, %d, %d), }", nc, px->h, px->w)
+                   : snprintf(header, sizeof(header), "{'descr': '|u1', 'fortran_order': False, 'shape': (%d, %d, %d), }", px->h, px->w, nc);
+    // Pad with spaces so the data starts 64-byte aligned, newline-terminated
+    int total = (10 + hlen + 1 + 63) & ~63;
+    memset(header + hlen, ' ', total - 10 - hlen - 1);
+    header[total - 10 - 1] = '\n';
+    hlen = total - 10;
+
+    size_t plane = (size_t)px->w * px->h;
+    if (!bytebuf_reserve(out, (size_t)total + plane * nc)) return false;
+    Uint8* p = out->data + out->len;
+    memcpy(p, "\x93NUMPY\x01\x00", 8);
+    p[8] = (Uint8)hlen;
+    p[9] = (Uint8)(hlen >> 8);
+    memcpy(p + 10, header, hlen);
+    p += total;
+
+    for (int y = 0; y < px->h; y++)
+    {
+        const Uint8* row = (const Uint8*)px->pixels + (size_t)y * px->pitch;
+        if (!chw || nc == 1) {
+            memcpy(p + (size_t)y * px->w * nc, row, (size_t)px->w * nc);
+            continue;
+        }
+        Uint8* r = p + (size_t)y * px->w;
+        for (int x = 0; x < px->w; x++)
+            for (int c = 0; c < nc; c++)
+                r[x + plane * c] = row[x * nc + c];
+    }
+    out->len += (size_t)total + plane * nc;
+    return true;
+}
+
+static bool encode_npy_hwc(SDL_Surface* px, const EncodeOptions* opt, Arena* scratch, ByteBuf* out)
+{
+    (void)opt;
+    (void)scratch;
+    return encode_npy(px, false, out);
+}
+
+static bool encode_npy_chw(SDL_Surface* px, const EncodeOptions* opt, Arena* scratch, ByteBuf* out)
+{
+    (void)opt;
+    (void)scratch;
+    return encode_npy(px, true, out);
+}
+
+#ifdef HAVE_WEBP
+// WebP has no gray input, so gray crops are expanded to RGB here
+static bool encode_webp(SDL_Surface* px, const EncodeOptions* opt, Arena* scratch, ByteBuf* out)
+{
+    (void)opt;
+    uint8_t* data = NULL;
+    size_t size = 0;
+    if (px->format->BytesPerPixel == 4) {
+        size = WebPEncodeLosslessRGBA(px->pixels, px->w, px->h, px->pitch, &data);
+    } else if (px->format->BytesPerPixel == 3) {
+        size = WebPEncodeLosslessRGB(px->pixels, px->w, px->h, px->pitch, &data);
+    } else {
+        Uint8* rgb = arena_alloc(scratch, (size_t)px->w * px->h * 3);
+        if (!rgb) return false;
+        for (int y = 0; y < px->h; y++) {
+            const Uint8* row = (const Uint8*)px->pixels + (size_t)y * px->pitch;
+            Uint8* o = rgb + (size_t)y * px->w * 3;
+            for (int x = 0; x < px->w; x++) o[3 * x] = o[3 * x + 1] = o[3 * x + 2] = row[x];
+        }
+        size = WebPEncodeLosslessRGB(rgb, px->w, px->h, px->w * 3, &data);
+    }
+    bool ok = size > 0 && bytebuf_append(out, data, size);
+    WebPFree(data);
+    return ok;
+}
+#endif
+
+// `scratch` is the caller's arena for temporary buffers; it is reset after the crop
+typedef bool (*EncodeFn)(SDL_Surface* pixels, const EncodeOptions* opt, Arena* scratch, ByteBuf* out);
+
+static const struct {
+    const char* name;
+    const char* ext;            // appended to generated filenames
+    EncodeFn    encode;
+} encoders[] = {
+    { "png",     ".png",  encode_png     },
+    { "sdl",     ".png",  encode_png_sdl },
+    { "qoi",     ".qoi",  encode_qoi     },
+    { "npy",     ".npy",  encode_npy_hwc },
+    { "npy-chw", ".npy",  encode_npy_chw },
+#ifdef HAVE_WEBP
+    { "webp",    ".webp", encode_webp    },
+#endif
+};
+
+static int encoder_index(const char* name)
+{
+    for (int i = 0; i < (int)SDL_arraysize(encoders); i++)
+        if (strcmp(name, encoders[i].name) == 0) return i;
+    return -1;
+}
+
+static EncodeFn encoder_find(const char* name)
+{
+    int i = encoder_index(name);
+    return i >= 0 ? encoders[i].encode : NULL;
+}
+
+static const char* encoder_ext(const char* name)
+{
+    int i = encoder_index(name);
+    return i >= 0 ? encoders[i].ext : "";
+}
+
+static bool write_file(const char* filename, const ByteBuf* buf)
+{
+    SDL_RWops* rw = SDL_RWFromFile(filename, "wb");
+    if (!rw) return false;
+    bool ok = SDL_RWwrite(rw, buf->data, 1, buf->len) == buf->len;
+    return SDL_RWclose(rw) == 0 && ok;
+}
+
+// ──────────────────────────────────────────────── Shard containers ────────────────────────────────────────────────
+// --shard prefix appends every encoded crop to prefix-000000.tar,
+// prefix-000001.tar, ... (plain ustar, WebDataset-compatible: members are
+// named key.ext) instead of creating one file per crop. Workers encode in
+// parallel; only the append is serialized.
+
+#define SHARD_DEFAULT_MB 1024
+
+typedef struct {
+    SDL_mutex*  lock;
+    const char* prefix;         // NULL = write individual files
+    Uint64      limit;          // start the next shard before passing this size
+    int         index;          // number of the shard being written
+    FILE*       f;
+    Uint64      size;
+} ShardWriter;
+
+static bool shard_init(ShardWriter* sw, const char* prefix, Uint64 limit)
+{
+    memset(sw, 0, sizeof(*sw));
+    sw->prefix = prefix;
+    sw->limit  = limit;
+    sw->index  = -1;
+    if (!prefix) return true;
+    sw->lock = SDL_CreateMutex();
+    return sw->lock != NULL;
+}
+
+// Two zero blocks end a tar archive
+static bool shard_close_current(ShardWriter* sw)
+{
+    if (!sw->f) return true;
+    static const Uint8 zero[1024];
+    bool ok = fwrite(zero, 1, sizeof(zero), sw->f) == sizeof(zero);
+    ok = fclose(sw->f) == 0 && ok;
+    sw->f = NULL;
+    return ok;
+}
+
+// Makes every member appended so far durable without ending the shard; the
+// end-of-archive blocks follow when it rolls over or is shut down
+static bool shard_sync(ShardWriter* sw)
+{
+    SDL_LockMutex(sw->lock);
+    bool ok = !sw->f || fflush(sw->f) == 0;
+#ifndef _WIN32
+    ok = ok && (!sw->f || fsync(fileno(sw->f)) == 0);
+#endif
+    SDL_UnlockMutex(sw->lock);
+    return ok;
+}
+
+static void shard_shutdown(ShardWriter* sw)
+{
+    if (!shard_close_current(sw))
+        fprintf(stderr, "Failed to finish shard %s-%06d.tar\n", sw->prefix, sw->index);
+    if (sw->lock) SDL_DestroyMutex(sw->lock);
+}
+
+// ustar header for a regular file; false if `name` does not fit
+static bool tar_header(Uint8 hdr[512], const char* name, Uint64 size)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > 100) return false;
+
+    memset(hdr, 0, 512);
+    memcpy(hdr, name, len);
+    memcpy(hdr + 100, "0000644", 7);                    // mode
+    memcpy(hdr + 108, "0000000", 7);                    // uid
+    memcpy(hdr + 116, "0000000", 7);                    // gid
+    snprintf((char*)hdr + 124, 12, "%011llo", (unsigned long long)size);
+    snprintf((char*)hdr + 136, 12, "%011llo", (unsigned long long)time(NULL));
+    hdr[156] = '0';                                     // regular file
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    unsigned sum = 8 * ' ';                             // checksum field counts as spaces
+    for (int i = 0; i < 512; i++)
+        if (i < 148 || i >= 156) sum += hdr[i];
+    snprintf((char*)hdr + 148, 8, "%06o", sum);
+    hdr[155] = ' ';
+    return true;
+}
+
+// Appends one member; writes `*shard_index` with the shard it went into
+static bool shard_append(ShardWriter* sw, const char* name, const ByteBuf* data, int* shard_index)
+{
+    Uint8 hdr[512];
+    while (name[0] == '/') name++;                      // archive members are relative
+    if (!tar_header(hdr, name, data->len)) {
+        SDL_SetError("name too long for a tar member");
+        return false;
+    }
+    static const Uint8 zero[512];
+    size_t pad = (512 - data->len % 512) % 512;
+    Uint64 need = 512 + data->len + pad;
+
+    SDL_LockMutex(sw->lock);
+    bool ok = true;
+    if (sw->f && sw->size > 0 && sw->size + need > sw->limit)
+        ok = shard_close_current(sw);
+    if (ok && !sw->f) {
+        char path[600];
+        snprintf(path, sizeof(path), "%s-%06d.tar", sw->prefix, ++sw->index);
+        sw->f    = fopen(path, "wb");
+        sw->size = 0;
+        ok = sw->f != NULL;
+        if (!ok) SDL_SetError("cannot create %s: %s", path, strerror(errno));
+    }
+    if (ok) {
+        ok = fwrite(hdr, 1, 512, sw->f) == 512 &&
+             fwrite(data->data, 1, data->len, sw->f) == data->len &&
+             fwrite(zero, 1, pad, sw->f) == pad;
+        sw->size += need;
+        *shard_index = sw->index;
+    }
+    SDL_UnlockMutex(sw->lock);
+    return ok;
+}
+
+// ──────────────────────────────────────────────── Near-duplicate index ────────────────────────────────────────────────
+// --dedup flag|skip: every snapshot gets a 64-bit difference hash (dHash:
+// luma on a 9×8 box grid, one bit per horizontal neighbour pair) before it
+// is encoded. Crops a pixel or two apart hash within a few bits of each
+// other. The index splits hashes into four 16-bit bands; two hashes at
+// Hamming distance ≤ 3 agree exactly on at least one band, so a lookup only
+// verifies the entries sharing a band bucket instead of every saved crop.
+
+#define DEDUP_BANDS             4
+#define DEDUP_BUCKETS       65536
+#define DEDUP_DEFAULT_DISTANCE  3     // the largest distance the band lookup is exact for
+#define DEDUP_FLAT_LUMA         2     // cell means this close carry no structure to compare
+
+enum { DEDUP_OFF, DEDUP_FLAG, DEDUP_SKIP };
+
+typedef struct {
+    Uint64 hash;
+    char*  name;
+    int    next[DEDUP_BANDS];       // chain within each band's bucket, -1 ends
+} DedupEntry;
+
+typedef struct {
+    SDL_mutex*  lock;
+    int         mode;               // DEDUP_*
+    int         distance;
+    int*        heads;              // DEDUP_BANDS × DEDUP_BUCKETS, -1 = empty
+    DedupEntry* items;
+    int         count, cap;
+} DedupIndex;
+
+static bool dedup_init(DedupIndex* d, int mode, int distance)
+{
+    memset(d, 0, sizeof(*d));
+    d->mode     = mode;
+    d->distance = distance;
+    if (mode == DEDUP_OFF) return true;
+    d->lock  = SDL_CreateMutex();
+    d->heads = malloc((size_t)DEDUP_BANDS * DEDUP_BUCKETS * sizeof(*d->heads));
+    if (!d->lock || !d->heads) return false;
+    memset(d->heads, 0xff, (size_t)DEDUP_BANDS * DEDUP_BUCKETS * sizeof(*d->heads));
+    return true;
+}
+
+static bool dedup_parse_mode(const char* name, int* mode)
+{
+    if (strcmp(name, "flag") == 0) { *mode = DEDUP_FLAG; return true; }
+    if (strcmp(name, "skip") == 0) { *mode = DEDUP_SKIP; return true; }
+    return false;
+}
+
+static void dedup_shutdown(DedupIndex* d)
+{
+    for (int i = 0; i < d->count; i++) free(d->items[i].name);
+    free(d->items);
+    free(d->heads);
+    if (d->lock) SDL_DestroyMutex(d->lock);
+    memset(d, 0, sizeof(*d));
+}
+
+// dHash of a crop surface (gray, RGB24 or RGBA32) at least 9 pixels wide and 8 high.
+// Returns false for a featureless crop: when every cell mean is within
+// DEDUP_FLAT_LUMA of the others the bits are noise (a flat tile of any
+// colour hashes to 0), so such crops are never matched against each other.
+static bool dhash(const SDL_Surface* px, Arena* scratch, Uint64* out)
+{
+    int bpp = px->format->BytesPerPixel;
+    Uint32 sum[8][9] = {{0}};
+    Uint32 area[8][9] = {{0}};
+    int w = px->w, h = px->h;
+    Uint8*  luma = arena_alloc(scratch, (size_t)w);
+    Uint8*  col  = arena_alloc(scratch, (size_t)w);
+    if (!luma || !col) return false;
+    for (int x = 0; x < w; x++) col[x] = (Uint8)(x * 9 / w);
+
+    for (int y = 0; y < h; y++)
+    {
+        const Uint8* p = (const Uint8*)px->pixels + (size_t)y * px->pitch;
+        if (bpp == 1)
+            memcpy(luma, p, (size_t)w);
+        else
+            for (int x = 0; x < w; x++, p += bpp)
+                luma[x] = (Uint8)((77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8);
+        Uint32* row = sum[y * 8 / h];
+        Uint32* n   = area[y * 8 / h];
+        for (int x = 0; x < w; x++) {
+            row[col[x]] += luma[x];
+            n[col[x]]++;
+        }
+    }
+
+    Uint32 lo = 255, hi = 0;
+    for (int r = 0; r < 8; r++)
+        for (int c = 0; c < 9; c++) {
+            Uint32 mean = sum[r][c] / area[r][c];
+            if (mean < lo) lo = mean;
+            if (mean > hi) hi = mean;
+        }
+    if (hi - lo <= DEDUP_FLAT_LUMA) return false;
+
+    // Compare cell means without dividing: a/na < b/nb  ⇔  a·nb < b·na
+    Uint64 hash = 0;
+    for (int r = 0; r < 8; r++)
+        for (int c = 0; c < 8; c++) {
+            Uint64 left  = (Uint64)sum[r][c] * area[r][c + 1];
+            Uint64 right = (Uint64)sum[r][c + 1] * area[r][c];
+            hash = (hash << 1) | (left < right);
+        }
+    *out = hash;
+    return true;
+}
+
+static int hamming64(Uint64 a, Uint64 b)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(a ^ b);
+#else
+    int n = 0;
+    for (Uint64 x = a ^ b; x; x &= x - 1) n++;
+    return n;
+#endif
+}
+
+// Looks `hash` up and, if nothing is within the distance, records it under
+// `name`. Returns the near-duplicate's name (valid until dedup_shutdown) or
+// NULL. Lookup and insert are one step so concurrent workers cannot both
+// admit the same crop.
+static const char* dedup_check(DedupIndex* d, Uint64 hash, const char* name, int* distance)
+{
+    const char* match = NULL;
+    SDL_LockMutex(d->lock);
+
+    int best = d->distance + 1;
+    for (int b = 0; b < DEDUP_BANDS && best > 0; b++)
+    {
+        int key = (int)((hash >> (16 * b)) & 0xffff);
+        for (int i = d->heads[b * DEDUP_BUCKETS + key]; i >= 0; i = d->items[i].next[b]) {
+            int dist = hamming64(hash, d->items[i].hash);
+            if (dist < best) { best = dist; match = d->items[i].name; }
+        }
+    }
+
+    if (!match && d->count == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 256;
+        DedupEntry* grown = realloc(d->items, (size_t)cap * sizeof(*grown));
+        if (grown) { d->items = grown; d->cap = cap; }
+    }
+    if (!match && d->count < d->cap) {
+        DedupEntry* e = &d->items[d->count];
+        e->hash = hash;
+        e->name = SDL_strdup(name);
+        if (e->name) {
+            for (int b = 0; b < DEDUP_BANDS; b++) {
+                int* head = &d->heads[b * DEDUP_BUCKETS + (int)((hash >> (16 * b)) & 0xffff)];
+                e->next[b] = *head;
+                *head = d->count;
+            }
+            d->count++;
+        }
+    }
+
+    SDL_UnlockMutex(d->lock);
+    *distance = best;
+    return match;
+}
+
+// ──────────────────────────────────────────────── Multi-scale export ────────────────────────────────────────────────
+// --scales 256,512,native saves every crop once per listed size (longest
+// side; "native" is the crop as cut) without a second decode. The crop is
+// halved with a 2×2 box filter while the next half is still at least the
+// target, so all sizes share one halving chain, and a separable Lanczos-3
+// pass covers the remaining factor (below 2). The vertical pass runs on
+// the SIMD vfilter kernel; each variant is then encoded as a job of its own.
+
+#define RESAMPLE_LOBES  3
+#define RESAMPLE_LEVELS 24     // halving chain; 2^23 is past any image side
+
+// Pixels in a crop's format (1, 3 or 4 bytes each) with a tight pitch
+typedef struct {
+    Uint8* px;
+    int    w, h, bpp;
+} Plane;
+
+static double lanczos(double x)
+{
+    x = fabs(x);
+    if (x < 1e-8) return 1.0;
+    if (x >= RESAMPLE_LOBES) return 0.0;
+    double px = M_PI * x;
+    return RESAMPLE_LOBES * sin(px) * sin(px / RESAMPLE_LOBES) / (px * px);
+}
+
+// Q14 weights and clamped source indices for scaling `in` samples to
+// `out`, `taps` (even) per output sample; returns taps or 0
+static int resample_weights(int in, int out, Arena* a, int** index, Sint16** weight)
+{
+    double scale = (double)in / out;
+    double stretch = scale > 1 ? scale : 1;     // widen the kernel when shrinking
+    double support = RESAMPLE_LOBES * stretch;
+    int taps = 2 * (int)ceil(support) + 2;
+    double* f = arena_alloc(a, (size_t)taps * sizeof(*f));
+    *index  = arena_alloc(a, (size_t)out * taps * sizeof(**index));
+    *weight = arena_alloc(a, (size_t)out * taps * sizeof(**weight));
+    if (!f || !*index || !*weight) return 0;
+
+    for (int o = 0; o < out; o++)
+    {
+        double center = (o + 0.5) * scale;
+        int first = (int)floor(center - support);
+        double sum = 0;
+        for (int t = 0; t < taps; t++) {
+            f[t] = lanczos((first + t + 0.5 - center) / stretch);
+            sum += f[t];
+        }
+        int* idx = *index + (size_t)o * taps;
+        Sint16* w = *weight + (size_t)o * taps;
+        int total = 0, peak = 0;
+        for (int t = 0; t < taps; t++) {
+            idx[t] = SDL_clamp(first + t, 0, in - 1);
+            w[t] = (Sint16)lround(f[t] / sum * (1 << 14));
+            total += w[t];
+            if (w[t] > w[peak]) peak = t;
+        }
+        w[peak] += (1 << 14) - total;    // rounding must not change the brightness
+    }
+    return taps;
+}
+
+// 2×2 box filter; an odd last row or column is paired with itself
+static bool plane_halve(const Plane* src, Plane* dst, Arena* a)
+{
+    dst->w = (src->w + 1) / 2;
+    dst->h = (src->h + 1) / 2;
+    dst->bpp = src->bpp;
+    dst->px = arena_alloc(a, (size_t)dst->w * dst->h * dst->bpp);
+    if (!dst->px) return false;
+
+    int bpp = src->bpp, pitch = src->w * bpp;
+    for (int y = 0; y < dst->h; y++)
+    {
+        const Uint8* r0 = src->px + (size_t)(2 * y) * pitch;
+        const Uint8* r1 = (2 * y + 1 < src->h) ? r0 + pitch : r0;
+        Uint8* out = dst->px + (size_t)y * dst->w * bpp;
+        for (int x = 0; x < dst->w; x++) {
+            int x0 = 2 * x * bpp;
+            int x1 = (2 * x + 1 < src->w) ? x0 + bpp : x0;
+            for (int c = 0; c < bpp; c++)
+                out[x * bpp + c] = (Uint8)((r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) >> 2);
+        }
+    }
+    return true;
+}
+
+// Separable Lanczos-3 from `src` to a dst_w × dst_h image at `dst` (tight pitch)
+static bool plane_resample(const Plane* src, Uint8* dst, int dst_w, int dst_h, Arena* a)
+{
+    int* xi; Sint16* xw;
+    int* yi; Sint16* yw;
+    int xt = resample_weights(src->w, dst_w, a, &xi, &xw);
+    int yt = resample_weights(src->h, dst_h, a, &yi, &yw);
+    int bpp = src->bpp, rowlen = dst_w * bpp;
+    Uint8* tmp = arena_alloc(a, (size_t)rowlen * src->h);
+    const Uint8** rows = arena_alloc(a, (size_t)SDL_max(yt, 1) * sizeof(*rows));
+    if (!xt || !yt || !tmp || !rows) return false;
+
+    // Horizontal: every source row to the output width
+    for (int y = 0; y < src->h; y++)
+    {
+        const Uint8* in = src->px + (size_t)y * src->w * bpp;
+        Uint8* out = tmp + (size_t)y * rowlen;
+        for (int x = 0; x < dst_w; x++) {
+            const int* idx = xi + (size_t)x * xt;
+            const Sint16* w = xw + (size_t)x * xt;
+            for (int c = 0; c < bpp; c++) {
+                int sum = 1 << 13;
+                for (int t = 0; t < xt; t++) sum += w[t] * in[idx[t] * bpp + c];
+                sum >>= 14;
+                out[x * bpp + c] = (Uint8)(sum < 0 ? 0 : sum > 255 ? 255 : sum);
+            }
+        }
+    }
+
+    // Vertical: whole output rows at once, channels need no special care
+    for (int y = 0; y < dst_h; y++) {
+        for (int t = 0; t < yt; t++) rows[t] = tmp + (size_t)yi[(size_t)y * yt + t] * rowlen;
+        pixel_kernels.vfilter(dst + (size_t)y * rowlen, rows, yw + (size_t)y * yt, yt, rowlen);
+    }
+    return true;
+}
+
+// Size of the variant of a w × h crop whose longest side is `side` (0 = as is)
+static void scale_size(int w, int h, int side, int* out_w, int* out_h)
+{
+    if (side == 0) { *out_w = w; *out_h = h; return; }
+    if (w >= h) {
+        *out_w = side;
+        *out_h = SDL_max(1, (int)lround((double)h * side / w));
+    } else {
+        *out_h = side;
+        *out_w = SDL_max(1, (int)lround((double)w * side / h));
+    }
+}
+
+static bool scales_native(const EncodeOptions* opt)
+{
+    for (int i = 0; i < opt->nscales; i++)
+        if (opt->scales[i] == 0) return true;
+    return opt->nscales == 0;
+}
+
+// "dir/crop_001.png" + 256 → "dir/crop_001.256.png": the variants of a crop
+// share its WebDataset key, so a shard sample holds 256.png, 512.png, png
+static void scale_filename(char* out, size_t size, const char* filename, int side)
+{
+    const char* slash = strrchr(filename, '/');
+    const char* dot = strrchr(slash ? slash : filename, '.');
+    if (!dot || dot == (slash ? slash + 1 : filename)) dot = filename + strlen(filename);
+    snprintf(out, size, "%.*s.%d%s", (int)(dot - filename), filename, side, dot);
+}
+
+// ──────────────────────────────────────────────── Background save queue ────────────────────────────────────────────────
+// The UI thread only snapshots the crop pixels; PNG encoding and the file
+// write happen on worker threads. Results are posted back for the overlay.
+
+#define SAVE_MAX_WORKERS      64
+#define SAVE_UI_WORKERS        4
+#define SAVE_STATUS_SHOW_MS 3000
+
+// Progress of a group of jobs (one grid cut); the counters are bumped by workers.
+// `done` counts the `total` queued crops; `pending` also counts their --scales
+// variants, so the batch is only finished once both say so.
+typedef struct {
+    int             total;
+    SDL_atomic_t    done, failed;
+    SDL_atomic_t    pending;        // jobs of the batch queued or encoding, variants included
+    FILE*           members;        // optional: gets the name of every shard member written
+    char**          written;        // sorted names already in a shard, not written again
+    int             nwritten;
+} SaveBatch;
+
+static int compare_paths(const void* a, const void* b);
+
+static bool save_batch_written(const SaveBatch* b, const char* name)
+{
+    return b->nwritten > 0 && bsearch(&name, b->written, (size_t)b->nwritten, sizeof(*b->written), compare_paths);
+}
+
+static bool save_batch_finished(SaveBatch* b)
+{
+    // In this order: a crop's variants are counted in `pending` before its `done`
+    return SDL_AtomicGet(&b->done) == b->total && SDL_AtomicGet(&b->pending) == 0;
+}
+
+typedef struct SaveJob {
+    SDL_Surface*    pixels;         // snapshot in crop_format(), owned by the job
+    void*           block;          // its pixel memory, from the queue's PixelPool (UI snapshots)
+    size_t          block_size;
+    SDL_Surface*    src;            // or: borrowed source to extract `crop` from in the worker
+    CropRegion      crop;
+    char            filename[512];
+    SaveBatch*      batch;          // optional, not owned
+    SaveBatch*      hold;           // optional: counts the jobs still reading `src`, see save_batch_wait()
+    bool            variant;        // a --scales size of another job: no dedup, no further sizes, only in batch->pending
+    struct SaveJob* next;
+} SaveJob;
+
+typedef struct {
+    SDL_mutex*  lock;
+    SDL_cond*   wake;
+    SDL_cond*   idle;               // signalled when `pending` drops to 0
+    SDL_cond*   released;           // broadcast whenever a job with a `hold` finishes
+    SaveJob*    head;
+    SaveJob*    tail;
+    int         pending;            // queued + currently encoding
+    bool        quit;
+    SDL_Thread* workers[SAVE_MAX_WORKERS];
+    int         nworkers;
+    Uint32      done_event;         // pushed after every finished job to wake the UI
+    EncodeOptions encode;
+    EncodeFn    encoder;
+    ShardWriter shard;
+    DedupIndex  dedup;
+    PixelPool   pool;               // pixel memory of snapshots taken by save_crop()
+    bool        quiet;              // no per-file "Saved:" lines (--bench)
+
+    // Last result, read by the overlay under `lock`
+    char        status[160];
+    bool        status_error;
+    Uint32      status_ticks;
+
+    // Totals for throughput reporting, under `lock`
+    int         saved, failed, skipped;
+    Uint64      pixel_bytes, file_bytes;
+} SaveQueue;
+
+static SDL_Surface* extract_crop_scratch(SDL_Surface* src, const CropRegion* crop, Arena* a);
+static void save_queue_push_variants(SaveQueue* q, const SaveJob* job, Arena* scratch);
+
+static void save_queue_post_status(SaveQueue* q, bool error, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    SDL_LockMutex(q->lock);
+    vsnprintf(q->status, sizeof(q->status), fmt, ap);
+    q->status_error = error;
+    q->status_ticks = SDL_GetTicks();
+    SDL_UnlockMutex(q->lock);
+    va_end(ap);
+}
+
+static int save_worker(void* data)
+{
+    SaveQueue* q = data;
+    ByteBuf out = {0};              // encode buffer, reused across jobs
+    Arena scratch = {0};            // this job's crop pixels and encoder temporaries
+
+    for (;;)
+    {
+        SDL_LockMutex(q->lock);
+        while (!q->head && !q->quit)
+            SDL_CondWait(q->wake, q->lock);
+        SaveJob* job = q->head;
+        if (!job) {                 // quit requested and nothing left to do
+            SDL_UnlockMutex(q->lock);
+            break;
+        }
+        q->head = job->next;
+        if (!q->head) q->tail = NULL;
+        SDL_UnlockMutex(q->lock);
+
+        if (!job->pixels)
+            job->pixels = extract_crop_scratch(job->src, &job->crop, &scratch);
+
+        // Near-duplicates are caught before the encode, the expensive part
+        const char* dup = NULL;
+        int dist = 0;
+        Uint64 hash;
+        if (job->pixels && !job->variant && q->dedup.mode != DEDUP_OFF && job->pixels->w >= 9 && job->pixels->h >= 8 &&
+            dhash(job->pixels, &scratch, &hash))
+            dup = dedup_check(&q->dedup, hash, job->filename, &dist);
+        if (dup) {
+            fprintf(stderr, "%s %s: near-duplicate of %s (distance %d)\n",
+                    q->dedup.mode == DEDUP_SKIP ? "Skipped" : "Warning:", job->filename, dup, dist);
+        }
+
+        // The other sizes go out as jobs of their own before this one encodes
+        bool skipped = dup && q->dedup.mode == DEDUP_SKIP;
+        bool native = true;
+        if (job->pixels && !job->variant && !skipped && q->encode.nscales > 0) {
+            save_queue_push_variants(q, job, &scratch);
+            native = scales_native(&q->encode);
+        }
+        if (native && job->batch && save_batch_written(job->batch, job->filename))
+            native = false;         // an earlier attempt of the job wrote this member
+
+        Sint64 size = -1;
+        int shard = 0;
+        out.len = 0;
+        if (!job->pixels) {
+            fprintf(stderr, "Failed to extract %s: %s\n", job->filename, SDL_GetError());
+            save_queue_post_status(q, true, "FAILED %s: %s", job->filename, SDL_GetError());
+        } else if (skipped) {
+            save_queue_post_status(q, true, "Skipped %s: same as %s", job->filename, dup);
+        } else if (!native) {
+            // only its resized variants are written
+        } else if (!q->encoder(job->pixels, &q->encode, &scratch, &out)) {
+            fprintf(stderr, "Failed to encode %s: %s\n", job->filename, IMG_GetError());
+            save_queue_post_status(q, true, "FAILED %s: encode error", job->filename);
+        } else if (q->shard.prefix && shard_append(&q->shard, job->filename, &out, &shard)) {
+            size = (Sint64)out.len;
+            if (job->batch && job->batch->members) fprintf(job->batch->members, "%s\n", job->filename);
+            if (!q->quiet)
+                printf("Saved: %s  (%d×%d) → %s-%06d.tar\n", job->filename, job->pixels->w, job->pixels->h,
+                       q->shard.prefix, shard);
+            save_queue_post_status(q, dup != NULL, "Saved %s (shard %d)%s", job->filename, shard,
+                                   dup ? ", near-duplicate" : "");
+        } else if (!q->shard.prefix && write_file(job->filename, &out)) {
+            size = (Sint64)out.len;
+            if (!q->quiet) printf("Saved: %s  (%d×%d)\n", job->filename, job->pixels->w, job->pixels->h);
+            save_queue_post_status(q, dup != NULL, "Saved %s%s", job->filename, dup ? " (near-duplicate)" : "");
+        } else {
+            fprintf(stderr, "Failed to save %s: %s\n", job->filename, SDL_GetError());
+            save_queue_post_status(q, true, "FAILED %s: %s", job->filename, SDL_GetError());
+        }
+
+        // Before `pending` drops, so the counts are final once save_queue_wait() returns
+        bool forwarded = job->pixels && !skipped && !native;
+        if (job->batch) {
+            if (size < 0 && !skipped && !forwarded) SDL_AtomicIncRef(&job->batch->failed);
+            if (!job->variant) SDL_AtomicIncRef(&job->batch->done);
+            SDL_AtomicAdd(&job->batch->pending, -1);
+        }
+        SaveBatch* hold = job->hold;
+        if (hold) SDL_AtomicAdd(&hold->pending, -1);
+
+        SDL_LockMutex(q->lock);
+        if (--q->pending == 0) SDL_CondBroadcast(q->idle);
+        if (hold) SDL_CondBroadcast(q->released);
+        if (size >= 0) {
+            q->saved++;
+            q->file_bytes  += (Uint64)size;
+            q->pixel_bytes += (Uint64)job->pixels->w * job->pixels->h * job->pixels->format->BytesPerPixel;
+        } else if (skipped) {
+            q->skipped++;
+        } else if (!forwarded) {
+            q->failed++;
+        }
+        SDL_UnlockMutex(q->lock);
+
+        SDL_FreeSurface(job->pixels);
+        if (job->block) pixel_pool_put(&q->pool, job->block, job->block_size);
+        free(job);
+        arena_reset(&scratch);
+
+        if (q->done_event != (Uint32)-1) {
+            SDL_Event ev = { .type = q->done_event };
+            SDL_PushEvent(&ev);
+        }
+    }
+    bytebuf_free(&out);
+    arena_free(&scratch);
+    return 0;
+}
+
+// `notify` registers the SDL event pushed per finished job (GUI only)
+static bool save_queue_init(SaveQueue* q, int nworkers, bool notify, const EncodeOptions* encode)
+{
+    memset(q, 0, sizeof(*q));
+    q->encode  = *encode;
+    q->encoder = encoder_find(encode->encoder);
+    if (!q->encoder) return false;
+    if (!shard_init(&q->shard, encode->shard_prefix, encode->shard_limit)) return false;
+    if (!dedup_init(&q->dedup, encode->dedup, encode->dedup_distance)) return false;
+    q->lock = SDL_CreateMutex();
+    q->wake = SDL_CreateCond();
+    q->idle = SDL_CreateCond();
+    q->released = SDL_CreateCond();
+    q->pool.lock = SDL_CreateMutex();
+    if (!q->lock || !q->wake || !q->idle || !q->released || !q->pool.lock) return false;
+    q->done_event = notify ? SDL_RegisterEvents(1) : (Uint32)-1;
+
+    int n = nworkers;
+    if (n < 1) n = 1;
+    if (n > SAVE_MAX_WORKERS) n = SAVE_MAX_WORKERS;
+
+    for (int i = 0; i < n; i++) {
+        q->workers[q->nworkers] = SDL_CreateThread(save_worker, "save_worker", q);
+        if (q->workers[q->nworkers]) q->nworkers++;
+    }
+    return q->nworkers > 0;
+}
+
+// Finishes every queued save before returning, so nothing is lost on quit
+static void save_queue_shutdown(SaveQueue* q)
+{
+    if (q->lock) {
+        SDL_LockMutex(q->lock);
+        if (q->pending > 0)
+            printf("Waiting for %d pending save(s)...\n", q->pending);
+        q->quit = true;
+        SDL_CondBroadcast(q->wake);
+        SDL_UnlockMutex(q->lock);
+    }
+
+    for (int i = 0; i < q->nworkers; i++)
+        SDL_WaitThread(q->workers[i], NULL);
+
+    shard_shutdown(&q->shard);
+    dedup_shutdown(&q->dedup);
+    pixel_pool_shutdown(&q->pool);
+    if (q->idle) SDL_DestroyCond(q->idle);
+    if (q->released) SDL_DestroyCond(q->released);
+    if (q->wake) SDL_DestroyCond(q->wake);
+    if (q->lock) SDL_DestroyMutex(q->lock);
+}
+
+// Blocks until every queued job has finished (the workers keep running)
+static void save_queue_wait(SaveQueue* q)
+{
+    SDL_LockMutex(q->lock);
+    while (q->pending > 0)
+        SDL_CondWait(q->idle, q->lock);
+    SDL_UnlockMutex(q->lock);
+}
+
+// Blocks until no job queued with `hold` still reads its source
+static void save_batch_wait(SaveQueue* q, SaveBatch* hold)
+{
+    SDL_LockMutex(q->lock);
+    while (SDL_AtomicGet(&hold->pending) > 0)
+        SDL_CondWait(q->released, q->lock);
+    SDL_UnlockMutex(q->lock);
+}
+
+// Converts the crop rectangle of `src` to RGBA32 at `dst`.
+// Only reads `src` (no blit map is attached to it), so worker threads may
+// extract from the same source concurrently.
+static bool extract_crop_to(SDL_Surface* src, const CropRegion* crop, void* dst, int dst_pitch)
+{
+    if (crop->w <= 0 || crop->h <= 0 ||
+        crop->x < 0 || crop->y < 0 || crop->x + crop->w > src->w || crop->y + crop->h > src->h)
+    {
+        SDL_SetError("crop %d,%d %dx%d outside %dx%d image", crop->x, crop->y, crop->w, crop->h, src->w, src->h);
+        return false;
+    }
+
+    const SDL_PixelFormat* fmt = src->format;
+    const Uint8* in = (const Uint8*)src->pixels + (size_t)crop->y * src->pitch
+                                                + (size_t)crop->x * fmt->BytesPerPixel;
+
+    if (pixels_convert(crop->w, crop->h, fmt->format, in, src->pitch,
+                       SDL_PIXELFORMAT_RGBA32, dst, dst_pitch))
+        return true;
+
+    if (fmt->palette && fmt->BitsPerPixel == 8)
+    {
+        Uint32 key;
+        bool has_key = SDL_GetColorKey(src, &key) == 0;
+        for (int y = 0; y < crop->h; y++) {
+            const Uint8* row = in + (size_t)y * src->pitch;
+            Uint8* out = (Uint8*)dst + (size_t)y * dst_pitch;
+            for (int x = 0; x < crop->w; x++, out += 4) {
+                SDL_Color c = fmt->palette->colors[row[x]];
+                out[0] = c.r; out[1] = c.g; out[2] = c.b;
+                out[3] = (has_key && row[x] == key) ? 0 : c.a;
+            }
+        }
+        return true;
+    }
+    return SDL_ConvertPixels(crop->w, crop->h, fmt->format, in, src->pitch,
+                             SDL_PIXELFORMAT_RGBA32, dst, dst_pitch) == 0;
+}
+
+static bool palette_is_gray(const SDL_Palette* pal)
+{
+    for (int i = 0; i < pal->ncolors; i++) {
+        SDL_Color c = pal->colors[i];
+        if (c.r != i || c.g != i || c.b != i || c.a != 255) return false;
+    }
+    return true;
+}
+
+static void palette_set_gray(SDL_Palette* pal)
+{
+    SDL_Color ramp[256];
+    for (int i = 0; i < 256; i++) ramp[i] = (SDL_Color){(Uint8)i, (Uint8)i, (Uint8)i, 255};
+    SDL_SetPaletteColors(pal, ramp, 0, SDL_min(pal->ncolors, 256));
+}
+
+// Format a crop of `src` is kept in from extraction to the encoder: 8-bit
+// grayscale stays one byte per pixel (INDEX8 with a gray ramp), anything
+// without alpha becomes RGB24 and only alpha sources pay for RGBA32
+static Uint32 crop_format(SDL_Surface* src)
+{
+    const SDL_PixelFormat* fmt = src->format;
+    Uint32 key;
+    bool has_key = SDL_GetColorKey(src, &key) == 0;
+    ByteLayout layout;
+    if (fmt->palette && fmt->BitsPerPixel == 8) {
+        if (has_key) return SDL_PIXELFORMAT_RGBA32;
+        if (palette_is_gray(fmt->palette)) return SDL_PIXELFORMAT_INDEX8;
+        for (int i = 0; i < fmt->palette->ncolors; i++)
+            if (fmt->palette->colors[i].a != 255) return SDL_PIXELFORMAT_RGBA32;
+        return SDL_PIXELFORMAT_RGB24;
+    }
+    if (byte_layout(fmt->format, &layout) && !layout.alpha) return SDL_PIXELFORMAT_RGB24;
+    return SDL_PIXELFORMAT_RGBA32;
+}
+
+// Like extract_crop_to, into `format` as returned by crop_format(src).
+// Rows already in that format are copied as they are.
+static bool extract_crop_as(SDL_Surface* src, const CropRegion* crop, Uint32 format, void* dst, int dst_pitch)
+{
+    if (format == SDL_PIXELFORMAT_RGBA32) return extract_crop_to(src, crop, dst, dst_pitch);
+    if (crop->w <= 0 || crop->h <= 0 ||
+        crop->x < 0 || crop->y < 0 || crop->x + crop->w > src->w || crop->y + crop->h > src->h)
+    {
+        SDL_SetError("crop %d,%d %dx%d outside %dx%d image", crop->x, crop->y, crop->w, crop->h, src->w, src->h);
+        return false;
+    }
+
+    const SDL_PixelFormat* fmt = src->format;
+    const Uint8* in = (const Uint8*)src->pixels + (size_t)crop->y * src->pitch
+                                                + (size_t)crop->x * fmt->BytesPerPixel;
+    if (fmt->format == format) {
+        for (int y = 0; y < crop->h; y++)
+            memcpy((Uint8*)dst + (size_t)y * dst_pitch, in + (size_t)y * src->pitch,
+                   (size_t)crop->w * fmt->BytesPerPixel);
+        return true;
+    }
+    if (fmt->palette) {         // opaque colour palette → RGB24
+        for (int y = 0; y < crop->h; y++) {
+            const Uint8* row = in + (size_t)y * src->pitch;
+            Uint8* out = (Uint8*)dst + (size_t)y * dst_pitch;
+            for (int x = 0; x < crop->w; x++, out += 3) {
+                SDL_Color c = fmt->palette->colors[row[x]];
+                out[0] = c.r; out[1] = c.g; out[2] = c.b;
+            }
+        }
+        return true;
+    }
+    return SDL_ConvertPixels(crop->w, crop->h, fmt->format, in, src->pitch, format, dst, dst_pitch) == 0;
+}
+
+// Surface in a crop format over caller-owned pixels with a tight pitch
+static SDL_Surface* crop_surface_from(void* mem, int w, int h, Uint32 format)
+{
+    SDL_Surface* s = SDL_CreateRGBSurfaceWithFormatFrom(
+        mem, w, h, SDL_BITSPERPIXEL(format), w * SDL_BYTESPERPIXEL(format), format);
+    if (s && s->format->palette) palette_set_gray(s->format->palette);
+    return s;
+}
+
+// Crop in `format` (from crop_format(src)) over caller-owned memory of
+// w × h × bytes-per-pixel bytes, which SDL_FreeSurface leaves alone
+static SDL_Surface* extract_crop_into(SDL_Surface* src, const CropRegion* crop, Uint32 format, void* mem)
+{
+    if (crop->w <= 0 || crop->h <= 0) {
+        SDL_SetError("empty crop");
+        return NULL;
+    }
+    SDL_Surface* cropped = crop_surface_from(mem, crop->w, crop->h, format);
+    if (!cropped) return NULL;
+
+    if (!extract_crop_as(src, crop, format, cropped->pixels, cropped->pitch)) {
+        SDL_FreeSurface(cropped);
+        return NULL;
+    }
+    return cropped;
+}
+
+// Crop of `src` whose pixels live in the arena until its next reset
+static SDL_Surface* extract_crop_scratch(SDL_Surface* src, const CropRegion* crop, Arena* a)
+{
+    Uint32 format = crop_format(src);
+    void* mem = crop->w > 0 && crop->h > 0
+              ? arena_alloc(a, (size_t)crop->w * crop->h * SDL_BYTESPERPIXEL(format)) : NULL;
+    if (!mem && crop->w > 0 && crop->h > 0) {
+        SDL_OutOfMemory();
+        return NULL;
+    }
+    return extract_crop_into(src, crop, format, mem);
+}
+
+// Same, into a new surface in crop_format(src)
+static SDL_Surface* extract_crop(SDL_Surface* src, const CropRegion* crop)
+{
+    if (crop->w <= 0 || crop->h <= 0) {
+        SDL_SetError("empty crop");
+        return NULL;
+    }
+    Uint32 format = crop_format(src);
+    SDL_Surface* cropped = SDL_CreateRGBSurfaceWithFormat(
+        0, crop->w, crop->h, SDL_BITSPERPIXEL(format), format);
+
+    if (!cropped) return NULL;
+    prof_count(PROF_SURF_ALLOC);
+    if (cropped->format->palette) palette_set_gray(cropped->format->palette);
+
+    if (!extract_crop_as(src, crop, format, cropped->pixels, cropped->pitch)) {
+        SDL_FreeSurface(cropped);
+        return NULL;
+    }
+    return cropped;
+}
+
+// Milliseconds until the overlay's save status changes on its own, or -1
+static int save_queue_status_timeout(SaveQueue* q)
+{
+    int timeout = -1;
+    SDL_LockMutex(q->lock);
+    if (q->pending == 0 && q->status[0]) {
+        Uint32 age = SDL_GetTicks() - q->status_ticks;
+        if (age < SAVE_STATUS_SHOW_MS) timeout = (int)(SAVE_STATUS_SHOW_MS - age) + 1;
+    }
+    SDL_UnlockMutex(q->lock);
+    return timeout;
+}
+
+static void save_queue_push(SaveQueue* q, SaveJob* job)
+{
+    if (job->batch) SDL_AtomicIncRef(&job->batch->pending);
+    if (job->hold) SDL_AtomicIncRef(&job->hold->pending);
+    SDL_LockMutex(q->lock);
+    if (q->tail) q->tail->next = job;
+    else         q->head = job;
+    q->tail = job;
+    q->pending++;
+    SDL_CondSignal(q->wake);
+    SDL_UnlockMutex(q->lock);
+}
+
+// Worker: queues every non-native --scales size of `job`'s crop as a job of
+// its own, at the head so its pixel blocks are back in the pool soon. The
+// halving chain lives in `scratch` and only grows as far as a size needs it.
+static void save_queue_push_variants(SaveQueue* q, const SaveJob* job, Arena* scratch)
+{
+    const SDL_Surface* px = job->pixels;
+    int bpp = px->format->BytesPerPixel;
+    Plane chain[RESAMPLE_LEVELS] = { { px->pixels, px->w, px->h, bpp } };
+    int nchain = 1;
+    if (px->pitch != px->w * bpp) {
+        chain[0].px = arena_alloc(scratch, (size_t)px->w * px->h * bpp);
+        if (!chain[0].px) {
+            fprintf(stderr, "Failed to resize %s: out of memory\n", job->filename);
+            save_queue_post_status(q, true, "FAILED %s: resize", job->filename);
+            if (job->batch) SDL_AtomicIncRef(&job->batch->failed);
+            return;
+        }
+        for (int y = 0; y < px->h; y++)
+            memcpy(chain[0].px + (size_t)y * px->w * bpp, (const Uint8*)px->pixels + (size_t)y * px->pitch,
+                   (size_t)px->w * bpp);
+    }
+
+    for (int i = 0; i < q->encode.nscales; i++)
+    {
+        int side = q->encode.scales[i];
+        if (side == 0) continue;
+        int w, h;
+        scale_size(px->w, px->h, side, &w, &h);
+
+        // The smallest level of the chain that is still at least w × h
+        int k = 0;
+        for (;;) {
+            if (k + 1 < nchain && chain[k + 1].w >= w && chain[k + 1].h >= h) {
+                k++;
+            } else if (k + 1 == nchain && nchain < RESAMPLE_LEVELS
+                       && (chain[k].w + 1) / 2 >= w && (chain[k].h + 1) / 2 >= h
+                       && plane_halve(&chain[k], &chain[nchain], scratch)) {
+                k = nchain++;
+            } else {
+                break;
+            }
+        }
+
+        SaveJob* v = calloc(1, sizeof(*v));
+        size_t bytes = (size_t)w * h * bpp;
+        bool ok = v && (v->block = pixel_pool_get(&q->pool, bytes, &v->block_size)) != NULL;
+        if (ok) {
+            if (chain[k].w == w && chain[k].h == h) memcpy(v->block, chain[k].px, bytes);
+            else ok = plane_resample(&chain[k], v->block, w, h, scratch);
+        }
+        if (ok) ok = (v->pixels = crop_surface_from(v->block, w, h, px->format->format)) != NULL;
+        if (!ok) {
+            fprintf(stderr, "Failed to resize %s to %d: out of memory\n", job->filename, side);
+            save_queue_post_status(q, true, "FAILED %s: resize to %d", job->filename, side);
+            if (job->batch) SDL_AtomicIncRef(&job->batch->failed);
+            if (v && v->block) pixel_pool_put(&q->pool, v->block, v->block_size);
+            free(v);
+            continue;
+        }
+        scale_filename(v->filename, sizeof(v->filename), job->filename, side);
+        v->batch = job->batch;      // keeps the batch unfinished until it is written
+        v->variant = true;
+        if (v->batch) SDL_AtomicIncRef(&v->batch->pending);
+
+        SDL_LockMutex(q->lock);
+        v->next = q->head;
+        q->head = v;
+        if (!q->tail) q->tail = v;
+        q->pending++;
+        SDL_CondSignal(q->wake);
+        SDL_UnlockMutex(q->lock);
+    }
+}
+
+// ──────────────────────────────────────────────── Parallel JPEG decode ────────────────────────────────────────────────
+// Large baseline JPEGs whose restart markers fall on MCU-row boundaries
+// are cut into horizontal stripes, one per core. Each stripe is re-wrapped
+// as a standalone JPEG (the original headers with the frame height patched,
+// then that stripe's entropy-coded segments with the restart markers
+// renumbered from RST0) and decoded by SDL_image on its own thread; restart
+// intervals reset the DC predictors, so the pieces decode independently.
+// With vertically subsampled chroma the decoder's upsampler reads the
+// neighbouring MCU row, so each stripe then also decodes one cut step of
+// context above and below and drops it, keeping seams bit-identical.
+// Progressive, arithmetic-coded and marker-less files take the single
+// threaded IMG_Load path. A callback sees every stripe as soon as it is
+// decoded, which the prefetcher uses for a progressive preview.
+
+#define JPEG_MAX_STRIPES    16
+#define JPEG_MIN_PIXELS    (4 << 20)    // smaller images decode fast enough on one core
+
+// Called on decode threads with each finished stripe (rows y.. of an img_w × img_h image)
+typedef void (*DecodeStripeFn)(void* user, SDL_Surface* stripe, int y, int img_w, int img_h);
+
+typedef struct {
+    const Uint8* data;
+    size_t       size;
+    size_t       sof_height;    // offset of the 16-bit frame height
+    size_t       scan;          // first entropy-coded byte
+    size_t       eoi;           // offset of the EOI marker
+    size_t*      rst;           // offset of every RSTn marker
+    int          nrst, rst_cap;
+    int          w, h;
+    int          mcu_h, mcus_per_row, mcu_rows;
+    int          restart;       // MCUs per restart interval
+    bool         vsub;          // some component is vertically subsampled
+} JpegLayout;
+
+typedef struct {
+    const JpegLayout* jpeg;
+    int               row0, row1;   // MCU rows this stripe contributes
+    int               ctx0, ctx1;   // MCU rows actually decoded (row0/row1 plus context)
+    SDL_Surface*      out;          // rows ctx0..ctx1
+    DecodeStripeFn    progress;
+    void*             user;
+} JpegStripe;
+
+static int gcd(int a, int b)
+{
+    while (b) { int t = a % b; a = b; b = t; }
+    return a;
+}
+
+static bool jpeg_parse(const Uint8* p, size_t n, JpegLayout* j)
+{
+    memset(j, 0, sizeof(*j));
+    j->data = p;
+    j->size = n;
+    if (n < 4 || p[0] != 0xFF || p[1] != 0xD8) return false;
+
+    int ncomp = 0, hmax = 1, vmax = 1;
+    size_t pos = 2;
+    for (;;)
+    {
+        if (pos + 4 > n || p[pos] != 0xFF) return false;
+        Uint8 m = p[pos + 1];
+        if (m == 0xFF) { pos++; continue; }        // fill byte
+        size_t len = ((size_t)p[pos + 2] << 8) | p[pos + 3];
+        if (len < 2 || pos + 2 + len > n) return false;
+        const Uint8* seg = p + pos + 4;
+
+        if (m == 0xC0 || m == 0xC1) {              // baseline / extended Huffman
+            if (len < 8 || seg[0] != 8) return false;
+            j->sof_height = pos + 5;
+            j->h  = (seg[1] << 8) | seg[2];
+            j->w  = (seg[3] << 8) | seg[4];
+            ncomp = seg[5];
+            if (ncomp < 1 || len < 8 + 3 * (size_t)ncomp) return false;
+            int vmin = 15;
+            for (int c = 0; c < ncomp; c++) {
+                hmax = SDL_max(hmax, seg[7 + 3 * c] >> 4);
+                vmax = SDL_max(vmax, seg[7 + 3 * c] & 15);
+                vmin = SDL_min(vmin, seg[7 + 3 * c] & 15);
+            }
+            j->vsub = vmin != vmax;
+        } else if (m >= 0xC2 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+            return false;                           // progressive, lossless or arithmetic
+        } else if (m == 0xDD && len >= 4) {
+            j->restart = (seg[0] << 8) | seg[1];
+        } else if (m == 0xDA) {
+            if (!ncomp || len < 3 || seg[0] != ncomp) return false;   // need one interleaved scan
+            j->scan = pos + 2 + len;
+            break;
+        }
+        pos += 2 + len;
+    }
+    if (j->w <= 0 || j->h <= 0 || j->restart <= 0) return false;
+
+    int mcu_w   = ncomp == 1 ? 8 : 8 * hmax;
+    j->mcu_h    = ncomp == 1 ? 8 : 8 * vmax;
+    j->mcus_per_row = (j->w + mcu_w - 1) / mcu_w;
+    j->mcu_rows     = (j->h + j->mcu_h - 1) / j->mcu_h;
+
+    for (size_t i = j->scan; i + 1 < n; i++)
+    {
+        if (p[i] != 0xFF) continue;
+        Uint8 m = p[i + 1];
+        if (m == 0x00 || m == 0xFF) continue;      // stuffed byte / fill
+        if (m >= 0xD0 && m <= 0xD7) {
+            if (j->nrst == j->rst_cap) {
+                j->rst_cap = j->rst_cap ? j->rst_cap * 2 : 1024;
+                size_t* grown = realloc(j->rst, (size_t)j->rst_cap * sizeof(*grown));
+                if (!grown) return false;
+                j->rst = grown;
+            }
+            j->rst[j->nrst++] = i++;
+            continue;
+        }
+        if (m != 0xD9) return false;                // DNL or a second scan
+        j->eoi = i;
+        break;
+    }
+    if (!j->eoi) return false;
+
+    Uint64 total = (Uint64)j->mcus_per_row * j->mcu_rows;
+    return (Uint64)j->nrst == (total + j->restart - 1) / j->restart - 1;
+}
+
+// Standalone JPEG for MCU rows [row0, row1)
+static bool jpeg_stripe_build(const JpegLayout* j, int row0, int row1, ByteBuf* out)
+{
+    int k0 = (int)((Sint64)row0 * j->mcus_per_row / j->restart);
+    int k1 = row1 == j->mcu_rows ? j->nrst + 1 : (int)((Sint64)row1 * j->mcus_per_row / j->restart);
+    int height = SDL_min(j->h, row1 * j->mcu_h) - row0 * j->mcu_h;
+
+    out->len = 0;
+    if (!bytebuf_append(out, j->data, j->scan)) return false;
+    out->data[j->sof_height]     = (Uint8)(height >> 8);
+    out->data[j->sof_height + 1] = (Uint8)height;
+
+    for (int k = k0; k < k1; k++)
+    {
+        size_t start = k == 0 ? j->scan : j->rst[k - 1] + 2;
+        size_t end   = k == j->nrst ? j->eoi : j->rst[k];
+        if (!bytebuf_append(out, j->data + start, end - start)) return false;
+        Uint8 marker[2] = { 0xFF, k + 1 < k1 ? (Uint8)(0xD0 + (k - k0) % 8) : 0xD9 };
+        if (!bytebuf_append(out, marker, 2)) return false;
+    }
+    return true;
+}
+
+static int jpeg_stripe_worker(void* data)
+{
+    JpegStripe* st = data;
+    const JpegLayout* j = st->jpeg;
+    ByteBuf buf = {0};
+    if (jpeg_stripe_build(j, st->ctx0, st->ctx1, &buf)) {
+        SDL_RWops* rw = SDL_RWFromConstMem(buf.data, (int)buf.len);
+        st->out = rw ? IMG_LoadTyped_RW(rw, 1, "JPG") : NULL;
+    }
+    bytebuf_free(&buf);
+
+    int y0 = st->ctx0 * j->mcu_h;
+    if (st->out && (st->out->w != j->w || st->out->h != SDL_min(j->h, st->ctx1 * j->mcu_h) - y0)) {
+        SDL_FreeSurface(st->out);
+        st->out = NULL;
+    }
+    if (st->out && st->progress) {
+        // Only this stripe's own rows, not the context
+        int y = st->row0 * j->mcu_h;
+        int h = SDL_min(j->h, st->row1 * j->mcu_h) - y;
+        SDL_Surface* own = SDL_CreateRGBSurfaceWithFormatFrom(
+            (Uint8*)st->out->pixels + (size_t)(y - y0) * st->out->pitch, j->w, h,
+            st->out->format->BitsPerPixel, st->out->pitch, st->out->format->format);
+        if (own) {
+            if (st->out->format->palette) SDL_SetSurfacePalette(own, st->out->format->palette);
+            st->progress(st->user, own, y, j->w, j->h);
+            SDL_FreeSurface(own);
+        }
+    }
+    return 0;
+}
+
+// Decodes `jpeg` in stripes; NULL if it cannot be split or a stripe failed
+static SDL_Surface* jpeg_decode_parallel(const JpegLayout* j, DecodeStripeFn progress, void* user)
+{
+    int n = SDL_min(SDL_GetCPUCount(), JPEG_MAX_STRIPES);
+    int rstep = j->restart / gcd(j->mcus_per_row, j->restart);  // MCU rows between usable cut points
+    n = SDL_min(n, j->mcu_rows / rstep);
+    if (n < 2 || (Sint64)j->w * j->h < JPEG_MIN_PIXELS) return NULL;
+
+    JpegStripe stripes[JPEG_MAX_STRIPES];
+    SDL_Thread* threads[JPEG_MAX_STRIPES];
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        int r0 = j->mcu_rows * i / n / rstep * rstep;
+        int r1 = i + 1 == n ? j->mcu_rows : j->mcu_rows * (i + 1) / n / rstep * rstep;
+        if (r1 <= r0) continue;
+        int ctx = j->vsub ? rstep : 0;
+        stripes[count] = (JpegStripe){ j, r0, r1, SDL_max(0, r0 - ctx), SDL_min(j->mcu_rows, r1 + ctx),
+                                       NULL, progress, user };
+        count++;
+    }
+    for (int i = 1; i < count; i++) {
+        threads[i] = SDL_CreateThread(jpeg_stripe_worker, "jpeg_stripe", &stripes[i]);
+        if (!threads[i]) jpeg_stripe_worker(&stripes[i]);
+    }
+    jpeg_stripe_worker(&stripes[0]);
+    for (int i = 1; i < count; i++)
+        if (threads[i]) SDL_WaitThread(threads[i], NULL);
+
+    // Stitch the stripes into one surface, freeing each as it is copied
+    SDL_Surface* out = NULL;
+    bool ok = true;
+    for (int i = 0; i < count; i++) ok = ok && stripes[i].out &&
+                                         stripes[i].out->format->format == stripes[0].out->format->format;
+    if (ok && !stripes[0].out->format->palette)
+        out = SDL_CreateRGBSurfaceWithFormat(0, j->w, j->h, stripes[0].out->format->BitsPerPixel,
+                                             stripes[0].out->format->format);
+    for (int i = 0; i < count; i++)
+    {
+        SDL_Surface* s = stripes[i].out;
+        if (out) {
+            size_t row = (size_t)s->w * s->format->BytesPerPixel;
+            int y0 = stripes[i].row0 * j->mcu_h;
+            int y1 = SDL_min(j->h, stripes[i].row1 * j->mcu_h);
+            int skip = y0 - stripes[i].ctx0 * j->mcu_h;
+            for (int y = y0; y < y1; y++)
+                memcpy((Uint8*)out->pixels + (size_t)y * out->pitch,
+                       (const Uint8*)s->pixels + (size_t)(y - y0 + skip) * s->pitch, row);
+        }
+        SDL_FreeSurface(s);
+    }
+    if (out) prof_count(PROF_SURF_ALLOC);
+    return out;
+}
+
+static bool has_jpeg_ext(const char* path)
+{
+    const char* dot = strrchr(path, '.');
+    return dot && (SDL_strcasecmp(dot, ".jpg") == 0 || SDL_strcasecmp(dot, ".jpeg") == 0);
+}
+
+// JPEG files through the stripe decoder when they allow it, else one
+// IMG_Load pass over the same bytes; NULL for other extensions
+static SDL_Surface* load_jpeg(const char* path, DecodeStripeFn progress, void* user, bool* handled)
+{
+    *handled = false;
+    if (!has_jpeg_ext(path)) return NULL;
+    size_t size = 0;
+    Uint8* data = SDL_LoadFile(path, &size);
+    if (!data) return NULL;
+    if (size > INT_MAX) {           // too big for a memory RWops; let IMG_Load stream it
+        SDL_free(data);
+        return NULL;
+    }
+    *handled = true;
+
+    JpegLayout j;
+    SDL_Surface* surface = NULL;
+    if (jpeg_parse(data, size, &j))
+        surface = jpeg_decode_parallel(&j, progress, user);
+    free(j.rst);
+    if (!surface) {
+        SDL_RWops* rw = SDL_RWFromConstMem(data, (int)size);
+        surface = rw ? IMG_LoadTyped_RW(rw, 1, "JPG") : NULL;
+    }
+    SDL_free(data);
+    return surface;
+}
+
+// ──────────────────────────────────────────────── Memory-mapped inputs ────────────────────────────────────────────────
+// Binary PGM/PPM (P5/P6, 8-bit) files need no decoding at all: the surface
+// points straight into a private file mapping, so level 0 is clean,
+// reclaimable page cache instead of a multi-GB heap allocation. Building the
+// mip levels still reads every page once (a --cache hit skips that); after
+// that only the pages under tiles and crops being read stay resident.
+// Compressed formats still go through IMG_Load. Under --watch nothing is
+// mapped: a file truncated while it is on screen would turn every read of
+// its missing pages into SIGBUS, so PNMs are read into memory like the rest.
+
+static bool watch_inputs;       // --watch: inputs may be rewritten while loaded
+
+#ifndef _WIN32
+
+typedef struct {
+    void*  base;
+    size_t size;
+    bool   source;      // maps the input file itself, whose pages change if it is rewritten in place
+} MappedFile;
+
+// Next header token of a PNM file ('#' comments skipped), or -1
+static long pnm_header_int(const Uint8* p, size_t size, size_t* pos)
+{
+    for (;;) {
+        while (*pos < size && (p[*pos] == ' ' || p[*pos] == '\t' || p[*pos] == '\r' || p[*pos] == '\n')) (*pos)++;
+        if (*pos < size && p[*pos] == '#') {
+            while (*pos < size && p[*pos] != '\n') (*pos)++;
+            continue;
+        }
+        break;
+    }
+    if (*pos >= size || p[*pos] < '0' || p[*pos] > '9') return -1;
+
+    long v = 0;
+    while (*pos < size && p[*pos] >= '0' && p[*pos] <= '9' && v < 1000000000L)
+        v = v * 10 + (p[(*pos)++] - '0');
+    return v;
+}
+
+// Returns NULL (without an error) for anything it does not handle
+static SDL_Surface* load_pnm_mapped(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 16) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    Uint8* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+
+    SDL_Surface* surface = NULL;
+    MappedFile* mf = NULL;
+
+    if (p[0] == 'P' && (p[1] == '5' || p[1] == '6'))
+    {
+        bool gray = p[1] == '5';
+        size_t pos = 2;
+        long w = pnm_header_int(p, size, &pos);
+        long h = pnm_header_int(p, size, &pos);
+        long maxval = pnm_header_int(p, size, &pos);
+        pos++;                      // single whitespace byte before the raster
+
+        int bpp = gray ? 1 : 3;
+        if (w > 0 && h > 0 && maxval == 255 && w <= INT_MAX / bpp &&
+            pos + (size_t)w * h * bpp <= size)
+        {
+            surface = SDL_CreateRGBSurfaceWithFormatFrom(p + pos, (int)w, (int)h, bpp * 8, (int)w * bpp,
+                                                         gray ? SDL_PIXELFORMAT_INDEX8 : SDL_PIXELFORMAT_RGB24);
+            mf = malloc(sizeof(*mf));
+        }
+    }
+
+    if (!surface || !mf) {
+        if (surface) SDL_FreeSurface(surface);
+        free(mf);
+        munmap(p, size);
+        return NULL;
+    }
+
+    if (surface->format->palette) palette_set_gray(surface->format->palette);
+
+    mf->base   = p;
+    mf->size   = size;
+    mf->source = true;
+    surface->userdata = mf;
+    return surface;
+}
+
+#endif
+
+// Frees an image from load_image(), unmapping it if it was memory-mapped
+static void image_free(SDL_Surface* surface)
+{
+    if (!surface) return;
+#ifndef _WIN32
+    MappedFile* mf = surface->userdata;
+    if (mf) {
+        SDL_FreeSurface(surface);
+        munmap(mf->base, mf->size);
+        free(mf);
+        return;
+    }
+#endif
+    SDL_FreeSurface(surface);
+}
+
+// True when `surface` reads the input file's pages directly, so it may
+// already show a newer version of the file than the one it was loaded from
+static bool image_maps_source(const SDL_Surface* surface)
+{
+#ifndef _WIN32
+    const MappedFile* mf = surface->userdata;
+    return mf && mf->source;
+#else
+    (void)surface;
+    return false;
+#endif
+}
+
+// Memory-mapped PNM, striped JPEG or IMG_Load, plus normalization:
+// sub-byte palettes (1/2/4 bpp) are expanded to RGBA32 once here, so every
+// later pixel path only sees 8-bit indexed or packed formats. `progress`
+// (may be NULL) sees JPEG stripes as they finish. Free with image_free().
+static SDL_Surface* load_image_progress(const char* path, DecodeStripeFn progress, void* user)
+{
+#ifndef _WIN32
+    SDL_Surface* mapped = watch_inputs ? NULL : load_pnm_mapped(path);
+    if (mapped) return mapped;
+#endif
+
+    bool handled;
+    SDL_Surface* surface = load_jpeg(path, progress, user, &handled);
+    if (!handled) surface = IMG_Load(path);
+    if (surface && surface->format->palette && surface->format->BitsPerPixel < 8) {
+        SDL_Surface* conv = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+        prof_count(PROF_SURF_ALLOC);
+        SDL_FreeSurface(surface);
+        surface = conv;
+    }
+    return surface;
+}
+
+static SDL_Surface* load_image(const char* path)
+{
+    return load_image_progress(path, NULL, NULL);
+}
+
+// Snapshots the crop on the calling thread into pooled memory and queues the PNG encode
+static void save_crop(SaveQueue* q, SDL_Surface* src, const CropRegion* crop, const char* filename)
+{
+    SaveJob* job = calloc(1, sizeof(*job));
+    if (!job) return;
+
+    Uint32 format = crop_format(src);
+    size_t bytes = (size_t)SDL_max(crop->w, 0) * SDL_max(crop->h, 0) * SDL_BYTESPERPIXEL(format);
+    job->block = pixel_pool_get(&q->pool, bytes, &job->block_size);
+    if (job->block) job->pixels = extract_crop_into(src, crop, format, job->block);
+    if (!job->pixels) {
+        if (job->block) pixel_pool_put(&q->pool, job->block, job->block_size);
+        free(job);
+        save_queue_post_status(q, true, "FAILED %s: out of memory", filename);
+        return;
+    }
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+
+    save_queue_push(q, job);
+}
+
+// Queues a crop whose extraction also runs on the worker. `src` is borrowed:
+// the caller keeps it alive and unmodified until save_queue_shutdown(), or
+// until save_batch_wait() on `hold` (may be NULL) returns.
+static bool save_crop_deferred(SaveQueue* q, SDL_Surface* src, const CropRegion* crop, const char* filename,
+                               SaveBatch* batch, SaveBatch* hold)
+{
+    SaveJob* job = calloc(1, sizeof(*job));
+    if (!job) return false;
+
+    job->src   = src;
+    job->crop  = *crop;
+    job->batch = batch;
+    job->hold  = hold;
+    snprintf(job->filename, sizeof(job->filename), "%s", filename);
+    save_queue_push(q, job);
+    return true;
+}
+
+// ──────────────────────────────────────────────── Tiled texture pyramid ────────────────────────────────────────────────
+// The image is never uploaded as a single texture. Each mip level is split
+// into TILE_SIZE tiles that are uploaded on first use and evicted LRU-first
+// once the VRAM budget is exceeded, so images far beyond the renderer's max
+// texture size still display and only the visible tiles cost VRAM.
+
+#define TILE_SIZE            512
+#define MAX_LEVELS            16
+#define DEFAULT_VRAM_MB      512
+#define MIP_BAND_ROWS         64
+#define DIFF_BLOCK            64     // granularity of reload diffs
+
+typedef struct {
+    SDL_Texture* tex;
+    Uint32       last_used;     // frame stamp for LRU eviction
+    SDL_ScaleMode mode;         // as last set; 0 (nearest) is SDL's default for new textures
+    bool         streaming;     // packed tile that tiles_refresh can patch in place
+} Tile;
+
+// CPU side of the pyramid; built off the UI thread, owns all of its levels
+typedef struct {
+    SDL_Surface* levels[MAX_LEVELS];    // [0] is the decoded image, the rest in its crop_format()
+    int          nlevels;
+} Pyramid;
+
+typedef struct {
+    SDL_Surface* surf;          // borrowed from the Pyramid
+    int          cols, rows;
+    Tile*        tiles;
+} TileLevel;
+
+typedef struct {
+    SDL_Renderer* renderer;
+    int           img_w, img_h;
+    int           tile_size;
+    int           nlevels;
+    TileLevel     levels[MAX_LEVELS];
+    size_t        vram_budget;  // bytes
+    size_t        vram_used;
+    Uint32        frame;
+    Uint32        tex_format;   // RGBA32 or BGRA32, whichever the renderer takes natively
+    Uint8*        scratch;      // one converted tile
+} TileCache;
+
+// One output row of the 2×2 box filter from rows `r0`/`r1` of `bpp`-byte
+// pixels that are `sw` wide; an odd last column is paired with itself
+static void mip_filter_row(const Uint8* r0, const Uint8* r1, int sw, Uint8* out, int dw, int bpp)
+{
+    for (int x = 0; x < dw; x++)
+    {
+        int x0 = 2 * x * bpp;
+        int x1 = (2 * x + 1 < sw) ? x0 + bpp : x0;
+        for (int c = 0; c < bpp; c++)
+            out[x * bpp + c] = (Uint8)((r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) >> 2);
+    }
+}
+
+// Empty surface in a crop format; gray gets its ramp
+static SDL_Surface* mip_surface(int w, int h, Uint32 format)
+{
+    SDL_Surface* s = SDL_CreateRGBSurfaceWithFormat(0, w, h, SDL_BITSPERPIXEL(format), format);
+    if (!s) return NULL;
+    prof_count(PROF_SURF_ALLOC);
+    if (s->format->palette) palette_set_gray(s->format->palette);
+    return s;
+}
+
+// 2×2 box-filtered half-size copy of `src` in its crop_format(), so gray
+// levels stay one byte per pixel and opaque ones three. Source rows in any
+// other format IMG_Load returns are converted in bands.
+static SDL_Surface* mip_downsample(SDL_Surface* src)
+{
+    int dw = (src->w + 1) / 2, dh = (src->h + 1) / 2;
+    Uint32 format = crop_format(src);
+    int bpp = SDL_BYTESPERPIXEL(format);
+    SDL_Surface* dst = mip_surface(dw, dh, format);
+    if (!dst) return NULL;
+
+    bool direct = src->format->format == format;
+    Uint8* band = NULL;
+    if (!direct) {
+        band = malloc((size_t)src->w * bpp * MIP_BAND_ROWS);
+        if (!band) { SDL_FreeSurface(dst); return NULL; }
+    }
+
+    for (int by = 0; by < src->h; by += MIP_BAND_ROWS)
+    {
+        int bh = SDL_min(MIP_BAND_ROWS, src->h - by);
+        const Uint8* rows;
+        int pitch;
+        if (direct) {
+            rows  = (const Uint8*)src->pixels + (size_t)by * src->pitch;
+            pitch = src->pitch;
+        } else {
+            CropRegion r = {0, by, src->w, bh};
+            pitch = src->w * bpp;
+            if (!extract_crop_as(src, &r, format, band, pitch)) {
+                free(band);
+                SDL_FreeSurface(dst);
+                return NULL;
+            }
+            rows = band;
+        }
+
+        // MIP_BAND_ROWS is even, so every band starts on an output row
+        for (int y = 0; y < bh; y += 2)
+        {
+            const Uint8* r0 = rows + (size_t)y * pitch;
+            const Uint8* r1 = (y + 1 < bh) ? r0 + pitch : r0;
+            mip_filter_row(r0, r1, src->w, (Uint8*)dst->pixels + (size_t)((by + y) / 2) * dst->pitch, dw, bpp);
+        }
+    }
+    free(band);
+    return dst;
+}
+
+// `r` (level-0 pixels) grown to whole texels of level `l`
+static SDL_Rect rect_at_level(const SDL_Rect* r, int l)
+{
+    int x0 = r->x >> l, y0 = r->y >> l;
+    int x1 = (r->x + r->w + (1 << l) - 1) >> l;
+    int y1 = (r->y + r->h + (1 << l) - 1) >> l;
+    SDL_Rect out = { x0, y0, x1 - x0, y1 - y0 };
+    return out;
+}
+
+// Recomputes the part of the half-size level `dst` (from mip_downsample)
+// that covers `r` (in `src` pixels), reading only the source rows and
+// columns it depends on
+static bool mip_update(SDL_Surface* src, SDL_Surface* dst, const SDL_Rect* r)
+{
+    int dx0 = r->x / 2, dy0 = r->y / 2;
+    int dx1 = SDL_min(dst->w, (r->x + r->w + 1) / 2);
+    int dy1 = SDL_min(dst->h, (r->y + r->h + 1) / 2);
+    if (dx1 <= dx0 || dy1 <= dy0) return true;
+
+    Uint32 format = dst->format->format;
+    int bpp = dst->format->BytesPerPixel;
+    int sx = 2 * dx0, sw = SDL_min(src->w, 2 * dx1) - sx;
+    Uint8* band = malloc((size_t)sw * bpp * MIP_BAND_ROWS);
+    if (!band) return false;
+
+    for (int dy = dy0; dy < dy1; dy += MIP_BAND_ROWS / 2)
+    {
+        int sy = 2 * dy;
+        int bh = SDL_min(MIP_BAND_ROWS, src->h - sy);
+        CropRegion c = { sx, sy, sw, bh };
+        if (!extract_crop_as(src, &c, format, band, sw * bpp)) { free(band); return false; }
+
+        int rows = SDL_min((bh + 1) / 2, dy1 - dy);
+        for (int y = 0; y < rows; y++)
+        {
+            const Uint8* r0 = band + (size_t)(2 * y) * sw * bpp;
+            const Uint8* r1 = (2 * y + 1 < bh) ? r0 + (size_t)sw * bpp : r0;
+            mip_filter_row(r0, r1, sw, (Uint8*)dst->pixels + (size_t)(dy + y) * dst->pitch + (size_t)dx0 * bpp,
+                           dx1 - dx0, bpp);
+        }
+    }
+    free(band);
+    return true;
+}
+
+static void pyramid_free(Pyramid* pyr)
+{
+    image_free(pyr->levels[0]);
+    for (int l = 1; l < pyr->nlevels; l++)
+        SDL_FreeSurface(pyr->levels[l]);
+    memset(pyr, 0, sizeof(*pyr));
+}
+
+// Takes ownership of `image` and adds half-size levels until one fits a tile
+static void pyramid_build(Pyramid* pyr, SDL_Surface* image, int tile_size)
+{
+    memset(pyr, 0, sizeof(*pyr));
+    SDL_Surface* level = image;
+    for (;;)
+    {
+        pyr->levels[pyr->nlevels++] = level;
+        if ((level->w <= tile_size && level->h <= tile_size) || pyr->nlevels == MAX_LEVELS)
+            break;
+
+        level = mip_downsample(level);
+        if (!level) break;          // coarser levels are an optimization only
+    }
+}
+
+// Rects (DIFF_BLOCK-aligned horizontal runs) where `a` and `b`, same size
+// and format, differ; NULL with *count 0 when they are identical, -1 when
+// out of memory. Rows that match as a whole cost a single memcmp.
+static SDL_Rect* image_diff(const SDL_Surface* a, const SDL_Surface* b, int* count)
+{
+    *count = 0;
+    int bpp = a->format->BytesPerPixel;
+    int bcols = (a->w + DIFF_BLOCK - 1) / DIFF_BLOCK;
+    Uint8* mark = malloc((size_t)bcols);
+    SDL_Rect* rects = NULL;
+    int cap = 0;
+    if (!mark) { *count = -1; return NULL; }
+
+    for (int by = 0; by < a->h; by += DIFF_BLOCK)
+    {
+        int bh = SDL_min(DIFF_BLOCK, a->h - by);
+        memset(mark, 0, (size_t)bcols);
+        for (int y = by; y < by + bh; y++)
+        {
+            const Uint8* ra = (const Uint8*)a->pixels + (size_t)y * a->pitch;
+            const Uint8* rb = (const Uint8*)b->pixels + (size_t)y * b->pitch;
+            if (!memcmp(ra, rb, (size_t)a->w * bpp)) continue;
+            for (int c = 0; c < bcols; c++) {
+                size_t off = (size_t)c * DIFF_BLOCK * bpp;
+                size_t len = (size_t)(SDL_min(DIFF_BLOCK, a->w - c * DIFF_BLOCK)) * bpp;
+                if (!mark[c] && memcmp(ra + off, rb + off, len)) mark[c] = 1;
+            }
+        }
+
+        for (int c = 0; c < bcols; c++)
+        {
+            if (!mark[c]) continue;
+            int end = c;
+            while (end < bcols && mark[end]) end++;
+            if (*count == cap) {
+                cap = cap ? cap * 2 : 16;
+                SDL_Rect* grown = realloc(rects, (size_t)cap * sizeof(*rects));
+                if (!grown) { free(rects); free(mark); *count = -1; return NULL; }
+                rects = grown;
+            }
+            int x = c * DIFF_BLOCK;
+            rects[(*count)++] = (SDL_Rect){ x, by, SDL_min(end * DIFF_BLOCK, a->w) - x, bh };
+            c = end;
+        }
+    }
+    free(mark);
+    return rects;
+}
+
+// Builds the pyramid of `image`, a new version of old->levels[0] with the
+// same size and format, by copying `old` and refiltering only the level-0
+// rects in `dirty`. Takes ownership of `image` on success.
+static bool pyramid_patch(Pyramid* pyr, const Pyramid* old, SDL_Surface* image,
+                          const SDL_Rect* dirty, int ndirty)
+{
+    memset(pyr, 0, sizeof(*pyr));
+    pyr->levels[pyr->nlevels++] = image;
+    bool ok = true;
+    for (int l = 1; l < old->nlevels && ok; l++)
+    {
+        SDL_Surface* o = old->levels[l];
+        SDL_Surface* s = mip_surface(o->w, o->h, o->format->format);
+        if (!s) break;
+        for (int y = 0; y < o->h; y++)
+            memcpy((Uint8*)s->pixels + (size_t)y * s->pitch, (const Uint8*)o->pixels + (size_t)y * o->pitch,
+                   (size_t)o->w * o->format->BytesPerPixel);
+        pyr->levels[pyr->nlevels++] = s;
+
+        for (int i = 0; i < ndirty && ok; i++) {
+            SDL_Rect r = rect_at_level(&dirty[i], l - 1);
+            ok = mip_update(pyr->levels[l - 1], s, &r);
+        }
+    }
+    if (ok && pyr->nlevels == old->nlevels) return true;
+
+    // The tile caches expect the old level count; let the caller rebuild
+    pyr->levels[0] = NULL;
+    pyramid_free(pyr);
+    return false;
+}
+
+// Largest tile edge the renderer accepts, capped at TILE_SIZE
+static int tiles_max_size(SDL_Renderer* renderer)
+{
+    int ts = TILE_SIZE;
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(renderer, &info) == 0) {
+        if (info.max_texture_width  > 0) ts = SDL_min(ts, info.max_texture_width);
+        if (info.max_texture_height > 0) ts = SDL_min(ts, info.max_texture_height);
+    }
+    return ts;
+}
+
+// RGBA32/BGRA32 byte order the renderer supports natively, so uploads of
+// kernel-converted tiles need no second conversion inside SDL
+static Uint32 tiles_texture_format(SDL_Renderer* renderer)
+{
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(renderer, &info) == 0) {
+        for (Uint32 i = 0; i < info.num_texture_formats; i++)
+            if (info.texture_formats[i] == SDL_PIXELFORMAT_BGRA32 ||
+                info.texture_formats[i] == SDL_PIXELFORMAT_RGBA32)
+                return info.texture_formats[i];
+    }
+    return SDL_PIXELFORMAT_RGBA32;
+}
+
+// Drops every uploaded tile but keeps the cache usable
+static void tiles_release(TileCache* tc)
+{
+    for (int l = 0; l < tc->nlevels; l++)
+    {
+        TileLevel* lv = &tc->levels[l];
+        for (int i = 0; i < lv->cols * lv->rows; i++)
+            if (lv->tiles[i].tex) {
+                SDL_DestroyTexture(lv->tiles[i].tex);
+                lv->tiles[i].tex  = NULL;
+                lv->tiles[i].mode = SDL_ScaleModeNearest;
+            }
+    }
+    tc->vram_used = 0;
+}
+
+static void tiles_destroy(TileCache* tc)
+{
+    tiles_release(tc);
+    for (int l = 0; l < tc->nlevels; l++)
+        free(tc->levels[l].tiles);
+    free(tc->scratch);
+    memset(tc, 0, sizeof(*tc));
+}
+
+static bool tiles_init(TileCache* tc, SDL_Renderer* renderer, const Pyramid* pyr,
+                       int tile_size, size_t vram_budget)
+{
+    memset(tc, 0, sizeof(*tc));
+    tc->renderer    = renderer;
+    tc->img_w       = pyr->levels[0]->w;
+    tc->img_h       = pyr->levels[0]->h;
+    tc->vram_budget = vram_budget;
+    tc->tile_size   = tile_size;
+    tc->tex_format  = tiles_texture_format(renderer);
+    tc->scratch     = malloc((size_t)tile_size * tile_size * 4);
+    if (!tc->scratch) return false;
+
+    for (int l = 0; l < pyr->nlevels; l++)
+    {
+        TileLevel* lv = &tc->levels[tc->nlevels++];
+        lv->surf  = pyr->levels[l];
+        lv->cols  = (lv->surf->w + tile_size - 1) / tile_size;
+        lv->rows  = (lv->surf->h + tile_size - 1) / tile_size;
+        lv->tiles = calloc((size_t)lv->cols * lv->rows, sizeof(Tile));
+        if (!lv->tiles) { tiles_destroy(tc); return false; }
+    }
+    return true;
+}
+
+// Picks the coarsest level that still has at least one texel per screen pixel
+static int tiles_pick_level(const TileCache* tc, float s)
+{
+    int lvl = 0;
+    while (lvl + 1 < tc->nlevels && s * (1 << (lvl + 1)) <= 1.0f)
+        lvl++;
+    return lvl;
+}
+
+static void tiles_evict_for(TileCache* tc, size_t bytes)
+{
+    while (tc->vram_used + bytes > tc->vram_budget)
+    {
+        Tile* lru = NULL;
+        for (int l = 0; l < tc->nlevels; l++) {
+            TileLevel* lv = &tc->levels[l];
+            for (int i = 0; i < lv->cols * lv->rows; i++) {
+                Tile* t = &lv->tiles[i];
+                if (t->tex && t->last_used != tc->frame && (!lru || t->last_used < lru->last_used))
+                    lru = t;
+            }
+        }
+        if (!lru) return;           // everything resident is on screen; go over budget this frame
+
+        int w, h;
+        SDL_QueryTexture(lru->tex, NULL, NULL, &w, &h);
+        SDL_DestroyTexture(lru->tex);
+        lru->tex  = NULL;
+        lru->mode = SDL_ScaleModeNearest;
+        tc->vram_used -= (size_t)w * h * 4;
+    }
+}
+
+static SDL_Texture* tiles_get(TileCache* tc, int lvl, int col, int row)
+{
+    TileLevel* lv = &tc->levels[lvl];
+    Tile* t = &lv->tiles[row * lv->cols + col];
+    t->last_used = tc->frame;
+    if (t->tex) return t->tex;
+
+    int ts = tc->tile_size;
+    int tx = col * ts, ty = row * ts;
+    int tw = SDL_min(ts, lv->surf->w - tx);
+    int th = SDL_min(ts, lv->surf->h - ty);
+    size_t bytes = (size_t)tw * th * 4;
+    tiles_evict_for(tc, bytes);
+
+    SDL_Surface* src = lv->surf;
+    Uint8* p = (Uint8*)src->pixels + (size_t)ty * src->pitch + (size_t)tx * src->format->BytesPerPixel;
+
+    // Packed formats: convert with the row kernels (or upload in place when
+    // the layout already matches) into a texture of the renderer's format.
+    // Streaming only under --watch, so a reload of the file rewrites just
+    // the rects that changed; otherwise static, which drivers place better.
+    ByteLayout layout;
+    if (byte_layout(src->format->format, &layout))
+    {
+        int access = watch_inputs ? SDL_TEXTUREACCESS_STREAMING : SDL_TEXTUREACCESS_STATIC;
+        t->tex = SDL_CreateTexture(tc->renderer, tc->tex_format, access, tw, th);
+        if (!t->tex) return NULL;
+        prof_count(PROF_TEX_CREATE);
+        t->streaming = watch_inputs;
+
+        if (src->format->format == tc->tex_format) {
+            SDL_UpdateTexture(t->tex, NULL, p, src->pitch);
+        } else {
+            pixels_convert(tw, th, src->format->format, p, src->pitch, tc->tex_format, tc->scratch, tw * 4);
+            SDL_UpdateTexture(t->tex, NULL, tc->scratch, tw * 4);
+        }
+        SDL_SetTextureBlendMode(t->tex, layout.alpha ? SDL_BLENDMODE_BLEND : SDL_BLENDMODE_NONE);
+        tc->vram_used += bytes;
+        return t->tex;
+    }
+
+    // Anything else (indexed): zero-copy view of the tile, SDL converts
+    SDL_Surface* view = SDL_CreateRGBSurfaceWithFormatFrom(p, tw, th, src->format->BitsPerPixel,
+                                                           src->pitch, src->format->format);
+    if (!view) return NULL;
+    prof_count(PROF_SURF_ALLOC);
+    if (src->format->palette) SDL_SetSurfacePalette(view, src->format->palette);
+
+    t->tex = SDL_CreateTextureFromSurface(tc->renderer, view);
+    prof_count(PROF_TEX_CREATE);
+    t->streaming = false;
+    SDL_FreeSurface(view);
+    if (t->tex) tc->vram_used += bytes;
+    return t->tex;
+}
+
+// Points the cache at `pyr`, a reload with the same size and level count,
+// and brings resident tiles up to date: streaming tiles get just the dirty
+// rects (level-0 pixels) rewritten through SDL_LockTexture, anything else
+// that intersects them is dropped and uploaded again on next use.
+static void tiles_refresh(TileCache* tc, const Pyramid* pyr, const SDL_Rect* dirty, int ndirty)
+{
+    int ts = tc->tile_size;
+    for (int l = 0; l < tc->nlevels; l++)
+    {
+        TileLevel* lv = &tc->levels[l];
+        SDL_Surface* src = lv->surf = pyr->levels[l];
+        int bpp = src->format->BytesPerPixel;
+
+        for (int i = 0; i < ndirty; i++)
+        {
+            SDL_Rect r = rect_at_level(&dirty[i], l);
+            int x1 = SDL_min(src->w, r.x + r.w), y1 = SDL_min(src->h, r.y + r.h);
+            if (x1 <= r.x || y1 <= r.y) continue;
+
+            for (int row = r.y / ts; row <= (y1 - 1) / ts; row++)
+            {
+                for (int col = r.x / ts; col <= (x1 - 1) / ts; col++)
+                {
+                    Tile* t = &lv->tiles[row * lv->cols + col];
+                    if (!t->tex) continue;
+
+                    if (!t->streaming) {
+                        int w, h;
+                        SDL_QueryTexture(t->tex, NULL, NULL, &w, &h);
+                        SDL_DestroyTexture(t->tex);
+                        t->tex  = NULL;
+                        t->mode = SDL_ScaleModeNearest;
+                        tc->vram_used -= (size_t)w * h * 4;
+                        continue;
+                    }
+
+                    int tx = col * ts, ty = row * ts;
+                    int x0 = SDL_max(r.x, tx), y0 = SDL_max(r.y, ty);
+                    SDL_Rect local = { x0 - tx, y0 - ty,
+                                       SDL_min(x1, tx + ts) - x0, SDL_min(y1, ty + ts) - y0 };
+                    const Uint8* in = (const Uint8*)src->pixels + (size_t)y0 * src->pitch + (size_t)x0 * bpp;
+                    void* px;
+                    int pitch;
+                    if (SDL_LockTexture(t->tex, &local, &px, &pitch) == 0) {
+                        pixels_convert(local.w, local.h, src->format->format, in, src->pitch,
+                                       tc->tex_format, px, pitch);
+                        SDL_UnlockTexture(t->tex);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Draws the tiles of level `lvl` that intersect `visible` (image coordinates),
+// mapping image point (x, y) to screen point (ox + x*sx, oy + y*sy).
+static void tiles_draw(TileCache* tc, int lvl, const SDL_Rect* visible,
+                       float sx, float sy, float ox, float oy)
+{
+    TileLevel* lv = &tc->levels[lvl];
+    int ts = tc->tile_size;
+
+    // Level texel → image pixel; exact at the right/bottom edges despite rounding up
+    float fx = (float)tc->img_w / lv->surf->w;
+    float fy = (float)tc->img_h / lv->surf->h;
+
+    int c0 = SDL_max(0, (int)(visible->x / fx) / ts);
+    int r0 = SDL_max(0, (int)(visible->y / fy) / ts);
+    int c1 = SDL_min(lv->cols - 1, (int)((visible->x + visible->w) / fx) / ts);
+    int r1 = SDL_min(lv->rows - 1, (int)((visible->y + visible->h) / fy) / ts);
+
+    // Linear filtering, except zoomed in past 2x to show individual pixels
+    SDL_ScaleMode mode = fx * sx >= 2.0f ? SDL_ScaleModeNearest : SDL_ScaleModeLinear;
+
+    for (int r = r0; r <= r1; r++)
+    {
+        for (int c = c0; c <= c1; c++)
+        {
+            SDL_Texture* tex = tiles_get(tc, lvl, c, r);
+            if (!tex) continue;
+            Tile* t = &lv->tiles[r * lv->cols + c];
+            if (t->mode != mode) {
+                SDL_SetTextureScaleMode(tex, mode);
+                t->mode = mode;
+            }
+
+            int tw = SDL_min(ts, lv->surf->w - c * ts);
+            int th = SDL_min(ts, lv->surf->h - r * ts);
+            SDL_FRect dst = {
+                ox + c * ts * fx * sx,
+                oy + r * ts * fy * sy,
+                tw * fx * sx,
+                th * fy * sy
+            };
+            SDL_RenderCopyF(tc->renderer, tex, NULL, &dst);
+        }
+    }
+}
+
+static void tiles_end_frame(TileCache* tc)
+{
+    tc->frame++;
+}
+
+// Uploads a whole (small) level ahead of time so the first draw is instant
+#define PREWARM_MAX_TILES 16
+
+static void tiles_prewarm(TileCache* tc, int lvl)
+{
+    TileLevel* lv = &tc->levels[lvl];
+    if (lv->cols * lv->rows > PREWARM_MAX_TILES) return;
+    for (int r = 0; r < lv->rows; r++)
+        for (int c = 0; c < lv->cols; c++)
+            tiles_get(tc, lvl, c, r);
+}
+
+// ──────────────────────────────────────────────── Decoded image cache ────────────────────────────────────────────────
+// --cache DIR keeps every decoded pyramid on disk as one file: a header,
+// then each level's rows at page-aligned offsets. A later launch maps that
+// file instead of decoding, so the tiles and crops page in on demand
+// exactly like a mapped PNM, and --batch reads level 0 from it too. Entries
+// are named by a hash of the absolute path and checked against the
+// source's size, mtime and a hash of its first and last 64 KiB; writes go
+// to a temporary file that is renamed into place, so concurrent instances
+// never see a half-written entry. Indexed images and inputs that are
+// already mapped are not cached.
+
+#define CACHE_MAGIC     "CCPYR001"
+#define CACHE_ALIGN     4096
+#define CACHE_SAMPLE   (64 * 1024)      // bytes hashed at each end of the source
+
+static const char* cache_dir;           // NULL = disabled
+
+#ifndef _WIN32
+
+typedef struct {
+    char   magic[8];
+    Uint64 src_size;
+    Sint64 src_mtime;
+    Uint64 src_hash;
+    Uint32 tile_size;
+    Uint32 nlevels;
+    struct {
+        Uint32 w, h, pitch, format;
+        Uint64 offset;
+    } levels[MAX_LEVELS];
+    char   path[1024];
+} CacheHeader;
+
+static Uint64 fnv1a(Uint64 h, const void* data, size_t len)
+{
+    const Uint8* p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Fills the identity fields of `hdr` for `path` and the entry's filename
+static bool cache_identify(const char* path, CacheHeader* hdr, char* entry, size_t size)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    char abs[PATH_MAX];
+    if (!realpath(path, abs) || strlen(abs) >= sizeof(hdr->path)) return false;
+    strcpy(hdr->path, abs);
+
+    int fd = open(hdr->path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    Uint8* buf = malloc(CACHE_SAMPLE);
+    bool ok = buf && fstat(fd, &st) == 0;
+    Uint64 h = 0xcbf29ce484222325ULL;
+    if (ok) {
+        ssize_t n = pread(fd, buf, CACHE_SAMPLE, 0);
+        ok = n >= 0;
+        if (ok) h = fnv1a(h, buf, (size_t)n);
+        if (ok && st.st_size > CACHE_SAMPLE) {
+            n = pread(fd, buf, CACHE_SAMPLE, st.st_size - CACHE_SAMPLE);
+            ok = n >= 0;
+            if (ok) h = fnv1a(h, buf, (size_t)n);
+        }
+    }
+    free(buf);
+    close(fd);
+    if (!ok) return false;
+
+    memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->src_size  = (Uint64)st.st_size;
+    hdr->src_mtime = (Sint64)st.st_mtime;
+    hdr->src_hash  = h;
+    snprintf(entry, size, "%s/%016llx.pyr", cache_dir,
+             (unsigned long long)fnv1a(0xcbf29ce484222325ULL, hdr->path, strlen(hdr->path)));
+    return true;
+}
+
+// Maps the cached pyramid of `path`. `tile_size` 0 accepts an entry built
+// for any tile size (level 0 is all --batch needs).
+static bool cache_load(const char* path, int tile_size, Pyramid* pyr)
+{
+    if (!cache_dir) return false;
+    CacheHeader want;
+    char entry[1100];
+    if (!cache_identify(path, &want, entry, sizeof(entry))) return false;
+
+    int fd = open(entry, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    Uint8* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return false;
+
+    const CacheHeader* hdr = (const CacheHeader*)p;
+    bool ok = memcmp(hdr->magic, want.magic, sizeof(hdr->magic)) == 0 &&
+              hdr->src_size == want.src_size && hdr->src_mtime == want.src_mtime &&
+              hdr->src_hash == want.src_hash && strcmp(hdr->path, want.path) == 0 &&
+              (tile_size == 0 || hdr->tile_size == (Uint32)tile_size) &&
+              hdr->nlevels >= 1 && hdr->nlevels <= MAX_LEVELS;
+
+    memset(pyr, 0, sizeof(*pyr));
+    for (Uint32 l = 0; ok && l < hdr->nlevels; l++)
+    {
+        Uint32 fmt = hdr->levels[l].format;
+        ByteLayout layout;
+        ok = byte_layout(fmt, &layout) && hdr->levels[l].w > 0 && hdr->levels[l].h > 0 &&
+             hdr->levels[l].w <= INT_MAX / 4 && hdr->levels[l].pitch >= hdr->levels[l].w * layout.bpp &&
+             hdr->levels[l].offset <= size &&
+             (Uint64)hdr->levels[l].pitch * hdr->levels[l].h <= size - hdr->levels[l].offset;
+        if (!ok) break;
+        SDL_Surface* s = SDL_CreateRGBSurfaceWithFormatFrom(p + hdr->levels[l].offset,
+                                                           (int)hdr->levels[l].w, (int)hdr->levels[l].h,
+                                                           layout.bpp * 8, (int)hdr->levels[l].pitch, fmt);
+        if (!s) { ok = false; break; }
+        pyr->levels[pyr->nlevels++] = s;
+    }
+
+    MappedFile* mf = ok ? malloc(sizeof(*mf)) : NULL;
+    if (!mf) {
+        for (int l = 0; l < pyr->nlevels; l++) SDL_FreeSurface(pyr->levels[l]);
+        memset(pyr, 0, sizeof(*pyr));
+        munmap(p, size);
+        return false;
+    }
+    // Level 0 owns the mapping (image_free unmaps); the others are views into it
+    mf->base   = p;
+    mf->size   = size;
+    mf->source = false;     // entries are only ever replaced by rename
+    pyr->levels[0]->userdata = mf;
+    return true;
+}
+
+static void cache_store(const char* path, const Pyramid* pyr, int tile_size)
+{
+    if (!cache_dir || pyr->nlevels == 0 || pyr->levels[0]->userdata) return;
+
+    CacheHeader hdr;
+    char entry[1100], tmp[1200];
+    if (!cache_identify(path, &hdr, entry, sizeof(entry))) return;
+    hdr.tile_size = (Uint32)tile_size;
+    hdr.nlevels   = (Uint32)pyr->nlevels;
+
+    Uint64 offset = (sizeof(hdr) + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+    for (int l = 0; l < pyr->nlevels; l++)
+    {
+        const SDL_Surface* s = pyr->levels[l];
+        ByteLayout layout;
+        if (!byte_layout(s->format->format, &layout)) return;
+        hdr.levels[l].w      = (Uint32)s->w;
+        hdr.levels[l].h      = (Uint32)s->h;
+        hdr.levels[l].pitch  = (Uint32)s->w * layout.bpp;
+        hdr.levels[l].format = s->format->format;
+        hdr.levels[l].offset = offset;
+        offset += ((Uint64)hdr.levels[l].pitch * s->h + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", entry, (int)getpid());
+    FILE* f = fopen(tmp, "wb");
+    if (!f) return;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (int l = 0; ok && l < pyr->nlevels; l++)
+    {
+        const SDL_Surface* s = pyr->levels[l];
+        ok = fseeko(f, (off_t)hdr.levels[l].offset, SEEK_SET) == 0;
+        for (int y = 0; ok && y < s->h; y++)
+            ok = fwrite((const Uint8*)s->pixels + (size_t)y * s->pitch, hdr.levels[l].pitch, 1, f) == 1;
+    }
+    // Pad the last level to its aligned end so the offsets stay inside the file
+    ok = ok && fseeko(f, (off_t)offset - 1, SEEK_SET) == 0 && fputc(0, f) != EOF;
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(tmp, entry) != 0) {
+        fprintf(stderr, "Warning: cannot write cache entry %s\n", entry);
+        remove(tmp);
+    }
+}
+
+#else
+
+static bool cache_load(const char* path, int tile_size, Pyramid* pyr)
+{
+    (void)path; (void)tile_size; (void)pyr;
+    return false;
+}
+static void cache_store(const char* path, const Pyramid* pyr, int tile_size) { (void)path; (void)pyr; (void)tile_size; }
+
+#endif
+
+// load_image() that serves level 0 of a cached pyramid when there is one
+static SDL_Surface* load_image_cached(const char* path)
+{
+    Pyramid pyr;
+    if (!cache_load(path, 0, &pyr)) return load_image(path);
+    for (int l = 1; l < pyr.nlevels; l++) SDL_FreeSurface(pyr.levels[l]);
+    return pyr.levels[0];
+}
+
+// ──────────────────────────────────────────────── Glyph atlas text ────────────────────────────────────────────────
+// Printable ASCII is rasterized once into a single white atlas texture. Text
+// lines are laid out as colored quads and drawn with one SDL_RenderGeometry
+// call; the vertex data is only rebuilt when the text actually changes.
+
+#define ATLAS_FIRST_CHAR   32
+#define ATLAS_LAST_CHAR   126
+#define ATLAS_NUM_CHARS   (ATLAS_LAST_CHAR - ATLAS_FIRST_CHAR + 1)
+#define ATLAS_WIDTH       512
+#define TEXT_MAX_LINES      6
+
+typedef struct {
+    SDL_Rect src;               // glyph cell in the atlas
+    int      xoff;              // cell offset from the pen position
+    int      advance;
+} Glyph;
+
+typedef struct {
+    TTF_Font*    font;
+    SDL_Texture* tex;
+    int          tex_w, tex_h;
+    Glyph        glyphs[ATLAS_NUM_CHARS];
+} GlyphAtlas;
+
+typedef struct {
+    const char* text;
+    SDL_Color   color;
+    float       x, y;
+} TextLine;
+
+typedef struct {
+    char        key[1024];      // everything the current vertices were built from
+    SDL_Vertex* verts;
+    int*        indices;
+    int         nverts, nindices, cap_quads;
+} TextBatch;
+
+static void atlas_destroy(GlyphAtlas* ga)
+{
+    if (ga->tex) SDL_DestroyTexture(ga->tex);
+    memset(ga, 0, sizeof(*ga));
+}
+
+static bool atlas_build(GlyphAtlas* ga, SDL_Renderer* renderer, TTF_Font* font)
+{
+    memset(ga, 0, sizeof(*ga));
+    ga->font = font;
+
+    SDL_Color white = {255, 255, 255, 255};
+    SDL_Surface* cells[ATLAS_NUM_CHARS] = {0};
+
+    // Render every glyph and shelf-pack the cells
+    int pen_x = 0, pen_y = 0, shelf_h = 0;
+    for (int i = 0; i < ATLAS_NUM_CHARS; i++)
+    {
+        Uint16 ch = (Uint16)(ATLAS_FIRST_CHAR + i);
+        Glyph* g = &ga->glyphs[i];
+        int minx = 0, maxx, miny, maxy;
+        TTF_GlyphMetrics(font, ch, &minx, &maxx, &miny, &maxy, &g->advance);
+        g->xoff = minx < 0 ? minx : 0;
+
+        cells[i] = TTF_RenderGlyph_Blended(font, ch, white);
+        if (!cells[i]) continue;
+        prof_count(PROF_SURF_ALLOC);
+
+        if (pen_x + cells[i]->w > ATLAS_WIDTH) {
+            pen_x = 0;
+            pen_y += shelf_h + 1;
+            shelf_h = 0;
+        }
+        g->src = (SDL_Rect){pen_x, pen_y, cells[i]->w, cells[i]->h};
+        pen_x += cells[i]->w + 1;
+        shelf_h = SDL_max(shelf_h, cells[i]->h);
+    }
+
+    ga->tex_w = ATLAS_WIDTH;
+    ga->tex_h = pen_y + shelf_h;
+    SDL_Surface* sheet = SDL_CreateRGBSurfaceWithFormat(0, ga->tex_w, SDL_max(ga->tex_h, 1), 32, SDL_PIXELFORMAT_RGBA32);
+
+    for (int i = 0; i < ATLAS_NUM_CHARS; i++)
+    {
+        if (!cells[i]) continue;
+        if (sheet) {
+            SDL_Rect dst = ga->glyphs[i].src;
+            SDL_SetSurfaceBlendMode(cells[i], SDL_BLENDMODE_NONE);
+            SDL_BlitSurface(cells[i], NULL, sheet, &dst);
+        }
+        SDL_FreeSurface(cells[i]);
+    }
+    if (!sheet) return false;
+
+    ga->tex = SDL_CreateTextureFromSurface(renderer, sheet);
+    prof_count(PROF_SURF_ALLOC);
+    prof_count(PROF_TEX_CREATE);
+    SDL_FreeSurface(sheet);
+    if (!ga->tex) return false;
+    SDL_SetTextureBlendMode(ga->tex, SDL_BLENDMODE_BLEND);
+    return true;
+}
+
+static bool text_batch_reserve(TextBatch* tb, int quads)
+{
+    if (quads <= tb->cap_quads) return true;
+
+    int cap = SDL_max(quads, tb->cap_quads * 2);
+    SDL_Vertex* v = realloc(tb->verts, (size_t)cap * 4 * sizeof(*v));
+    if (!v) return false;
+    tb->verts = v;
+    int* idx = realloc(tb->indices, (size_t)cap * 6 * sizeof(*idx));
+    if (!idx) return false;
+    tb->indices = idx;
+    tb->cap_quads = cap;
+    return true;
+}
+
+static void text_batch_free(TextBatch* tb)
+{
+    free(tb->verts);
+    free(tb->indices);
+    memset(tb, 0, sizeof(*tb));
+}
+
+// Rebuilds the quads for `lines` unless they match what the batch already holds
+static void text_batch_layout(TextBatch* tb, const GlyphAtlas* ga, const TextLine* lines, int nlines)
+{
+    char key[sizeof(tb->key)];
+    int klen = 0;
+    for (int i = 0; i < nlines && klen < (int)sizeof(key); i++) {
+        const SDL_Color* c = &lines[i].color;
+        klen += snprintf(key + klen, sizeof(key) - klen, "%g,%g,%02x%02x%02x%02x:%s\n",
+                         lines[i].x, lines[i].y, c->r, c->g, c->b, c->a, lines[i].text);
+    }
+    if (tb->verts && strcmp(key, tb->key) == 0) return;
+    snprintf(tb->key, sizeof(tb->key), "%s", key);
+
+    tb->nverts = tb->nindices = 0;
+    for (int i = 0; i < nlines; i++)
+    {
+        const TextLine* ln = &lines[i];
+        if (!text_batch_reserve(tb, tb->nverts / 4 + (int)strlen(ln->text))) return;
+
+        float pen = ln->x;
+        Uint16 prev = 0;
+        for (const char* p = ln->text; *p; p++)
+        {
+            Uint16 ch = (Uint8)*p;
+            if (ch < ATLAS_FIRST_CHAR || ch > ATLAS_LAST_CHAR) ch = '?';
+            const Glyph* g = &ga->glyphs[ch - ATLAS_FIRST_CHAR];
+
+            if (prev) pen += TTF_GetFontKerningSizeGlyphs(ga->font, prev, ch);
+            prev = ch;
+
+            if (g->src.w > 0 && g->src.h > 0)
+            {
+                float x0 = pen + g->xoff, y0 = ln->y;
+                float x1 = x0 + g->src.w, y1 = y0 + g->src.h;
+                float u0 = (float)g->src.x / ga->tex_w, v0 = (float)g->src.y / ga->tex_h;
+                float u1 = (float)(g->src.x + g->src.w) / ga->tex_w;
+                float v1 = (float)(g->src.y + g->src.h) / ga->tex_h;
+
+                int base = tb->nverts;
+                SDL_Vertex* v = &tb->verts[base];
+                v[0] = (SDL_Vertex){{x0, y0}, ln->color, {u0, v0}};
+                v[1] = (SDL_Vertex){{x1, y0}, ln->color, {u1, v0}};
+                v[2] = (SDL_Vertex){{x1, y1}, ln->color, {u1, v1}};
+                v[3] = (SDL_Vertex){{x0, y1}, ln->color, {u0, v1}};
+                int* ix = &tb->indices[tb->nindices];
+                ix[0] = base; ix[1] = base + 1; ix[2] = base + 2;
+                ix[3] = base; ix[4] = base + 2; ix[5] = base + 3;
+                tb->nverts += 4;
+                tb->nindices += 6;
+            }
+            pen += g->advance;
+        }
+    }
+}
+
+static void text_batch_draw(const TextBatch* tb, SDL_Renderer* renderer, const GlyphAtlas* ga)
+{
+    if (tb->nindices > 0)
+        SDL_RenderGeometry(renderer, ga->tex, tb->verts, tb->nverts, tb->indices, tb->nindices);
+}
+
+// ──────────────────────────────────────────────── Overlay geometry ────────────────────────────────────────────────
+// Untextured, per-vertex-colored quads for the crop overlay (dimming,
+// region outlines, handles), collected over a frame and submitted with one
+// SDL_RenderGeometry call instead of a draw call per rectangle and color.
+
+typedef struct {
+    SDL_Vertex* verts;
+    int*        indices;
+    int         nverts, nindices;
+    int         cap_quads;
+} QuadBatch;
+
+static bool quad_batch_reserve(QuadBatch* qb, int quads)
+{
+    if (quads <= qb->cap_quads) return true;
+
+    int cap = SDL_max(quads, SDL_max(qb->cap_quads * 2, 64));
+    SDL_Vertex* v = realloc(qb->verts, (size_t)cap * 4 * sizeof(*v));
+    if (!v) return false;
+    qb->verts = v;
+    int* idx = realloc(qb->indices, (size_t)cap * 6 * sizeof(*idx));
+    if (!idx) return false;
+    qb->indices = idx;
+    qb->cap_quads = cap;
+    return true;
+}
+
+static void quad_batch_free(QuadBatch* qb)
+{
+    free(qb->verts);
+    free(qb->indices);
+    memset(qb, 0, sizeof(*qb));
+}
+
+// Empty rectangles are dropped (callers pass unclamped edge maths)
+static void quad_batch_rect(QuadBatch* qb, float x, float y, float w, float h, SDL_Color c)
+{
+    if (w <= 0 || h <= 0 || !quad_batch_reserve(qb, qb->nverts / 4 + 1)) return;
+
+    int base = qb->nverts;
+    SDL_Vertex* v = &qb->verts[base];
+    v[0] = (SDL_Vertex){{x,     y    }, c, {0, 0}};
+    v[1] = (SDL_Vertex){{x + w, y    }, c, {0, 0}};
+    v[2] = (SDL_Vertex){{x + w, y + h}, c, {0, 0}};
+    v[3] = (SDL_Vertex){{x,     y + h}, c, {0, 0}};
+    int* ix = &qb->indices[qb->nindices];
+    ix[0] = base; ix[1] = base + 1; ix[2] = base + 2;
+    ix[3] = base; ix[4] = base + 2; ix[5] = base + 3;
+    qb->nverts += 4;
+    qb->nindices += 6;
+}
+
+// Four `t`-thick edges just inside the rectangle
+static void quad_batch_frame(QuadBatch* qb, float x, float y, float w, float h, float t, SDL_Color c)
+{
+    quad_batch_rect(qb, x, y, w, t, c);
+    quad_batch_rect(qb, x, y + h - t, w, t, c);
+    quad_batch_rect(qb, x, y + t, t, h - 2 * t, c);
+    quad_batch_rect(qb, x + w - t, y + t, t, h - 2 * t, c);
+}
+
+// Submits and empties the batch; alpha-blended, as the overlay colors expect
+static void quad_batch_draw(QuadBatch* qb, SDL_Renderer* renderer)
+{
+    if (qb->nindices > 0) {
+        SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+        SDL_RenderGeometry(renderer, NULL, qb->verts, qb->nverts, qb->indices, qb->nindices);
+    }
+    qb->nverts = qb->nindices = 0;
+}
+
+// ──────────────────────────────────────────────── Image session & prefetch ────────────────────────────────────────────────
+// The session is a list of files (directories are expanded). A loader thread
+// decodes the current image first, then the next `ahead` images and the
+// previous one, building each pyramid off the UI thread. The UI thread only
+// creates the tile caches, so switching to a prefetched image is instant.
+// With --watch the current file is polled, and a changed file is reloaded on
+// the same thread, diffed in DIFF_BLOCK blocks against what is on screen and
+// patched into the streaming tiles, so the upload is the size of the edit.
+
+#define DEFAULT_PREFETCH       2
+#define MAX_PREFETCH           8
+#define PREFETCH_SLOTS        (MAX_PREFETCH + 3)    // current + previous + ahead + one in flight
+#define LOADING_PREVIEW_MAX 1024    // longest side of the preview shown while a JPEG decodes
+#define WATCH_INTERVAL_MS    1000    // --watch: how often the current file is stat()ed
+
+typedef struct {
+    char** paths;
+    int    count;
+} ImageList;
+
+static bool has_image_ext(const char* name)
+{
+    static const char* exts[] = {
+        ".png", ".jpg", ".jpeg", ".bmp", ".gif", ".tga", ".tif", ".tiff",
+        ".webp", ".pnm", ".ppm", ".pgm", ".qoi"
+    };
+    const char* dot = strrchr(name, '.');
+    if (!dot) return false;
+    for (size_t i = 0; i < SDL_arraysize(exts); i++)
+        if (SDL_strcasecmp(dot, exts[i]) == 0) return true;
+    return false;
+}
+
+static bool image_list_push(ImageList* list, const char* path)
+{
+    char** grown = realloc(list->paths, (size_t)(list->count + 1) * sizeof(*grown));
+    if (!grown) return false;
+    list->paths = grown;
+    list->paths[list->count] = SDL_strdup(path);
+    return list->paths[list->count++] != NULL;
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Adds `path` itself, or every image file in it (sorted) if it is a directory
+static bool image_list_add(ImageList* list, const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return image_list_push(list, path);
+
+    DIR* dir = opendir(path);
+    if (!dir) return false;
+
+    int first = list->count;
+    struct dirent* de;
+    while ((de = readdir(dir)))
+    {
+        if (de->d_name[0] == '.' || !has_image_ext(de->d_name)) continue;
+        char full[1024];
+        snprintf(full, sizeof(full), "%s/%s", path, de->d_name);
+        if (!image_list_push(list, full)) break;
+    }
+    closedir(dir);
+
+    qsort(list->paths + first, list->count - first, sizeof(*list->paths), compare_paths);
+    return true;
+}
+
+static void image_list_free(ImageList* list)
+{
+    for (int i = 0; i < list->count; i++)
+        SDL_free(list->paths[i]);
+    free(list->paths);
+    memset(list, 0, sizeof(*list));
+}
+
+enum { SLOT_FREE, SLOT_LOADING, SLOT_READY, SLOT_FAILED };
+#define PREFETCH_STORED  (-1)    // ready_event code: a cache write finished, its slot may be released
+enum { RELOAD_NONE, RELOAD_QUEUED, RELOAD_RUNNING, RELOAD_DONE, RELOAD_FAILED };
+
+typedef struct {
+    int       index;            // into the image list
+    int       state;            // SLOT_*, under the prefetcher lock
+    Pyramid   pyr;              // valid once SLOT_READY
+    char      error[256];
+
+    // Reload of a READY slot after its file changed (--watch). `reload` is
+    // under the prefetcher lock; the rest belongs to whoever it says runs.
+    int       reload;           // RELOAD_*
+    Pyramid   fresh;            // RELOAD_DONE: replaces pyr
+    SDL_Rect* dirty;            // level-0 rects where fresh differs from pyr
+    int       ndirty;           // -1: fresh was built from scratch (new size or format)
+
+    // UI thread only
+    TileCache tiles;
+    bool      has_tiles;
+    bool      shown;            // has been the current image since its tiles were made
+    bool      pinned;           // a grid cut still reads pyr.levels[0]; do not release
+    bool      storing;          // under the prefetcher lock: the decode thread is writing the pyramid to the cache
+} ImageSlot;
+
+typedef struct {
+    SDL_mutex*       lock;
+    SDL_cond*        wake;
+    SDL_Thread*      thread;
+    bool             quit;
+
+    const ImageList* list;
+    int              tile_size;
+    int              current;
+    int              ahead;
+    ImageSlot        slots[PREFETCH_SLOTS];
+    Uint32           ready_event;   // pushed whenever a slot finishes loading (or a preview stripe lands)
+
+    // Progressive preview of the image being decoded, under `preview_lock`
+    SDL_mutex*       preview_lock;
+    SDL_Surface*     preview;       // point-sampled every `preview_step` pixels
+    Uint32           preview_format; // renderer's RGBA32/BGRA32, so texture updates are plain copies
+    int              preview_index; // image it shows, -1 = none
+    int              preview_w, preview_h, preview_step;
+    Uint32           preview_version;
+} Prefetcher;
+
+static ImageSlot* prefetch_find(Prefetcher* pf, int index)
+{
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+        if (pf->slots[i].state != SLOT_FREE && pf->slots[i].index == index)
+            return &pf->slots[i];
+    return NULL;
+}
+
+static bool prefetch_wanted(const Prefetcher* pf, int index)
+{
+    return index >= pf->current - 1 && index <= pf->current + pf->ahead;
+}
+
+// Next index to decode in priority order (current, ahead..., previous), or -1
+static int prefetch_next(Prefetcher* pf, ImageSlot** out)
+{
+    ImageSlot* free_slot = NULL;
+    for (int i = 0; i < PREFETCH_SLOTS && !free_slot; i++)
+        if (pf->slots[i].state == SLOT_FREE) free_slot = &pf->slots[i];
+    if (!free_slot) return -1;
+
+    for (int k = 0; k <= pf->ahead + 1; k++)
+    {
+        int idx = (k <= pf->ahead) ? pf->current + k : pf->current - 1;
+        if (idx < 0 || idx >= pf->list->count || prefetch_find(pf, idx)) continue;
+        *out = free_slot;
+        return idx;
+    }
+    return -1;
+}
+
+// Decode thread: samples a finished stripe into the preview
+static void prefetch_stripe(void* user, SDL_Surface* stripe, int y, int img_w, int img_h)
+{
+    Prefetcher* pf = user;
+    Uint8* row = malloc((size_t)stripe->w * 4);
+    if (!row) return;
+
+    SDL_LockMutex(pf->preview_lock);
+    if (!pf->preview) {
+        int step = (SDL_max(img_w, img_h) + LOADING_PREVIEW_MAX - 1) / LOADING_PREVIEW_MAX;
+        pf->preview = SDL_CreateRGBSurfaceWithFormat(0, (img_w + step - 1) / step, (img_h + step - 1) / step,
+                                                     32, pf->preview_format);
+        pf->preview_step = step;
+        pf->preview_w    = img_w;
+        pf->preview_h    = img_h;
+    }
+    SDL_Surface* pv = pf->preview;
+    int step = pf->preview_step;
+    for (int py = (y + step - 1) / step; pv && py < pv->h && py * step < y + stripe->h; py++)
+    {
+        const Uint8* in = (const Uint8*)stripe->pixels + (size_t)(py * step - y) * stripe->pitch;
+        if (!pixels_convert(stripe->w, 1, stripe->format->format, in, stripe->pitch,
+                            pf->preview_format, row, stripe->w * 4)) {
+            CropRegion line = { 0, py * step - y, stripe->w, 1 };
+            if (!extract_crop_to(stripe, &line, row, stripe->w * 4)) break;
+            if (pf->preview_format == SDL_PIXELFORMAT_BGRA32)
+                for (int x = 0; x < stripe->w; x++) {
+                    Uint8 t = row[4 * x];
+                    row[4 * x] = row[4 * x + 2];
+                    row[4 * x + 2] = t;
+                }
+        }
+        Uint32* out = (Uint32*)((Uint8*)pv->pixels + (size_t)py * pv->pitch);
+        for (int px = 0; px < pv->w; px++)
+            memcpy(&out[px], row + (size_t)px * step * 4, 4);
+    }
+    pf->preview_version++;
+    SDL_UnlockMutex(pf->preview_lock);
+    free(row);
+
+    SDL_Event ev = { .type = pf->ready_event };
+    SDL_PushEvent(&ev);
+}
+
+static void prefetch_preview_reset(Prefetcher* pf, int index)
+{
+    SDL_LockMutex(pf->preview_lock);
+    SDL_FreeSurface(pf->preview);
+    pf->preview = NULL;
+    pf->preview_index = index;
+    SDL_UnlockMutex(pf->preview_lock);
+}
+
+// Decode thread: the pyramid is already published, so the cache write no
+// longer delays the first frame of the image; `storing` keeps the slot (and
+// so `pyr`) alive until it finishes.
+static void prefetch_store(Prefetcher* pf, ImageSlot* slot, const char* path, const Pyramid* pyr)
+{
+    cache_store(path, pyr, pf->tile_size);
+
+    SDL_LockMutex(pf->lock);
+    slot->storing = false;
+    SDL_UnlockMutex(pf->lock);
+
+    SDL_Event ev = { .type = pf->ready_event };
+    ev.user.code = PREFETCH_STORED;
+    SDL_PushEvent(&ev);
+}
+
+static bool prefetch_should_store(const Pyramid* pyr)
+{
+    return cache_dir && pyr->nlevels > 0 && !pyr->levels[0]->userdata;
+}
+
+static ImageSlot* prefetch_next_reload(Prefetcher* pf)
+{
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+        if (pf->slots[i].state == SLOT_READY && pf->slots[i].reload == RELOAD_QUEUED)
+            return &pf->slots[i];
+    return NULL;
+}
+
+// Decode thread: loads the new version of `slot`'s file and, when size and
+// format are unchanged, diffs it against the old level 0 and refilters only
+// the blocks that differ. slot->pyr is only read; the UI keeps drawing it.
+static void prefetch_reload_run(Prefetcher* pf, ImageSlot* slot)
+{
+    const char* path = pf->list->paths[slot->index];
+    SDL_Surface* old = slot->pyr.levels[0];
+    SDL_Surface* image = load_image(path);
+    Pyramid fresh = {0};
+    SDL_Rect* dirty = NULL;
+    int ndirty = -1;
+
+    if (image && !image_maps_source(old) && image->w == old->w && image->h == old->h &&
+        image->format->format == old->format->format && !image->format->palette)
+    {
+        dirty = image_diff(old, image, &ndirty);
+        if (ndirty == 0) {
+            image_free(image);      // touched but identical
+            image = NULL;
+        } else if (ndirty > 0 && !pyramid_patch(&fresh, &slot->pyr, image, dirty, ndirty)) {
+            free(dirty);
+            dirty  = NULL;
+            ndirty = -1;
+        }
+    }
+    if (image && ndirty < 0) pyramid_build(&fresh, image, pf->tile_size);
+    bool store = image && prefetch_should_store(&fresh);
+
+    SDL_LockMutex(pf->lock);
+    slot->fresh   = fresh;
+    slot->dirty   = dirty;
+    slot->ndirty  = ndirty;
+    slot->reload  = image ? RELOAD_DONE : ndirty == 0 ? RELOAD_NONE : RELOAD_FAILED;
+    slot->storing = store;
+    SDL_UnlockMutex(pf->lock);
+
+    SDL_Event ev = { .type = pf->ready_event };
+    ev.user.code = slot->index;
+    SDL_PushEvent(&ev);
+
+    // The UI may swap `fresh` into slot->pyr meanwhile; the surfaces stay the same
+    if (store) prefetch_store(pf, slot, path, &fresh);
+}
+
+static int prefetch_worker(void* data)
+{
+    Prefetcher* pf = data;
+
+    for (;;)
+    {
+        SDL_LockMutex(pf->lock);
+        ImageSlot* slot = NULL;
+        ImageSlot* reload = NULL;
+        int idx = -1;
+        while (!pf->quit && !(reload = prefetch_next_reload(pf)) && (idx = prefetch_next(pf, &slot)) < 0)
+            SDL_CondWait(pf->wake, pf->lock);
+        if (pf->quit) {
+            SDL_UnlockMutex(pf->lock);
+            break;
+        }
+        if (reload) {
+            reload->reload = RELOAD_RUNNING;
+            SDL_UnlockMutex(pf->lock);
+            prefetch_reload_run(pf, reload);
+            continue;
+        }
+        slot->index = idx;
+        slot->state = SLOT_LOADING;
+        SDL_UnlockMutex(pf->lock);
+
+        Pyramid pyr = {0};
+        char error[256] = "";
+        const char* path = pf->list->paths[idx];
+        SDL_Surface* image = NULL;
+        prefetch_preview_reset(pf, idx);
+        if (cache_load(path, pf->tile_size, &pyr)) {
+            image = pyr.levels[0];
+        } else if ((image = load_image_progress(path, prefetch_stripe, pf))) {
+            pyramid_build(&pyr, image, pf->tile_size);
+        } else {
+            snprintf(error, sizeof(error), "%s", IMG_GetError());
+        }
+
+        bool store = image && prefetch_should_store(&pyr);
+
+        prefetch_preview_reset(pf, -1);
+        SDL_LockMutex(pf->lock);
+        slot->pyr     = pyr;
+        slot->state   = image ? SLOT_READY : SLOT_FAILED;
+        slot->storing = store;
+        snprintf(slot->error, sizeof(slot->error), "%s", error);
+        SDL_UnlockMutex(pf->lock);
+
+        SDL_Event ev = { .type = pf->ready_event };
+        ev.user.code = idx;
+        SDL_PushEvent(&ev);
+
+        if (store) prefetch_store(pf, slot, path, &pyr);
+    }
+    return 0;
+}
+
+static bool prefetch_start(Prefetcher* pf, const ImageList* list, int tile_size, int ahead, Uint32 preview_format)
+{
+    memset(pf, 0, sizeof(*pf));
+    pf->preview_format = preview_format;
+    pf->list        = list;
+    pf->tile_size   = tile_size;
+    pf->ahead       = ahead;
+    pf->ready_event = SDL_RegisterEvents(1);
+    pf->lock        = SDL_CreateMutex();
+    pf->wake        = SDL_CreateCond();
+    pf->preview_lock  = SDL_CreateMutex();
+    pf->preview_index = -1;
+    if (!pf->lock || !pf->wake || !pf->preview_lock) return false;
+
+    pf->thread = SDL_CreateThread(prefetch_worker, "prefetch", pf);
+    return pf->thread != NULL;
+}
+
+static void slot_release(ImageSlot* slot)
+{
+    if (slot->has_tiles) tiles_destroy(&slot->tiles);
+    pyramid_free(&slot->pyr);
+    pyramid_free(&slot->fresh);
+    free(slot->dirty);
+    memset(slot, 0, sizeof(*slot));
+    slot->state = SLOT_FREE;
+}
+
+// UI thread: makes `index` current, frees slots that fell out of the window
+static void prefetch_set_current(Prefetcher* pf, int index)
+{
+    SDL_LockMutex(pf->lock);
+    pf->current = index;
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+    {
+        ImageSlot* slot = &pf->slots[i];
+        if ((slot->state == SLOT_READY || slot->state == SLOT_FAILED) && !slot->pinned && !slot->storing &&
+            slot->reload != RELOAD_QUEUED && slot->reload != RELOAD_RUNNING &&
+            !prefetch_wanted(pf, slot->index))
+            slot_release(slot);
+    }
+    SDL_CondSignal(pf->wake);
+    SDL_UnlockMutex(pf->lock);
+}
+
+// UI thread: state of the slot holding `index`, or SLOT_LOADING if not started yet
+static int prefetch_state(Prefetcher* pf, int index, ImageSlot** out)
+{
+    SDL_LockMutex(pf->lock);
+    ImageSlot* slot = prefetch_find(pf, index);
+    int state = slot ? slot->state : SLOT_LOADING;
+    SDL_UnlockMutex(pf->lock);
+    *out = slot;
+    return state;
+}
+
+// UI thread: asks for `slot` to be loaded again from disk
+static void prefetch_reload(Prefetcher* pf, ImageSlot* slot)
+{
+    SDL_LockMutex(pf->lock);
+    if (slot->state == SLOT_READY && slot->reload == RELOAD_NONE) {
+        slot->reload = RELOAD_QUEUED;
+        SDL_CondSignal(pf->wake);
+    }
+    SDL_UnlockMutex(pf->lock);
+}
+
+// UI thread: swaps in a finished reload of `slot`, patching its resident
+// tiles (or dropping them when the pyramid was rebuilt). Returns the
+// RELOAD_DONE/RELOAD_FAILED it consumed, or RELOAD_NONE; `*changed` is the
+// number of level-0 pixels in the dirty rects, -1 after a rebuild.
+static int prefetch_apply_reload(Prefetcher* pf, ImageSlot* slot, Sint64* changed)
+{
+    SDL_LockMutex(pf->lock);
+    int r = slot->reload;
+    if (r == RELOAD_DONE || r == RELOAD_FAILED) slot->reload = RELOAD_NONE;
+    SDL_UnlockMutex(pf->lock);
+    if (r != RELOAD_DONE) return r == RELOAD_FAILED ? r : RELOAD_NONE;
+
+    if (slot->ndirty < 0) {
+        if (slot->has_tiles) tiles_destroy(&slot->tiles);
+        slot->has_tiles = false;
+        slot->shown     = false;
+        *changed = -1;
+    } else {
+        if (slot->has_tiles) tiles_refresh(&slot->tiles, &slot->fresh, slot->dirty, slot->ndirty);
+        *changed = 0;
+        for (int i = 0; i < slot->ndirty; i++)
+            *changed += (Sint64)slot->dirty[i].w * slot->dirty[i].h;
+    }
+    pyramid_free(&slot->pyr);
+    slot->pyr = slot->fresh;
+    memset(&slot->fresh, 0, sizeof(slot->fresh));
+    free(slot->dirty);
+    slot->dirty  = NULL;
+    slot->ndirty = 0;
+    return RELOAD_DONE;
+}
+
+static void prefetch_stop(Prefetcher* pf)
+{
+    if (pf->lock) {
+        SDL_LockMutex(pf->lock);
+        pf->quit = true;
+        SDL_CondSignal(pf->wake);
+        SDL_UnlockMutex(pf->lock);
+    }
+    if (pf->thread) SDL_WaitThread(pf->thread, NULL);
+
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+        if (pf->slots[i].state != SLOT_FREE) slot_release(&pf->slots[i]);
+
+    SDL_FreeSurface(pf->preview);
+    if (pf->preview_lock) SDL_DestroyMutex(pf->preview_lock);
+    if (pf->wake) SDL_DestroyCond(pf->wake);
+    if (pf->lock) SDL_DestroyMutex(pf->lock);
+}
+
+// UI thread: brings `*tex` up to date with the decode preview of `index` and
+// reports the full image size; false when that image has no preview
+static bool prefetch_preview(Prefetcher* pf, SDL_Renderer* renderer, int index,
+                             SDL_Texture** tex, Uint32* version, int* img_w, int* img_h)
+{
+    SDL_LockMutex(pf->preview_lock);
+    SDL_Surface* pv = pf->preview;
+    bool have = pv && pf->preview_index == index;
+    if (have && pf->preview_version != *version)
+    {
+        int tw = 0, th = 0;
+        if (*tex) SDL_QueryTexture(*tex, NULL, NULL, &tw, &th);
+        if (!*tex || tw != pv->w || th != pv->h) {
+            if (*tex) SDL_DestroyTexture(*tex);
+            *tex = SDL_CreateTexture(renderer, pv->format->format, SDL_TEXTUREACCESS_STATIC, pv->w, pv->h);
+            prof_count(PROF_TEX_CREATE);
+            if (*tex) SDL_SetTextureScaleMode(*tex, SDL_ScaleModeLinear);
+        }
+        if (*tex) SDL_UpdateTexture(*tex, NULL, pv->pixels, pv->pitch);
+        *version = pf->preview_version;
+    }
+    if (have) {
+        *img_w = pf->preview_w;
+        *img_h = pf->preview_h;
+    }
+    SDL_UnlockMutex(pf->preview_lock);
+    return have;
+}
+
+// Scale at which the whole image fits the output, as used by the main view
+static float fit_scale(int rw, int rh, int w, int h)
+{
+    return fminf((float)rw / w, (float)rh / h);
+}
+
+// UI thread: gives every ready slot a tile cache. Images other than the
+// current one only keep the level the fit-to-window view draws, uploaded
+// ahead of time, so their VRAM use stays small.
+static void prefetch_sync_tiles(Prefetcher* pf, SDL_Renderer* renderer, size_t vram_budget)
+{
+    int rw, rh;
+    SDL_GetRendererOutputSize(renderer, &rw, &rh);
+
+    for (int i = 0; i < PREFETCH_SLOTS; i++)
+    {
+        ImageSlot* slot = &pf->slots[i];
+        SDL_LockMutex(pf->lock);
+        bool ready = slot->state == SLOT_READY;
+        SDL_UnlockMutex(pf->lock);
+        if (!ready) continue;
+
+        bool current = slot->index == pf->current;
+        bool warm = false;
+        if (!slot->has_tiles) {
+            slot->has_tiles = tiles_init(&slot->tiles, renderer, &slot->pyr, pf->tile_size, vram_budget);
+            if (!slot->has_tiles) continue;
+            warm = !current;
+        } else if (!current && slot->shown) {
+            tiles_release(&slot->tiles);
+            slot->shown = false;
+            warm = true;
+        }
+
+        if (current) {
+            slot->shown = true;
+        } else if (warm) {
+            SDL_Surface* img = slot->pyr.levels[0];
+            tiles_prewarm(&slot->tiles, tiles_pick_level(&slot->tiles, fit_scale(rw, rh, img->w, img->h)));
+        }
+    }
+}
+
+// ──────────────────────────────────────────────── Viewport ────────────────────────────────────────────────
+// Image → window transform, recomputed only when the window, the image or
+// the zoom/pan changes and shared by hit testing and rendering. Zoom is
+// relative to fitting the whole image; the mouse wheel zooms around the
+// cursor and right/middle drag pans. Drags are applied once per frame from
+// the latest mouse position, however many motion events a high-rate mouse
+// queued in between.
+
+#define VIEW_MAX_SCALE  32.0f   // output pixels per image pixel when fully zoomed in
+#define VIEW_WHEEL_STEP 1.25f
+
+typedef struct {
+    int   rw, rh;           // renderer output size
+    int   img_w, img_h;
+    float zoom;             // 1 = whole image fits
+    float cx, cy;           // image point shown at the center of the output
+
+    // Derived by viewport_update()
+    float s;                // image pixels → output pixels
+    float ox, oy;           // output position of image (0, 0)
+} Viewport;
+
+// Clamps zoom and center (no panning past the edges, centered while the
+// image is smaller than the window) and derives s/ox/oy
+static void viewport_update(Viewport* vp)
+{
+    if (vp->img_w <= 0 || vp->img_h <= 0) {
+        vp->s  = 1.0f;
+        vp->ox = vp->oy = 0;
+        return;
+    }
+    float fit = fit_scale(vp->rw, vp->rh, vp->img_w, vp->img_h);
+    float max_zoom = fmaxf(VIEW_MAX_SCALE / fit, 1.0f);
+    vp->zoom = fminf(fmaxf(vp->zoom, 1.0f), max_zoom);
+    vp->s = fit * vp->zoom;
+
+    float half_w = vp->rw / (2 * vp->s), half_h = vp->rh / (2 * vp->s);
+    vp->cx = (vp->img_w <= 2 * half_w) ? vp->img_w / 2.0f : fminf(fmaxf(vp->cx, half_w), vp->img_w - half_w);
+    vp->cy = (vp->img_h <= 2 * half_h) ? vp->img_h / 2.0f : fminf(fmaxf(vp->cy, half_h), vp->img_h - half_h);
+
+    vp->ox = floorf(vp->rw / 2.0f - vp->cx * vp->s);
+    vp->oy = floorf(vp->rh / 2.0f - vp->cy * vp->s);
+}
+
+// Picks up the output size; a different image resets to fit-to-window,
+// the same one keeps its zoom and center (window resize)
+static void viewport_fit(Viewport* vp, SDL_Renderer* renderer, int img_w, int img_h)
+{
+    SDL_GetRendererOutputSize(renderer, &vp->rw, &vp->rh);
+    if (img_w != vp->img_w || img_h != vp->img_h) {
+        vp->img_w = img_w;
+        vp->img_h = img_h;
+        vp->zoom  = 1.0f;
+        vp->cx    = img_w / 2.0f;
+        vp->cy    = img_h / 2.0f;
+    }
+    viewport_update(vp);
+}
+
+static void viewport_reset(Viewport* vp)
+{
+    vp->zoom = 1.0f;
+    vp->cx = vp->img_w / 2.0f;
+    vp->cy = vp->img_h / 2.0f;
+    viewport_update(vp);
+}
+
+static void viewport_to_image(const Viewport* vp, int mx, int my, float* ix, float* iy)
+{
+    *ix = (mx - vp->ox) / vp->s;
+    *iy = (my - vp->oy) / vp->s;
+}
+
+// Zooms by `factor` keeping the image point under (mx, my) in place
+static void viewport_zoom_at(Viewport* vp, int mx, int my, float factor)
+{
+    float ix, iy;
+    viewport_to_image(vp, mx, my, &ix, &iy);
+    vp->zoom *= factor;
+    viewport_update(vp);
+    vp->cx = ix - (mx - vp->rw / 2.0f) / vp->s;
+    vp->cy = iy - (my - vp->rh / 2.0f) / vp->s;
+    viewport_update(vp);
+}
+
+static void viewport_pan(Viewport* vp, int dx, int dy)
+{
+    vp->cx -= dx / vp->s;
+    vp->cy -= dy / vp->s;
+    viewport_update(vp);
+}
+
+// Image rectangle covered by the output, for drawing only the visible tiles
+static SDL_Rect viewport_visible(const Viewport* vp)
+{
+    int x0 = SDL_max(0, (int)floorf(-vp->ox / vp->s));
+    int y0 = SDL_max(0, (int)floorf(-vp->oy / vp->s));
+    int x1 = SDL_min(vp->img_w, (int)ceilf((vp->rw - vp->ox) / vp->s));
+    int y1 = SDL_min(vp->img_h, (int)ceilf((vp->rh - vp->oy) / vp->s));
+    return (SDL_Rect){ x0, y0, SDL_max(0, x1 - x0), SDL_max(0, y1 - y0) };
+}
+
+// Moves (or, with `resizing`, resizes from the bottom-right corner) `crop`
+// so the grabbed point follows the mouse at image position (ix, iy).
+// A non-zero `aspect` (w / h) keeps resizes at that ratio.
+static void drag_apply(CropRegion* crop, bool resizing, float ix, float iy,
+                       float offset_x, float offset_y, float aspect, int img_w, int img_h)
+{
+    if (!resizing)
+    {
+        crop->x = (int)(ix - offset_x + 0.5f);
+        crop->y = (int)(iy - offset_y + 0.5f);
+        if (crop->x < 0) crop->x = 0;
+        if (crop->y < 0) crop->y = 0;
+        if (crop->x + crop->w > img_w) crop->x = img_w - crop->w;
+        if (crop->y + crop->h > img_h) crop->y = img_h - crop->h;
+    }
+    else
+    {
+        int brx = (int)(ix + offset_x + 0.5f);
+        int bry = (int)(iy + offset_y + 0.5f);
+        int nw = brx - crop->x;
+        int nh = bry - crop->y;
+        nw = fmax(nw, MIN_SQUARE_SIZE);
+        nh = fmax(nh, MIN_SQUARE_SIZE);
+        nw = fmin(nw, img_w - crop->x);
+        nh = fmin(nh, img_h - crop->y);
+        if (aspect > 0) {
+            // Shrink whichever side overshoots the ratio
+            if (nw > nh * aspect) nw = (int)(nh * aspect + 0.5f);
+            else                  nh = (int)(nw / aspect + 0.5f);
+        }
+        crop->w = nw;
+        crop->h = nh;
+    }
+}
+
+// ──────────────────────────────────────────────── Regions ────────────────────────────────────────────────
+// An image can carry many named, free-aspect regions; the one being edited
+// is mirrored in `crop`. A uniform grid over the image indexes them, so
+// hit testing and finding the regions in view only look at nearby cells
+// instead of every box.
+
+#define REGION_CELL 256         // grid cell size in image pixels
+
+typedef struct {
+    CropRegion rect;
+    char       name[32];
+} Region;
+
+typedef struct {
+    int* ids;
+    int  count, cap;
+} RegionCell;
+
+typedef struct {
+    Region*     items;
+    int         count, cap;
+    int         active;         // index of the region mirrored in `crop`
+    int         next_name;
+
+    int         img_w, img_h;
+    int         cols, rows;
+    RegionCell* cells;
+
+    Uint32*     stamp;          // per region: last query that reported it
+    Uint32      query;
+    int*        found;          // result buffer of regions_query()
+} RegionSet;
+
+static void regions_free(RegionSet* rs)
+{
+    if (rs->cells)
+        for (int i = 0; i < rs->cols * rs->rows; i++) free(rs->cells[i].ids);
+    free(rs->cells);
+    free(rs->items);
+    free(rs->stamp);
+    free(rs->found);
+    memset(rs, 0, sizeof(*rs));
+}
+
+// Cells overlapped by `r`, clamped to the grid
+static void regions_cell_span(const RegionSet* rs, const CropRegion* r, int* c0, int* r0, int* c1, int* r1)
+{
+    *c0 = SDL_clamp(r->x / REGION_CELL, 0, rs->cols - 1);
+    *r0 = SDL_clamp(r->y / REGION_CELL, 0, rs->rows - 1);
+    *c1 = SDL_clamp((r->x + r->w - 1) / REGION_CELL, 0, rs->cols - 1);
+    *r1 = SDL_clamp((r->y + r->h - 1) / REGION_CELL, 0, rs->rows - 1);
+}
+
+static void regions_index(RegionSet* rs, int id, bool insert)
+{
+    if (!rs->cells) return;
+    int c0, r0, c1, r1;
+    regions_cell_span(rs, &rs->items[id].rect, &c0, &r0, &c1, &r1);
+    for (int r = r0; r <= r1; r++)
+        for (int c = c0; c <= c1; c++)
+        {
+            RegionCell* cell = &rs->cells[r * rs->cols + c];
+            if (!insert) {
+                for (int k = 0; k < cell->count; k++)
+                    if (cell->ids[k] == id) { cell->ids[k] = cell->ids[--cell->count]; break; }
+                continue;
+            }
+            if (cell->count == cell->cap) {
+                int cap = cell->cap ? cell->cap * 2 : 8;
+                int* grown = realloc(cell->ids, (size_t)cap * sizeof(*grown));
+                if (!grown) continue;   // region just won't be hit-testable from this cell
+                cell->ids = grown;
+                cell->cap = cap;
+            }
+            cell->ids[cell->count++] = id;
+        }
+}
+
+// Empty set for an image of img_w × img_h
+static bool regions_init(RegionSet* rs, int img_w, int img_h)
+{
+    regions_free(rs);
+    rs->img_w = img_w;
+    rs->img_h = img_h;
+    rs->cols  = SDL_max(1, (img_w + REGION_CELL - 1) / REGION_CELL);
+    rs->rows  = SDL_max(1, (img_h + REGION_CELL - 1) / REGION_CELL);
+    rs->cells = calloc((size_t)rs->cols * rs->rows, sizeof(*rs->cells));
+    return rs->cells != NULL;
+}
+
+// Appends a region named region_NNN; returns its index or -1
+static int regions_add(RegionSet* rs, const CropRegion* rect)
+{
+    if (rs->count == rs->cap) {
+        int cap = rs->cap ? rs->cap * 2 : 64;
+        Region* items = realloc(rs->items, (size_t)cap * sizeof(*items));
+        if (!items) return -1;
+        rs->items = items;
+        Uint32* stamp = realloc(rs->stamp, (size_t)cap * sizeof(*stamp));
+        if (!stamp) return -1;
+        rs->stamp = stamp;
+        int* found = realloc(rs->found, (size_t)cap * sizeof(*found));
+        if (!found) return -1;
+        rs->found = found;
+        rs->cap = cap;
+    }
+    int id = rs->count++;
+    rs->items[id].rect = *rect;
+    snprintf(rs->items[id].name, sizeof(rs->items[id].name), "region_%03d", ++rs->next_name);
+    rs->stamp[id] = 0;
+    regions_index(rs, id, true);
+    return id;
+}
+
+static void regions_update(RegionSet* rs, int id, const CropRegion* rect)
+{
+    if (id < 0 || id >= rs->count) return;
+    const CropRegion* old = &rs->items[id].rect;
+    if (old->x == rect->x && old->y == rect->y && old->w == rect->w && old->h == rect->h) return;
+    regions_index(rs, id, false);
+    rs->items[id].rect = *rect;
+    regions_index(rs, id, true);
+}
+
+// Removes `id`; the last region moves into its slot (and `active` follows)
+static void regions_remove(RegionSet* rs, int id)
+{
+    int last = rs->count - 1;
+    regions_index(rs, id, false);
+    if (id != last) {
+        regions_index(rs, last, false);
+        rs->items[id] = rs->items[last];
+        rs->stamp[id] = rs->stamp[last];
+        regions_index(rs, id, true);
+    }
+    rs->count--;
+    if (rs->active == last) rs->active = id;
+    if (rs->active >= rs->count) rs->active = rs->count - 1;
+}
+
+// Smallest region containing image point (x, y), or -1
+static int regions_hit(const RegionSet* rs, float x, float y)
+{
+    if (!rs->cells || x < 0 || y < 0 || x >= rs->img_w || y >= rs->img_h) return -1;
+    const RegionCell* cell = &rs->cells[(int)(y / REGION_CELL) * rs->cols + (int)(x / REGION_CELL)];
+    int best = -1;
+    long long best_area = 0;
+    for (int k = 0; k < cell->count; k++)
+    {
+        const CropRegion* r = &rs->items[cell->ids[k]].rect;
+        if (x < r->x || x >= r->x + r->w || y < r->y || y >= r->y + r->h) continue;
+        long long area = (long long)r->w * r->h;
+        if (best < 0 || area < best_area) { best = cell->ids[k]; best_area = area; }
+    }
+    return best;
+}
+
+// Regions intersecting `view` (image coordinates), each reported once;
+// returns the count, indices in rs->found
+static int regions_query(RegionSet* rs, const SDL_Rect* view)
+{
+    if (view->w <= 0 || view->h <= 0 || rs->count == 0) return 0;
+    if (++rs->query == 0) {                 // wrapped: old stamps could collide
+        memset(rs->stamp, 0, (size_t)rs->count * sizeof(*rs->stamp));
+        rs->query = 1;
+    }
+    CropRegion v = { view->x, view->y, view->w, view->h };
+    int c0, r0, c1, r1;
+    regions_cell_span(rs, &v, &c0, &r0, &c1, &r1);
+
+    int n = 0;
+    for (int r = r0; r <= r1; r++)
+        for (int c = c0; c <= c1; c++)
+        {
+            const RegionCell* cell = &rs->cells[r * rs->cols + c];
+            for (int k = 0; k < cell->count; k++)
+            {
+                int id = cell->ids[k];
+                if (rs->stamp[id] == rs->query) continue;
+                rs->stamp[id] = rs->query;
+                const CropRegion* b = &rs->items[id].rect;
+                if (b->x + b->w <= v.x || b->x >= v.x + v.w || b->y + b->h <= v.y || b->y >= v.y + v.h) continue;
+                rs->found[n++] = id;
+            }
+        }
+    return n;
+}
+
+// Stores the edited `crop` back into the active region, then makes `id` active
+static void regions_select(RegionSet* rs, int id, CropRegion* crop)
+{
+    if (rs->active >= 0 && rs->active < rs->count)
+        regions_update(rs, rs->active, crop);
+    rs->active = id;
+    *crop = rs->items[id].rect;
+}
+
+// Parks the regions of the image being left (with the crop's latest edit)
+// in `slot`, one per input, leaving `rs` empty
+static void regions_stash(RegionSet* rs, RegionSet* slot, const CropRegion* crop)
+{
+    regions_free(slot);
+    if (rs->count) {
+        if (rs->active >= 0 && rs->active < rs->count) regions_update(rs, rs->active, crop);
+        *slot = *rs;
+        memset(rs, 0, sizeof(*rs));
+    }
+    regions_free(rs);
+}
+
+// Takes back what regions_stash() parked for an image of img_w × img_h and
+// makes its active region the crop; false (and `slot` dropped) if nothing
+// was parked or the image changed size since
+static bool regions_unstash(RegionSet* rs, RegionSet* slot, int img_w, int img_h, CropRegion* crop)
+{
+    if (!slot->count || slot->img_w != img_w || slot->img_h != img_h) {
+        regions_free(slot);
+        return false;
+    }
+    regions_free(rs);
+    *rs = *slot;
+    memset(slot, 0, sizeof(*slot));
+    if (rs->active < 0 || rs->active >= rs->count) rs->active = 0;
+    *crop = rs->items[rs->active].rect;
+    return true;
+}
+
+// ──────────────────────────────────────────────── Crop suggestions ────────────────────────────────────────────────
+// A: propose the highest edge-energy crops of the current size as new
+// regions. Luma gradient energy is summed per 8×8 block (one psadbw per
+// block row) on a thread per core, and a summed-area table over the blocks
+// makes any candidate's score four lookups, so even 100 MP images are
+// scored at every block position in milliseconds. The map is built once per
+// image; later presses only re-rank.
+
+#define SUGGEST_CELL          8     // block edge in pixels (the energy8 group size)
+#define SUGGEST_DEFAULT       8
+#define SUGGEST_MAX          64
+#define SUGGEST_MAX_THREADS  16
+
+typedef struct {
+    const SDL_Surface* src;     // image the map was built from (not owned)
+    int     cols, rows;         // blocks, partial ones at the right and bottom edge included
+    Uint64* sat;                // (rows + 1) × (cols + 1), zero first row and column
+} SaliencyMap;
+
+typedef struct {
+    SaliencyMap* map;
+    SDL_Surface* src;
+    int          row0, row1;    // block rows filled by this worker
+    bool         ok;
+} SaliencyJob;
+
+static void saliency_free(SaliencyMap* m)
+{
+    free(m->sat);
+    memset(m, 0, sizeof(*m));
+}
+
+// Fills block rows [row0, row1) of the SAT with per-row prefix sums; the
+// column pass runs after every worker is done
+static int saliency_worker(void* data)
+{
+    SaliencyJob* job = data;
+    SaliencyMap* m = job->map;
+    SDL_Surface* src = job->src;
+    int w = src->w, lw = m->cols * SUGGEST_CELL + 32;     // padded so kernels may over-read
+    int stride = m->cols + 1;
+
+    Uint32 format = crop_format(src);     // gray sources are read as they are
+    int bpp = SDL_BYTESPERPIXEL(format);
+    Uint8*  pix  = malloc((size_t)w * bpp * (SUGGEST_CELL + 1));
+    Uint8*  luma = calloc((size_t)lw, SUGGEST_CELL + 1);
+    Uint32* acc  = malloc((size_t)m->cols * sizeof(*acc));
+    job->ok = pix && luma && acc;
+
+    for (int br = job->row0; job->ok && br < job->row1; br++)
+    {
+        // This block's rows plus the one above it for the vertical gradient
+        int y0 = br * SUGGEST_CELL;
+        int ys = y0 > 0 ? y0 - 1 : 0;
+        int ye = SDL_min(y0 + SUGGEST_CELL, src->h);
+        CropRegion band = { 0, ys, w, ye - ys };
+        if (!extract_crop_as(src, &band, format, pix, w * bpp)) { job->ok = false; break; }
+
+        for (int r = 0; r < band.h; r++) {
+            const Uint8* px = pix + (size_t)r * w * bpp;
+            Uint8* l = luma + (size_t)r * lw;
+            if (bpp == 1)
+                memcpy(l, px, (size_t)w);
+            else
+                for (int x = 0; x < w; x++, px += bpp)
+                    l[x] = (Uint8)((77 * px[0] + 150 * px[1] + 29 * px[2]) >> 8);
+            memset(l + w, l[w - 1], (size_t)(lw - w));      // no edge past the border
+        }
+
+        memset(acc, 0, (size_t)m->cols * sizeof(*acc));
+        for (int r = (y0 > 0); r < band.h; r++) {
+            const Uint8* cur = luma + (size_t)r * lw;
+            pixel_kernels.energy8(acc, cur, r > 0 ? cur - lw : cur, m->cols);
+        }
+
+        Uint64* row = m->sat + (size_t)(br + 1) * stride;
+        Uint64 sum = 0;
+        row[0] = 0;
+        for (int c = 0; c < m->cols; c++)
+            row[c + 1] = sum += acc[c];
+    }
+
+    free(acc);
+    free(luma);
+    free(pix);
+    return 0;
+}
+
+static bool saliency_build(SaliencyMap* m, SDL_Surface* src)
+{
+    saliency_free(m);
+    m->cols = (src->w + SUGGEST_CELL - 1) / SUGGEST_CELL;
+    m->rows = (src->h + SUGGEST_CELL - 1) / SUGGEST_CELL;
+    size_t stride = (size_t)m->cols + 1;
+    m->sat = calloc(stride * (m->rows + 1), sizeof(*m->sat));
+    if (!m->sat) return false;
+
+    int n = SDL_clamp(SDL_GetCPUCount(), 1, SUGGEST_MAX_THREADS);
+    if (n > m->rows) n = m->rows;
+    SaliencyJob jobs[SUGGEST_MAX_THREADS];
+    SDL_Thread* threads[SUGGEST_MAX_THREADS];
+    for (int i = 0; i < n; i++) {
+        jobs[i] = (SaliencyJob){ m, src, m->rows * i / n, m->rows * (i + 1) / n, false };
+        threads[i] = i > 0 ? SDL_CreateThread(saliency_worker, "saliency", &jobs[i]) : NULL;
+        if (i > 0 && !threads[i]) saliency_worker(&jobs[i]);
+    }
+    saliency_worker(&jobs[0]);          // the calling thread takes the first band
+
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        if (threads[i]) SDL_WaitThread(threads[i], NULL);
+        ok &= jobs[i].ok;
+    }
+    if (!ok) {
+        saliency_free(m);
+        return false;
+    }
+
+    for (int r = 1; r <= m->rows; r++) {
+        Uint64* row = m->sat + (size_t)r * stride;
+        const Uint64* above = row - stride;
+        for (size_t c = 0; c < stride; c++) row[c] += above[c];
+    }
+    m->src = src;
+    return true;
+}
+
+// Energy of blocks [c0, c1) × [r0, r1)
+static Uint64 saliency_sum(const SaliencyMap* m, int c0, int r0, int c1, int r1)
+{
+    size_t stride = (size_t)m->cols + 1;
+    const Uint64* s = m->sat;
+    return s[r1 * stride + c1] - s[r0 * stride + c1] - s[r1 * stride + c0] + s[r0 * stride + c0];
+}
+
+// Blocks out every candidate position whose w×h crop would overlap `r`
+static void saliency_block(Sint64* score, int ncx, int ncy, int w, int h, const CropRegion* r)
+{
+    int c0 = r->x - w >= 0 ? (r->x - w) / SUGGEST_CELL + 1 : 0;
+    int r0 = r->y - h >= 0 ? (r->y - h) / SUGGEST_CELL + 1 : 0;
+    int c1 = SDL_min((r->x + r->w - 1) / SUGGEST_CELL, ncx - 1);
+    int r1 = SDL_min((r->y + r->h - 1) / SUGGEST_CELL, ncy - 1);
+    for (int y = r0; y <= r1; y++)
+        for (int x = c0; x <= c1; x++)
+            score[(size_t)y * ncx + x] = -1;
+}
+
+// Up to `k` non-overlapping w×h crops on the block grid, best first, none
+// of them overlapping a region already in `avoid`. Returns how many.
+static int saliency_suggest(const SaliencyMap* m, int w, int h, const RegionSet* avoid, CropRegion* out, int k)
+{
+    const SDL_Surface* src = m->src;
+    if (w > src->w || h > src->h) return 0;
+    int ncx = (src->w - w) / SUGGEST_CELL + 1;
+    int ncy = (src->h - h) / SUGGEST_CELL + 1;
+    int bw = SDL_max(1, (w + SUGGEST_CELL / 2) / SUGGEST_CELL);
+    int bh = SDL_max(1, (h + SUGGEST_CELL / 2) / SUGGEST_CELL);
+
+    Sint64* score = malloc((size_t)ncx * ncy * sizeof(*score));
+    if (!score) return 0;
+    for (int y = 0; y < ncy; y++)
+        for (int x = 0; x < ncx; x++)
+            score[(size_t)y * ncx + x] = (Sint64)saliency_sum(m, x, y, SDL_min(x + bw, m->cols),
+                                                              SDL_min(y + bh, m->rows));
+    for (int i = 0; i < avoid->count; i++)
+        saliency_block(score, ncx, ncy, w, h, &avoid->items[i].rect);
+
+    int n = 0;
+    while (n < k)
+    {
+        size_t best = 0;
+        for (size_t i = 1; i < (size_t)ncx * ncy; i++)
+            if (score[i] > score[best]) best = i;
+        if (score[best] < 0) break;     // nothing left that fits
+
+        out[n] = (CropRegion){ (int)(best % ncx) * SUGGEST_CELL, (int)(best / ncx) * SUGGEST_CELL, w, h };
+        saliency_block(score, ncx, ncy, w, h, &out[n]);
+        n++;
+    }
+    free(score);
+    return n;
+}
+
+// ──────────────────────────────────────────────── Crop history & session log ────────────────────────────────────────────────
+// Undo/redo keeps one delta per edit in a fixed ring: a key press is one
+// entry, a whole drag or resize gesture is one entry, so memory is bounded
+// and undo/redo are O(1). --session file.csv appends every save as a
+// manifest row; "--batch file.csv" replays it without the GUI. The
+// crop_NNN / ipc_NNN counters resume past the rows already in the file, so
+// a session spanning several launches never names two crops alike.
+
+#define HISTORY_CAP 256
+
+typedef struct {
+    int dx, dy, dw, dh;
+} CropDelta;
+
+typedef struct {
+    CropDelta  ring[HISTORY_CAP];
+    int        start;           // oldest entry
+    int        len;             // entries in the ring
+    int        pos;             // entries applied; [pos, len) can be redone
+    CropRegion gesture;         // crop when the open drag began
+    bool       open;
+} CropHistory;
+
+static void history_clear(CropHistory* h)
+{
+    h->start = h->len = h->pos = 0;
+    h->open = false;
+}
+
+// Records the edit `before` → `after`, dropping the redo tail and, when
+// full, the oldest entry
+static void history_record(CropHistory* h, const CropRegion* before, const CropRegion* after)
+{
+    CropDelta d = { after->x - before->x, after->y - before->y, after->w - before->w, after->h - before->h };
+    if (!d.dx && !d.dy && !d.dw && !d.dh) return;
+
+    h->len = h->pos;
+    if (h->len == HISTORY_CAP) {
+        h->start = (h->start + 1) % HISTORY_CAP;
+        h->len--;
+    }
+    h->ring[(h->start + h->len) % HISTORY_CAP] = d;
+    h->pos = ++h->len;
+}
+
+static void history_begin(CropHistory* h, const CropRegion* crop)
+{
+    h->gesture = *crop;
+    h->open = true;
+}
+
+static void history_end(CropHistory* h, const CropRegion* crop)
+{
+    if (!h->open) return;
+    h->open = false;
+    history_record(h, &h->gesture, crop);
+}
+
+static bool history_undo(CropHistory* h, CropRegion* crop)
+{
+    if (h->open || h->pos == 0) return false;
+    const CropDelta* d = &h->ring[(h->start + --h->pos) % HISTORY_CAP];
+    crop->x -= d->dx; crop->y -= d->dy; crop->w -= d->dw; crop->h -= d->dh;
+    return true;
+}
+
+static bool history_redo(CropHistory* h, CropRegion* crop)
+{
+    if (h->open || h->pos == h->len) return false;
+    const CropDelta* d = &h->ring[(h->start + h->pos++) % HISTORY_CAP];
+    crop->x += d->dx; crop->y += d->dy; crop->w += d->dw; crop->h += d->dh;
+    return true;
+}
+
+typedef struct {
+    FILE*       f;
+    const char* image;          // last "# image:" line written
+    int         next_crop;      // number of the next S save (crop_NNN)
+    int         next_ipc;       // number of the next unnamed IPC save (ipc_NNN)
+} SessionLog;
+
+// Moves the counters past every crop_NNN / ipc_NNN row of an existing log
+static void session_seed(SessionLog* s, const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) return;
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        CropRegion c;
+        int used = 0, num;
+        if (line[0] == '#' || sscanf(line, "%d ,%d ,%d ,%d ,%n", &c.x, &c.y, &c.w, &c.h, &used) != 4 || !used)
+            continue;
+        const char* name = line + used;
+        while (*name == ' ' || *name == '\t') name++;
+        if (sscanf(name, "crop_%d_", &num) == 1 && num >= s->next_crop) s->next_crop = num + 1;
+        if (sscanf(name, "ipc_%d_", &num) == 1 && num >= s->next_ipc) s->next_ipc = num + 1;
+    }
+    fclose(f);
+}
+
+static bool session_open(SessionLog* s, const char* path)
+{
+    memset(s, 0, sizeof(*s));
+    s->next_crop = s->next_ipc = 1;
+    if (!path) return true;
+    session_seed(s, path);
+    s->f = fopen(path, "a");
+    return s->f != NULL;
+}
+
+// A crop name a manifest row can hold: the rest of the line, trimmed, and
+// kept free of commas so the file still reads as CSV elsewhere
+static bool session_name_ok(const char* name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || name[0] == ' ' || name[0] == '\t' || name[len - 1] == ' ' || name[len - 1] == '\t')
+        return false;
+    for (const char* c = name; *c; c++)
+        if (*c == ',' || (unsigned char)*c < ' ') return false;
+    return true;
+}
+
+static void session_close(SessionLog* s)
+{
+    if (s->f) fclose(s->f);
+    s->f = NULL;
+}
+
+// One manifest row per queued save, preceded by "# image: path" whenever
+// the source image changes
+static void session_record(SessionLog* s, const char* image, const CropRegion* crop, const char* filename)
+{
+    if (!s || !s->f) return;
+    if (s->image != image) {
+        fprintf(s->f, "# image: %s\n", image);
+        s->image = image;
+    }
+    fprintf(s->f, "%d,%d,%d,%d,%s\n", crop->x, crop->y, crop->w, crop->h, filename);
+    fflush(s->f);
+}
+
+// ──────────────────────────────────────────────── Grid cutter ────────────────────────────────────────────────
+// G cuts the whole image into crop-sized tiles: every tile is a deferred
+// job, so the save workers extract and encode them in parallel while the UI
+// keeps running. Tiles are queued a window at a time as earlier ones
+// finish. Tiles step by the crop size minus --grid-overlap; the last row
+// and column are pulled in flush with the image edge so the whole image is
+// covered.
+
+#define GRID_AHEAD 256          // tiles queued ahead of the workers
+
+// Basename of `path` without its extension, for tile filenames
+static void path_stem(const char* path, char* out, size_t size)
+{
+    const char* base = strrchr(path, '/');
+#ifdef _WIN32
+    const char* bslash = strrchr(path, '\\');
+    if (bslash && (!base || bslash > base)) base = bslash;
+#endif
+    base = base ? base + 1 : path;
+    snprintf(out, size, "%s", base);
+    char* dot = strrchr(out, '.');
+    if (dot && dot != out) *dot = '\0';
+}
+
+typedef struct {
+    SDL_Surface* src;           // borrowed; the slot stays pinned until the cut is done
+    const char*  image;
+    const char*  ext;
+    char         stem[256];
+    int          tw, th, stride_x, stride_y;
+    int          x, y;          // next tile
+    int          queued;
+    SaveBatch    batch;         // total is every tile of the cut
+} GridCut;
+
+// Sets up a cut of `src` into tw × th tiles; posts why not and returns
+// false when there are none
+static bool grid_start(GridCut* g, SaveQueue* q, SDL_Surface* src, int tw, int th, int overlap,
+                       const char* image, const char* ext)
+{
+    memset(g, 0, sizeof(*g));
+    if (tw <= overlap || th <= overlap) {
+        save_queue_post_status(q, true, "Grid: overlap %d leaves no tiles at %dx%d", overlap, tw, th);
+        return false;
+    }
+    if (tw > src->w || th > src->h) {
+        save_queue_post_status(q, true, "Grid: %dx%d tiles do not fit the %dx%d image", tw, th, src->w, src->h);
+        return false;
+    }
+    g->stride_x = tw - overlap;
+    g->stride_y = th - overlap;
+    Sint64 cols = (src->w - tw + g->stride_x - 1) / g->stride_x + 1;
+    Sint64 rows = (src->h - th + g->stride_y - 1) / g->stride_y + 1;
+    if (cols * rows > INT_MAX) {
+        save_queue_post_status(q, true, "Grid: %lld tiles are too many", (long long)(cols * rows));
+        return false;
+    }
+    g->src   = src;
+    g->image = image;
+    g->ext   = ext;
+    g->tw    = tw;
+    g->th    = th;
+    g->batch.total = (int)(cols * rows);
+    path_stem(image, g->stem, sizeof(g->stem));
+    return true;
+}
+
+// Queues the next tiles until GRID_AHEAD jobs (tiles and their --scales
+// variants) are waiting on the workers, so a cut of millions of tiles costs
+// neither millions of jobs nor a UI stall.
+// Called again as jobs finish; tiles that cannot be queued count as failed.
+static void grid_feed(GridCut* g, SaveQueue* q, SessionLog* session)
+{
+    while (g->queued < g->batch.total && SDL_AtomicGet(&g->batch.pending) < GRID_AHEAD)
+    {
+        int x = SDL_min(g->x, g->src->w - g->tw);
+        int y = SDL_min(g->y, g->src->h - g->th);
+        CropRegion tile = { x, y, g->tw, g->th };
+        char name[512];
+        snprintf(name, sizeof(name), "%s_%05d_%05d_%dx%d%s", g->stem, x, y, g->tw, g->th, g->ext);
+        if (save_crop_deferred(q, g->src, &tile, name, &g->batch, NULL)) {
+            session_record(session, g->image, &tile, name);
+        } else {
+            SDL_AtomicIncRef(&g->batch.failed);
+            SDL_AtomicIncRef(&g->batch.done);
+        }
+        g->queued++;
+
+        if (x + g->tw < g->src->w) {
+            g->x += g->stride_x;
+        } else {
+            g->x = 0;
+            g->y += g->stride_y;
+        }
+    }
+}
+
+// ──────────────────────────────────────────────── Control socket ────────────────────────────────────────────────
+// --ipc /path.sock accepts line commands from external tools on a
+// Unix-domain socket, one reply line each:
+//   get                        → "crop X Y W H PATH" (or "error ...")
+//   crop X Y W H               → set the active crop (undoable)
+//   save [filename]            → queue a save like S
+//   batch manifest.csv         → queue every manifest row against the current image
+//   grab                       → "shm NAME W H PITCH RGBA32": the crop pixels in POSIX
+//                                shared memory, valid until the next grab on the
+//                                connection; unlinked when it closes
+// The sockets are non-blocking and owned by the UI thread. A watcher thread
+// only poll()s them and pushes an SDL event, so the idle loop still sleeps
+// in SDL_WaitEvent and commands are handled between frames.
+
+#define IPC_MAX_CLIENTS  8
+#define IPC_LINE_MAX  1024
+
+#ifndef _WIN32
+
+typedef struct {
+    int    fd;                  // -1 = unused
+    char   buf[IPC_LINE_MAX];
+    int    len;
+
+    // Shared memory returned by "grab"
+    int    shm_fd;
+    char   shm_name[64];
+    void*  shm_map;
+    size_t shm_size;
+} IpcClient;
+
+typedef struct {
+    int          listen_fd;     // -1 = disabled
+    char         path[108];
+    IpcClient    clients[IPC_MAX_CLIENTS];
+    SDL_mutex*   lock;          // guards the fds the watcher polls
+    SDL_sem*     polled;        // posted once the UI has serviced a wakeup
+    SDL_Thread*  watcher;
+    SDL_atomic_t quit;
+    SDL_atomic_t signalled;     // a wakeup event is outstanding
+    Uint32       event;
+} IpcServer;
+
+static int ipc_watcher(void* data)
+{
+    IpcServer* srv = data;
+    while (!SDL_AtomicGet(&srv->quit))
+    {
+        struct pollfd fds[1 + IPC_MAX_CLIENTS];
+        int n = 0;
+        SDL_LockMutex(srv->lock);
+        fds[n++] = (struct pollfd){ .fd = srv->listen_fd, .events = POLLIN };
+        for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+            if (srv->clients[i].fd >= 0)
+                fds[n++] = (struct pollfd){ .fd = srv->clients[i].fd, .events = POLLIN };
+        SDL_UnlockMutex(srv->lock);
+
+        // Short timeout so connections accepted meanwhile get polled too
+        if (poll(fds, n, 200) <= 0 || SDL_AtomicGet(&srv->quit)) continue;
+
+        SDL_AtomicSet(&srv->signalled, 1);
+        SDL_Event ev = { .type = srv->event };
+        SDL_PushEvent(&ev);
+        SDL_SemWait(srv->polled);
+    }
+    return 0;
+}
+
+static void ipc_client_close(IpcServer* srv, IpcClient* c)
+{
+    SDL_LockMutex(srv->lock);
+    close(c->fd);
+    c->fd = -1;
+    SDL_UnlockMutex(srv->lock);
+    c->len = 0;
+    if (c->shm_map) munmap(c->shm_map, c->shm_size);
+    if (c->shm_fd >= 0) {
+        close(c->shm_fd);
+        shm_unlink(c->shm_name);
+    }
+    c->shm_fd = -1;
+    c->shm_map = NULL;
+    c->shm_size = 0;
+}
+
+// `path` NULL leaves the server disabled (every call becomes a no-op)
+static bool ipc_start(IpcServer* srv, const char* path)
+{
+    memset(srv, 0, sizeof(*srv));
+    srv->listen_fd = -1;
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+        srv->clients[i].fd = srv->clients[i].shm_fd = -1;
+    if (!path) return true;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) return false;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    snprintf(srv->path, sizeof(srv->path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    unlink(path);               // stale socket from an earlier run
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+        close(fd);
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    srv->listen_fd = fd;
+
+    srv->event   = SDL_RegisterEvents(1);
+    srv->lock    = SDL_CreateMutex();
+    srv->polled  = SDL_CreateSemaphore(0);
+    srv->watcher = srv->lock && srv->polled ? SDL_CreateThread(ipc_watcher, "ipc", srv) : NULL;
+    return srv->watcher != NULL;
+}
+
+static void ipc_stop(IpcServer* srv)
+{
+    if (srv->listen_fd < 0) return;
+    SDL_AtomicSet(&srv->quit, 1);
+    if (srv->polled) SDL_SemPost(srv->polled);
+    if (srv->watcher) SDL_WaitThread(srv->watcher, NULL);
+
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+        if (srv->clients[i].fd >= 0) ipc_client_close(srv, &srv->clients[i]);
+    close(srv->listen_fd);
+    unlink(srv->path);
+    if (srv->polled) SDL_DestroySemaphore(srv->polled);
+    if (srv->lock) SDL_DestroyMutex(srv->lock);
+    srv->listen_fd = -1;
+}
+
+static bool ipc_is_event(const IpcServer* srv, const SDL_Event* ev)
+{
+    return srv->listen_fd >= 0 && ev->type == srv->event;
+}
+
+// UI thread: accepts connections and reads whatever has arrived, then lets
+// the watcher poll again. Never blocks.
+static void ipc_poll(IpcServer* srv)
+{
+    if (srv->listen_fd < 0 || !SDL_AtomicCAS(&srv->signalled, 1, 0)) return;
+
+    int fd;
+    while ((fd = accept(srv->listen_fd, NULL, NULL)) >= 0)
+    {
+        int slot = -1;
+        for (int i = 0; i < IPC_MAX_CLIENTS && slot < 0; i++)
+            if (srv->clients[i].fd < 0) slot = i;
+        if (slot < 0) {
+            static const char busy[] = "error too many connections\n";
+            send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        SDL_LockMutex(srv->lock);
+        srv->clients[slot].fd = fd;
+        SDL_UnlockMutex(srv->lock);
+    }
+
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+    {
+        IpcClient* c = &srv->clients[i];
+        if (c->fd < 0) continue;
+        ssize_t got = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+        if (got > 0) {
+            c->len += (int)got;
+            if (c->len == (int)sizeof(c->buf) - 1 && !memchr(c->buf, '\n', c->len))
+                c->len = 0;     // over-long line: drop it
+        } else if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            ipc_client_close(srv, c);
+        }
+    }
+    SDL_SemPost(srv->polled);
+}
+
+// Pops the next complete command line; `*client` identifies it for replies
+static bool ipc_next_command(IpcServer* srv, int* client, char* line, size_t size)
+{
+    for (int i = 0; i < IPC_MAX_CLIENTS; i++)
+    {
+        IpcClient* c = &srv->clients[i];
+        char* nl = c->fd >= 0 ? memchr(c->buf, '\n', c->len) : NULL;
+        if (!nl) continue;
+
+        int n = (int)(nl - c->buf);
+        snprintf(line, size, "%.*s", n, c->buf);
+        line[strcspn(line, "\r")] = '\0';
+        c->len -= n + 1;
+        memmove(c->buf, nl + 1, c->len);
+        *client = i;
+        return true;
+    }
+    return false;
+}
+
+static void ipc_reply(IpcServer* srv, int client, const char* fmt, ...)
+{
+    IpcClient* c = &srv->clients[client];
+    if (c->fd < 0) return;
+    char buf[IPC_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+    va_end(ap);
+    n = SDL_min(n, (int)sizeof(buf) - 2);
+    buf[n++] = '\n';
+    // Replies are short; a client that stops reading gets disconnected
+    if (send(c->fd, buf, n, MSG_NOSIGNAL) != n)
+        ipc_client_close(srv, c);
+}
+
+// Extracts `crop` straight into the connection's shared memory object
+static void ipc_grab(IpcServer* srv, int client, SDL_Surface* src, const CropRegion* crop)
+{
+    IpcClient* c = &srv->clients[client];
+    size_t pitch = (size_t)crop->w * 4;
+    size_t size  = pitch * crop->h;
+
+    if (c->shm_fd < 0) {
+        snprintf(c->shm_name, sizeof(c->shm_name), "/cookie_cutter.%d.%d", (int)getpid(), client);
+        c->shm_fd = shm_open(c->shm_name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (c->shm_fd < 0) {
+            ipc_reply(srv, client, "error shm_open: %s", strerror(errno));
+            return;
+        }
+    }
+    if (size != c->shm_size) {
+        if (c->shm_map) munmap(c->shm_map, c->shm_size);
+        c->shm_map  = NULL;
+        c->shm_size = 0;
+        if (ftruncate(c->shm_fd, (off_t)size) != 0) {
+            ipc_reply(srv, client, "error ftruncate: %s", strerror(errno));
+            return;
+        }
+        void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, c->shm_fd, 0);
+        if (map == MAP_FAILED) {
+            ipc_reply(srv, client, "error mmap: %s", strerror(errno));
+            return;
+        }
+        c->shm_map  = map;
+        c->shm_size = size;
+    }
+    if (!extract_crop_to(src, crop, c->shm_map, (int)pitch)) {
+        ipc_reply(srv, client, "error %s", SDL_GetError());
+        return;
+    }
+    ipc_reply(srv, client, "shm %s %d %d %d RGBA32", c->shm_name, crop->w, crop->h, (int)pitch);
+}
+
+#else   // no Unix-domain sockets / POSIX shm
+
+typedef struct { int listen_fd; } IpcServer;
+
+static bool ipc_start(IpcServer* srv, const char* path) { srv->listen_fd = -1; return path == NULL; }
+static void ipc_stop(IpcServer* srv) { (void)srv; }
+static bool ipc_is_event(const IpcServer* srv, const SDL_Event* ev) { (void)srv; (void)ev; return false; }
+static void ipc_poll(IpcServer* srv) { (void)srv; }
+static bool ipc_next_command(IpcServer* srv, int* client, char* line, size_t size)
+{
+    (void)srv; (void)client; (void)line; (void)size;
+    return false;
+}
+static void ipc_reply(IpcServer* srv, int client, const char* fmt, ...) { (void)srv; (void)client; (void)fmt; }
+static void ipc_grab(IpcServer* srv, int client, SDL_Surface* src, const CropRegion* crop)
+{
+    (void)srv; (void)client; (void)src; (void)crop;
+}
+
+#endif
+
+// ──────────────────────────────────────────────── Headless batch mode ────────────────────────────────────────────────
+// --batch manifest.csv input.png: no window or renderer, every manifest row is
+// extracted and encoded on a worker per core. Manifest rows are
+// "x,y,w,h[,filename]"; blank lines, '#' comments and a header row are skipped.
+// "# image: path" lines (written by --session) name the source of the rows
+// that follow, so a session file replays without an input argument.
+
+typedef struct {
+    CropRegion crop;
+    char       filename[512];
+    int        image;           // index into the manifest's images, -1 if none was named
+} BatchEntry;
+
+static BatchEntry* load_manifest(const char* path, const char* ext, int* count, ImageList* images)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open manifest %s\n", path);
+        return NULL;
+    }
+
+    BatchEntry* entries = NULL;
+    int n = 0, cap = 0, lineno = 0;
+    char line[1024];
+    bool ok = true;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        lineno++;
+        char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (strncmp(p, "# image:", 8) == 0) {
+            p += 8;
+            while (*p == ' ' || *p == '\t') p++;
+            p[strcspn(p, "\r\n")] = '\0';
+            if (!image_list_push(images, p)) { ok = false; break; }
+            continue;
+        }
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+
+        BatchEntry e = { .image = images->count - 1 };
+        int used = 0;
+        if (sscanf(p, "%d ,%d ,%d ,%d%n", &e.crop.x, &e.crop.y, &e.crop.w, &e.crop.h, &used) != 4) {
+            if (n == 0 && lineno == 1) continue;    // header row
+            fprintf(stderr, "%s:%d: expected x,y,w,h[,filename]\n", path, lineno);
+            ok = false;
+            break;
+        }
+
+        p += used;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') {
+            p++;
+            while (*p == ' ' || *p == '\t') p++;
+            p[strcspn(p, "\r\n")] = '\0';
+            snprintf(e.filename, sizeof(e.filename), "%s", p);
+        }
+        if (!e.filename[0])
+            snprintf(e.filename, sizeof(e.filename), "crop_%05d_%dx%d%s", n + 1, e.crop.w, e.crop.h, ext);
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            BatchEntry* grown = realloc(entries, (size_t)cap * sizeof(*grown));
+            if (!grown) { ok = false; break; }
+            entries = grown;
+        }
+        entries[n++] = e;
+    }
+    fclose(f);
+
+    if (!ok) {
+        free(entries);
+        return NULL;
+    }
+    *count = n;
+    return entries;
+}
+
+typedef struct {
+    double load_s;
+    int    load_failed, nimages;
+} BatchStats;
+
+// Queues every entry on `q` and waits for them. Consecutive rows from one
+// image share a decode. The next image decodes while the workers drain the
+// previous one's rows, so at most two images are loaded and the workers
+// only idle for the first decode. `batches` (may be NULL) gives each row's
+// SaveBatch.
+static void batch_crop_entries(SaveQueue* q, const BatchEntry* entries, SaveBatch* const* batches, int count,
+                               const ImageList* images, BatchStats* st)
+{
+    double freq = (double)SDL_GetPerformanceFrequency();
+    SDL_Surface* loaded[2] = { NULL, NULL };
+    SaveBatch holds[2];
+    memset(holds, 0, sizeof(holds));
+    int k = 0;
+
+    for (int i = 0, end; i < count; i = end)
+    {
+        for (end = i; end < count && entries[end].image == entries[i].image; end++) {}
+        const char* path = images->paths[entries[i].image];
+
+        Uint64 t1 = SDL_GetPerformanceCounter();
+        SDL_Surface* surface = load_image_cached(path);
+        st->load_s += (SDL_GetPerformanceCounter() - t1) / freq;
+        if (!surface) {
+            fprintf(stderr, "Failed to load %s: %s\n", path, IMG_GetError());
+            st->load_failed += end - i;
+            for (int j = i; batches && j < end; j++) SDL_AtomicIncRef(&batches[j]->failed);
+            continue;
+        }
+        st->nimages++;
+
+        k ^= 1;
+        loaded[k] = surface;
+        for (int j = i; j < end; j++)
+            save_crop_deferred(q, surface, &entries[j].crop, entries[j].filename, batches ? batches[j] : NULL,
+                               &holds[k]);
+
+        // The older image is released while this one's rows are encoding
+        if (loaded[k ^ 1]) {
+            save_batch_wait(q, &holds[k ^ 1]);
+            image_free(loaded[k ^ 1]);
+            loaded[k ^ 1] = NULL;
+        }
+    }
+    save_queue_wait(q);
+    for (int j = 0; j < 2; j++) image_free(loaded[j]);
+}
+
+// `input_path` (may be NULL) overrides the manifest's "# image:" lines
+static int run_batch(const char* manifest_path, const char* input_path, const EncodeOptions* encode)
+{
+    int count = 0;
+    ImageList images = {0};
+    BatchEntry* entries = load_manifest(manifest_path, encoder_ext(encode->encoder), &count, &images);
+    if (!entries) {
+        image_list_free(&images);
+        return 1;
+    }
+    if (input_path) {
+        image_list_free(&images);
+        image_list_push(&images, input_path);
+        for (int i = 0; i < count; i++) entries[i].image = 0;
+    }
+    for (int i = 0; i < count; i++)
+        if (entries[i].image < 0) {
+            fprintf(stderr, "%s: row %d has no \"# image:\" source; pass the image on the command line\n",
+                    manifest_path, i + 1);
+            image_list_free(&images);
+            free(entries);
+            return 1;
+        }
+
+    SaveQueue saves;
+    if (!save_queue_init(&saves, SDL_GetCPUCount(), false, encode)) {
+        fprintf(stderr, "Failed to start save workers: %s\n", SDL_GetError());
+        save_queue_shutdown(&saves);
+        image_list_free(&images);
+        free(entries);
+        return 1;
+    }
+
+    double freq = (double)SDL_GetPerformanceFrequency();
+    BatchStats st = {0};
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    batch_crop_entries(&saves, entries, NULL, count, &images, &st);
+
+    int nworkers = saves.nworkers;
+    save_queue_shutdown(&saves);
+    double total_s = (SDL_GetPerformanceCounter() - t0) / freq;
+    double crop_s = SDL_max(total_s, 1e-9);     // decodes overlap the encodes, so rates are end to end
+
+    printf("Batch: %d/%d crops from %d image(s) on %d workers, %s pixel kernels\n",
+           saves.saved, count, st.nimages, nworkers, pixel_kernels.isa);
+    printf("  encode  %s, zlib level %d, %s filter\n",
+           encode->encoder, encode->png_level, png_filter_names[encode->png_filter]);
+    printf("  decode  %.3f s\n", st.load_s);
+    printf("  crops   %.3f s  %.1f crops/s  %.1f MB/s pixels  %.1f MB/s written\n",
+           crop_s, saves.saved / crop_s,
+           saves.pixel_bytes / (1024.0 * 1024.0) / crop_s,
+           saves.file_bytes / (1024.0 * 1024.0) / crop_s);
+    if (saves.skipped) printf("  skipped %d near-duplicate(s)\n", saves.skipped);
+    int failed = saves.failed + st.load_failed;
+    if (failed) fprintf(stderr, "  %d crop(s) failed\n", failed);
+
+    image_list_free(&images);
+    free(entries);
+    return failed ? 1 : 0;
+}
+
+// ──────────────────────────────────────────────── Distributed batch workers ────────────────────────────────────────────────
+// --worker DIR makes this process one node of a batch farm sharing DIR over
+// any filesystem with an atomic rename (local disk, NFS). Producers drop job
+// files in the --batch manifest format, "# image:" lines and crop names
+// included (unnamed rows are numbered per job), into DIR/todo. Each round a
+// node claims up to WORKER_CLAIM_JOBS of them by renaming them into
+// DIR/running, so every job goes to exactly one node, and cuts all their
+// rows grouped by source image: an image named by several claimed jobs is
+// decoded once. Crops go to the node's own tar shards as <job>/<crop>
+// members, so jobs cannot overwrite each other's crops; a job naming one
+// crop twice fails. The shards (DIR/shards/<node>, or
+// <--shard prefix>-<node>) stay open across rounds and roll over at
+// --shard-mb; they are flushed and fsync()ed before the round's jobs move
+// on to DIR/done, or DIR/failed to be moved back into todo for a retry,
+// and get their end-of-archive blocks when they roll or the node exits.
+//
+// Every member a job writes is listed in DIR/members/<job>. A failed job
+// keeps its list; a retry skips the rows whose members (every --scales
+// size) are all in some node's shard already, writes only the missing
+// members of the rest and adds them, so no member is ever written twice.
+// The list is removed once the job is done.
+// DIR/metrics/<node>.json holds the node's throughput so far and is
+// replaced after every round. The node exits once todo is empty.
+
+#define WORKER_CLAIM_JOBS 8
+
+#ifndef _WIN32
+
+typedef struct {
+    char      name[256];        // job file name in todo/
+    char      path[1024];       // where it sits while claimed
+    bool      bad;              // unreadable, rows without an image, or no members log
+    int       resumed;          // rows an earlier attempt already wrote
+    char      members[1024];    // DIR/members/<job>
+    char      members_tmp[1024]; // this attempt's list, replaces `members` if it fails too
+    SaveBatch batch;
+} WorkerJob;
+
+typedef struct {
+    const char* dir;
+    char        node[128];
+    Uint64      t0;
+    int         jobs_done, jobs_failed, rows;
+    BatchStats  st;
+} WorkerNode;
+
+static bool worker_mkdir(const char* dir, const char* sub)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, sub);
+    if (mkdir(path, 0777) == 0 || errno == EEXIST) return true;
+    fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+    return false;
+}
+
+// Claims up to `max` jobs from todo/; -1 if it cannot be read
+static int worker_claim(const WorkerNode* w, WorkerJob* jobs, int max)
+{
+    char todo[1024];
+    snprintf(todo, sizeof(todo), "%s/todo", w->dir);
+    DIR* dir = opendir(todo);
+    if (!dir) {
+        fprintf(stderr, "Cannot read %s: %s\n", todo, strerror(errno));
+        return -1;
+    }
+
+    int n = 0;
+    struct dirent* de;
+    while (n < max && (de = readdir(dir)))
+    {
+        if (de->d_name[0] == '.') continue;     // also producers' temp files
+        WorkerJob* job = &jobs[n];
+        memset(job, 0, sizeof(*job));
+        char from[1024];
+        if (snprintf(from, sizeof(from), "%s/%s", todo, de->d_name) >= (int)sizeof(from) ||
+            snprintf(job->name, sizeof(job->name), "%s", de->d_name) >= (int)sizeof(job->name) ||
+            snprintf(job->path, sizeof(job->path), "%s/running/%s.%s", w->dir, job->name, w->node)
+                >= (int)sizeof(job->path)) {
+            fprintf(stderr, "Skipping job %s/%s: path too long\n", todo, de->d_name);
+            continue;
+        }
+        if (rename(from, job->path) == 0) n++;  // otherwise another node was first
+    }
+    closedir(dir);
+    return n;
+}
+
+typedef struct {
+    BatchEntry entry;
+    SaveBatch* batch;
+    int        seq;
+} WorkerRow;
+
+static int compare_worker_rows(const void* a, const void* b)
+{
+    const WorkerRow* x = a;
+    const WorkerRow* y = b;
+    if (x->entry.image != y->entry.image) return x->entry.image - y->entry.image;
+    return x->seq - y->seq;
+}
+
+// The member names in the log at `path`, sorted; NULL (and *n = 0) if none
+static char** worker_read_members(const char* path, int* n)
+{
+    *n = 0;
+    FILE* f = fopen(path, "r");
+    if (!f) return NULL;
+    char** names = NULL;
+    int cap = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0]) continue;
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 256;
+            char** grown = realloc(names, (size_t)cap * sizeof(*grown));
+            if (!grown) break;
+            names = grown;
+        }
+        if (!(names[*n] = SDL_strdup(line))) break;
+        (*n)++;
+    }
+    fclose(f);
+    if (*n > 0) qsort(names, (size_t)*n, sizeof(*names), compare_paths);
+    return names;
+}
+
+static void worker_free_members(char** names, int n)
+{
+    for (int i = 0; i < n; i++) SDL_free(names[i]);
+    free(names);
+}
+
+// True when every file `name` turns into (each --scales size) is listed
+static bool worker_row_written(char** written, int nwritten, const char* name, const EncodeOptions* opt)
+{
+    if (nwritten == 0) return false;
+    int nsides = opt->nscales > 0 ? opt->nscales : 1;
+    for (int i = 0; i < nsides; i++)
+    {
+        char variant[512];
+        const char* key = variant;
+        if (opt->nscales == 0 || opt->scales[i] == 0) key = name;
+        else scale_filename(variant, sizeof(variant), name, opt->scales[i]);
+        if (!bsearch(&key, written, (size_t)nwritten, sizeof(*written), compare_paths)) return false;
+    }
+    return true;
+}
+
+// Opens this attempt's members log for `job`, seeded with what earlier
+// attempts wrote, which the batch keeps so the save workers skip them
+static bool worker_open_members(const WorkerNode* w, WorkerJob* job)
+{
+    if (snprintf(job->members, sizeof(job->members), "%s/members/%s", w->dir, job->name) >= (int)sizeof(job->members) ||
+        snprintf(job->members_tmp, sizeof(job->members_tmp), "%s.%s.tmp", job->members, w->node)
+            >= (int)sizeof(job->members_tmp)) {
+        fprintf(stderr, "%s: members log path too long\n", job->name);
+        return false;
+    }
+    job->batch.members = fopen(job->members_tmp, "w");
+    if (!job->batch.members) {
+        fprintf(stderr, "Cannot write %s: %s\n", job->members_tmp, strerror(errno));
+        return false;
+    }
+    SaveBatch* b = &job->batch;
+    b->written = worker_read_members(job->members, &b->nwritten);
+    for (int i = 0; i < b->nwritten; i++) fprintf(b->members, "%s\n", b->written[i]);
+    return true;
+}
+
+// Ends the attempt's members log: dropped with the old one once the job is
+// done, otherwise it becomes the list the next attempt resumes from
+static void worker_close_members(WorkerJob* job, bool done)
+{
+    worker_free_members(job->batch.written, job->batch.nwritten);
+    job->batch.written  = NULL;
+    job->batch.nwritten = 0;
+    if (!job->batch.members) return;
+    bool ok = fclose(job->batch.members) == 0;
+    job->batch.members = NULL;
+    if (done) {
+        remove(job->members_tmp);
+        remove(job->members);
+    } else if (!ok || rename(job->members_tmp, job->members) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", job->members, strerror(errno));
+    }
+}
+
+// Every claimed job's rows, by source image; `images` collects each path
+// once. Rows an earlier attempt of the job already wrote are left out.
+static WorkerRow* worker_load_rows(const WorkerNode* w, WorkerJob* jobs, int njobs, const EncodeOptions* opt,
+                                   ImageList* images, int* count)
+{
+    const char* ext = encoder_ext(opt->encoder);
+    WorkerRow* rows = NULL;
+    int n = 0;
+    for (int j = 0; j < njobs; j++)
+    {
+        int c = -1;             // stays -1 if the manifest cannot be read
+        ImageList named = {0};
+        BatchEntry* entries = load_manifest(jobs[j].path, ext, &c, &named);
+        int* image_of = c >= 0 ? calloc((size_t)named.count + 1, sizeof(*image_of)) : NULL;
+        WorkerRow* grown = image_of ? realloc(rows, (size_t)(n + c + 1) * sizeof(*grown)) : NULL;
+        jobs[j].bad = !grown;
+        for (int i = 0; grown && i < named.count; i++) {
+            int k = 0;
+            while (k < images->count && strcmp(images->paths[k], named.paths[i]) != 0) k++;
+            if (k == images->count && !image_list_push(images, named.paths[i])) jobs[j].bad = true;
+            image_of[i] = k;
+        }
+        for (int i = 0; grown && i < c; i++)
+            if (entries[i].image < 0) {
+                fprintf(stderr, "%s: row %d has no \"# image:\" source\n", jobs[j].name, i + 1);
+                jobs[j].bad = true;
+            }
+
+        char** names = !jobs[j].bad && c > 0 ? malloc((size_t)c * sizeof(*names)) : NULL;
+        if (!jobs[j].bad && c > 0 && !names) jobs[j].bad = true;
+        for (int i = 0; names && i < c; i++) {
+            char member[sizeof(entries[i].filename)];
+            if (snprintf(member, sizeof(member), "%s/%s", jobs[j].name, entries[i].filename) >= (int)sizeof(member)) {
+                fprintf(stderr, "%s: crop name of row %d is too long\n", jobs[j].name, i + 1);
+                jobs[j].bad = true;
+            }
+            memcpy(entries[i].filename, member, sizeof(member));
+            names[i] = entries[i].filename;
+        }
+        if (names && !jobs[j].bad) {
+            qsort(names, (size_t)c, sizeof(*names), compare_paths);
+            for (int i = 1; i < c && !jobs[j].bad; i++)
+                if (strcmp(names[i - 1], names[i]) == 0) {
+                    fprintf(stderr, "%s: crop %s is named twice\n", jobs[j].name, names[i] + strlen(jobs[j].name) + 1);
+                    jobs[j].bad = true;
+                }
+        }
+        free(names);
+
+        SaveBatch* b = &jobs[j].batch;
+        if (!jobs[j].bad && !worker_open_members(w, &jobs[j])) jobs[j].bad = true;
+
+        if (grown) rows = grown;
+        if (!jobs[j].bad) {
+            for (int i = 0; i < c; i++) {
+                if (worker_row_written(b->written, b->nwritten, entries[i].filename, opt)) {
+                    jobs[j].resumed++;
+                    continue;
+                }
+                rows[n] = (WorkerRow){ entries[i], &jobs[j].batch, n };
+                rows[n].entry.image = image_of[entries[i].image];
+                n++;
+            }
+            jobs[j].batch.total = c - jobs[j].resumed;
+        }
+        free(image_of);
+        free(entries);
+        image_list_free(&named);
+    }
+    if (n > 0) qsort(rows, n, sizeof(*rows), compare_worker_rows);
+    *count = n;
+    return rows;
+}
+
+static void worker_write_metrics(const WorkerNode* w, SaveQueue* q)
+{
+    char path[1024], tmp[1100];
+    snprintf(path, sizeof(path), "%s/metrics/%s.json", w->dir, w->node);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    SDL_LockMutex(q->lock);
+    int saved = q->saved, failed = q->failed + w->st.load_failed, skipped = q->skipped;
+    double pixel_mb = q->pixel_bytes / (1024.0 * 1024.0), file_mb = q->file_bytes / (1024.0 * 1024.0);
+    SDL_UnlockMutex(q->lock);
+    double elapsed_s = (SDL_GetPerformanceCounter() - w->t0) / (double)SDL_GetPerformanceFrequency();
+    double crop_s = SDL_max(elapsed_s, 1e-9);  // decodes overlap the encodes
+
+    fprintf(f, "{\n  \"node\": \"%s\",\n  \"workers\": %d,\n  \"pixel_kernels\": \"%s\",\n",
+            w->node, q->nworkers, pixel_kernels.isa);
+    fprintf(f, "  \"updated\": %lld,\n  \"elapsed_s\": %.3f,\n", (long long)time(NULL), elapsed_s);
+    fprintf(f, "  \"jobs_done\": %d,\n  \"jobs_failed\": %d,\n  \"images\": %d,\n",
+            w->jobs_done, w->jobs_failed, w->st.nimages);
+    fprintf(f, "  \"crops_saved\": %d,\n  \"crops_failed\": %d,\n  \"crops_skipped\": %d,\n", saved, failed, skipped);
+    fprintf(f, "  \"decode_s\": %.3f,\n  \"crops_per_s\": %.1f,\n", w->st.load_s, saved / crop_s);
+    fprintf(f, "  \"pixel_mb_per_s\": %.1f,\n  \"written_mb_per_s\": %.1f\n}\n", pixel_mb / crop_s, file_mb / crop_s);
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+}
+
+// `node` (may be NULL) names this node instead of the host name
+static int run_worker(const char* dir, const char* node, const EncodeOptions* encode)
+{
+    WorkerNode w = { .dir = dir };
+    char host[64] = "node";
+    if (!node && gethostname(host, sizeof(host)) == 0) host[sizeof(host) - 1] = '\0';
+    snprintf(w.node, sizeof(w.node), "%s-%d", node ? node : host, (int)getpid());
+    for (char* c = w.node; *c; c++)     // it ends up in file names and JSON
+        if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_' && *c != '.') *c = '_';
+
+    if (!worker_mkdir(dir, "running") || !worker_mkdir(dir, "done") || !worker_mkdir(dir, "failed") ||
+        !worker_mkdir(dir, "metrics") || !worker_mkdir(dir, "members") ||
+        (!encode->shard_prefix && !worker_mkdir(dir, "shards")))
+        return 1;
+
+    char prefix[1024];
+    if (encode->shard_prefix) snprintf(prefix, sizeof(prefix), "%s-%s", encode->shard_prefix, w.node);
+    else                      snprintf(prefix, sizeof(prefix), "%s/shards/%s", dir, w.node);
+    EncodeOptions opt = *encode;
+    opt.shard_prefix = prefix;
+
+    SaveQueue saves;
+    if (!save_queue_init(&saves, SDL_GetCPUCount(), false, &opt)) {
+        fprintf(stderr, "Failed to start save workers: %s\n", SDL_GetError());
+        save_queue_shutdown(&saves);
+        return 1;
+    }
+    printf("Worker %s: %d workers, %s pixel kernels, shards %s-NNNNNN.tar\n",
+           w.node, saves.nworkers, pixel_kernels.isa, prefix);
+
+    WorkerJob jobs[WORKER_CLAIM_JOBS];
+    w.t0 = SDL_GetPerformanceCounter();
+    int njobs;
+    while ((njobs = worker_claim(&w, jobs, WORKER_CLAIM_JOBS)) > 0)
+    {
+        int count = 0;
+        ImageList images = {0};
+        WorkerRow* rows = worker_load_rows(&w, jobs, njobs, &opt, &images, &count);
+        BatchEntry* entries = malloc((size_t)SDL_max(count, 1) * sizeof(*entries));
+        SaveBatch** batches = malloc((size_t)SDL_max(count, 1) * sizeof(*batches));
+        bool ok = entries && batches && (rows || count == 0);
+        if (ok) {
+            for (int i = 0; i < count; i++) {
+                entries[i] = rows[i].entry;
+                batches[i] = rows[i].batch;
+            }
+            batch_crop_entries(&saves, entries, batches, count, &images, &w.st);
+            w.rows += count;
+        }
+
+        // A job only counts as done once its shard members are on disk. The
+        // shard itself stays open across rounds and rolls at --shard-mb.
+        ok = shard_sync(&saves.shard) && ok;
+
+        for (int j = 0; j < njobs; j++)
+        {
+            int failed = SDL_AtomicGet(&jobs[j].batch.failed);
+            bool done = ok && !jobs[j].bad && failed == 0;
+            char to[1024];
+            if (snprintf(to, sizeof(to), "%s/%s/%s", dir, done ? "done" : "failed", jobs[j].name) >= (int)sizeof(to))
+                fprintf(stderr, "Cannot move %s: path too long\n", jobs[j].path);
+            else if (rename(jobs[j].path, to) != 0)
+                fprintf(stderr, "Cannot move %s to %s: %s\n", jobs[j].path, to, strerror(errno));
+            worker_close_members(&jobs[j], done);
+            if (done) w.jobs_done++;
+            else      w.jobs_failed++;
+            printf("Job %s: %s, %d crop(s)%s", jobs[j].name, done ? "done" : "FAILED",
+                   jobs[j].batch.total, failed ? ", some failed" : "");
+            if (jobs[j].resumed) printf(", %d already written", jobs[j].resumed);
+            printf("\n");
+        }
+        worker_write_metrics(&w, &saves);
+
+        free(batches);
+        free(entries);
+        free(rows);
+        image_list_free(&images);
+    }
+
+    worker_write_metrics(&w, &saves);
+    int nworkers = saves.nworkers;
+    save_queue_shutdown(&saves);
+    double crop_s = SDL_max((SDL_GetPerformanceCounter() - w.t0) / (double)SDL_GetPerformanceFrequency(), 1e-9);
+    printf("Worker %s: %d job(s) done, %d failed; %d/%d crops from %d image(s) on %d workers\n",
+           w.node, w.jobs_done, w.jobs_failed, saves.saved, w.rows, w.st.nimages, nworkers);
+    printf("  decode  %.3f s\n", w.st.load_s);
+    printf("  crops   %.3f s  %.1f crops/s  %.1f MB/s written\n",
+           crop_s, saves.saved / crop_s, saves.file_bytes / (1024.0 * 1024.0) / crop_s);
+    return njobs < 0 || w.jobs_failed ? 1 : 0;
+}
+
+#else   // no POSIX rename/mkdir semantics to build the queue on
+
+static int run_worker(const char* dir, const char* node, const EncodeOptions* encode)
+{
+    (void)dir; (void)node; (void)encode;
+    fprintf(stderr, "--worker is not supported on this platform\n");
+    return 1;
+}
+
+#endif
+
+// ──────────────────────────────────────────────── Benchmark harness ────────────────────────────────────────────────
+// --bench out.json [image|directory...]: headless timings of every stage a crop
+// goes through, written as JSON so runs can be compared across commits.
+// Without a corpus, deterministic synthetic images are written to the temp
+// directory in each loader path's format (mapped PPM, PNG, BMP) and removed
+// afterwards. Every figure is the median (and min) of --bench-reps runs.
+// Texture uploads go through SDL's software renderer, so they measure the
+// tile conversion and copy path rather than a particular GPU driver.
+
+#define BENCH_DEFAULT_REPS   5
+#define BENCH_EXTRACT_CROPS 64
+#define BENCH_BATCH_CROPS  256
+#define BENCH_CROP_SIZE    256
+#define BENCH_ENCODE_SIZE  512
+
 typedef struct {
-    int x, y;       // top-left in original image coordinates
-    int w, h;       // width & height (currently forced square)
-} CropRegion;
+    FILE*       out;
+    int         nresults;
+    int         reps;
+    double      freq;
+    double*     samples;        // 2 × reps timings in ms; stages fill the first reps
+    const char* image;          // corpus file being measured
+    Uint32      format;         // its decoded pixel format
+} Bench;
 
-static void save_crop(SDL_Surface* src, const CropRegion* crop, const char* filename)
+static Uint32 bench_rand(Uint32* state)
 {
-    if (crop->w <= 0 || crop->h <= 0) return;
+    // xorshift32: crop positions and synthetic pixels are the same every run
+    Uint32 x = *state;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return *state = x;
+}
 
-    SDL_Rect srcrect = { crop->x, crop->y, crop->w, crop->h };
+static double bench_ms(const Bench* b, Uint64 t0)
+{
+    return (SDL_GetPerformanceCounter() - t0) * 1000.0 / b->freq;
+}
 
-    SDL_Surface* cropped = SDL_CreateRGBSurfaceWithFormat(
-        0, crop->w, crop->h, 32, SDL_PIXELFORMAT_RGBA32);
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
 
-    if (!cropped) return;
+static void bench_json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20)         fprintf(f, "\\u%04x", c);
+        else                       fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// One result object from `samples` (b->reps of them, sorted in place).
+// `bytes` are the pixel bytes one run processes (for MB/s), `out_bytes` the
+// encoded size if the stage has one.
+static void bench_report(Bench* b, const char* stage, int w, int h, double* samples,
+                         double bytes, double out_bytes)
+{
+    qsort(samples, b->reps, sizeof(*samples), compare_doubles);
+    double median = samples[b->reps / 2], min = samples[0];
 
-    SDL_BlitSurface(src, &srcrect, cropped, NULL);
+    fprintf(b->out, "%s\n    {\"stage\": ", b->nresults++ ? "," : "");
+    bench_json_string(b->out, stage);
+    fprintf(b->out, ", \"image\": ");
+    bench_json_string(b->out, b->image);
+    fprintf(b->out, ", \"format\": ");
+    bench_json_string(b->out, SDL_GetPixelFormatName(b->format));
+    fprintf(b->out, ", \"w\": %d, \"h\": %d, \"median_ms\": %.4f, \"min_ms\": %.4f, \"mb_s\": %.2f",
+            w, h, median, min, median > 0 ? bytes / (1024.0 * 1024.0) / (median / 1000.0) : 0.0);
+    if (out_bytes > 0) fprintf(b->out, ", \"out_bytes\": %.0f", out_bytes);
+    fputc('}', b->out);
 
-    if (IMG_SavePNG(cropped, filename) == 0) {
-        printf("Saved: %s  (%d×%d)\n", filename, crop->w, crop->h);
-    } else {
-        fprintf(stderr, "Failed to save %s: %s\n", filename, IMG_GetError());
+    printf("  %-24s %10.3f ms  (min %10.3f)\n", stage, median, min);
+}
+
+static const char* bench_temp_dir(void)
+{
+    const char* dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = getenv("TEMP");
+#ifdef _WIN32
+    if (!dir || !*dir) dir = ".";
+#else
+    if (!dir || !*dir) dir = "/tmp";
+#endif
+    return dir;
+}
+
+// Smooth gradients plus low-amplitude noise: compresses somewhere between a
+// photo and a flat render, and is identical on every run
+static SDL_Surface* bench_synthetic(int w, int h)
+{
+    SDL_Surface* s = SDL_CreateRGBSurfaceWithFormat(0, w, h, 24, SDL_PIXELFORMAT_RGB24);
+    if (!s) return NULL;
+    Uint32 seed = 0x9e3779b9u;
+    for (int y = 0; y < h; y++) {
+        Uint8* row = (Uint8*)s->pixels + (size_t)y * s->pitch;
+        for (int x = 0; x < w; x++) {
+            Uint32 n = bench_rand(&seed) & 15;
+            row[x * 3 + 0] = (Uint8)(x * 255 / w + n);
+            row[x * 3 + 1] = (Uint8)(y * 255 / h + n);
+            row[x * 3 + 2] = (Uint8)(((x ^ y) >> 3) + n);
+        }
+    }
+    return s;
+}
+
+static bool bench_write_ppm(SDL_Surface* s, const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fprintf(f, "P6\n%d %d\n255\n", s->w, s->h) > 0;
+    for (int y = 0; ok && y < s->h; y++)
+        ok = fwrite((Uint8*)s->pixels + (size_t)y * s->pitch, 3, s->w, f) == (size_t)s->w;
+    return fclose(f) == 0 && ok;
+}
+
+static bool bench_write_png(SDL_Surface* s, const char* path)
+{
+    CropRegion all = { 0, 0, s->w, s->h };
+    SDL_Surface* px = extract_crop(s, &all);
+    EncodeOptions opt = {0};
+    encode_options_set_profile(&opt, "fast");
+    ByteBuf buf = {0};
+    Arena scratch = {0};
+    bool ok = px && encode_png(px, &opt, &scratch, &buf) && write_file(path, &buf);
+    arena_free(&scratch);
+    bytebuf_free(&buf);
+    SDL_FreeSurface(px);
+    return ok;
+}
+
+// Writes the synthetic corpus to uniquely named temp files. `names` gets a
+// stable label per file so results line up across runs.
+static bool bench_make_corpus(ImageList* corpus, ImageList* names)
+{
+    static const int sizes[] = { 1024, 4096 };
+    static const char* const exts[] = { "ppm", "png", "bmp" };
+    unsigned tag = (unsigned)time(NULL);
+
+    for (size_t i = 0; i < SDL_arraysize(sizes); i++)
+    {
+        SDL_Surface* s = bench_synthetic(sizes[i], sizes[i]);
+        if (!s) return false;
+        for (size_t e = 0; e < SDL_arraysize(exts); e++)
+        {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/cc_bench_%08x_%d.%s", bench_temp_dir(), tag, sizes[i], exts[e]);
+            bool ok = e == 0 ? bench_write_ppm(s, path)
+                    : e == 1 ? bench_write_png(s, path)
+                    :          SDL_SaveBMP(s, path) == 0;
+            char name[64];
+            snprintf(name, sizeof(name), "synthetic_%d.%s", sizes[i], exts[e]);
+            if (!ok || !image_list_push(corpus, path) || !image_list_push(names, name)) {
+                fprintf(stderr, "Failed to write %s: %s\n", path, SDL_GetError());
+                SDL_FreeSurface(s);
+                return false;
+            }
+        }
+        SDL_FreeSurface(s);
+    }
+    return true;
+}
+
+// Crops of `size` (clamped to the image) at seeded positions
+static void bench_crops(const SDL_Surface* s, int size, CropRegion* crops, int n)
+{
+    Uint32 seed = 12345;
+    int cw = SDL_min(size, s->w), ch = SDL_min(size, s->h);
+    for (int i = 0; i < n; i++) {
+        crops[i].w = cw;
+        crops[i].h = ch;
+        crops[i].x = (int)(bench_rand(&seed) % (Uint32)(s->w - cw + 1));
+        crops[i].y = (int)(bench_rand(&seed) % (Uint32)(s->h - ch + 1));
     }
+}
+
+static bool bench_image(Bench* b, const char* path, const char* name, SDL_Renderer* renderer)
+{
+    char stage[64];
+    Uint64 t0;
+
+    // decode (for mapped PNM this is the header parse and mmap only)
+    SDL_Surface* s = NULL;
+    for (int r = 0; r < b->reps; r++) {
+        if (s) image_free(s);
+        t0 = SDL_GetPerformanceCounter();
+        s = load_image(path);
+        b->samples[r] = bench_ms(b, t0);
+        if (!s) {
+            fprintf(stderr, "Failed to load %s: %s\n", path, IMG_GetError());
+            return false;
+        }
+    }
+    printf("%s (%dx%d %s)\n", path, s->w, s->h, SDL_GetPixelFormatName(s->format->format));
+    b->image  = name;
+    b->format = s->format->format;
+    int w = s->w, h = s->h;
+    double image_bytes = (double)w * h * 4;
+    bench_report(b, "decode", w, h, b->samples, image_bytes, 0);
+
+    // crop extraction in the saved format into one reused buffer
+    CropRegion crops[BENCH_BATCH_CROPS];
+    bench_crops(s, BENCH_CROP_SIZE, crops, BENCH_BATCH_CROPS);
+    int cw = crops[0].w, ch = crops[0].h;
+    Uint32 crop_fmt = crop_format(s);
+    int cbpp = SDL_BYTESPERPIXEL(crop_fmt);
+    Uint8* dst = malloc((size_t)cw * ch * cbpp);
+    if (!dst) { image_free(s); return false; }
+    for (int r = 0; r < b->reps; r++) {
+        t0 = SDL_GetPerformanceCounter();
+        for (int i = 0; i < BENCH_EXTRACT_CROPS; i++)
+            extract_crop_as(s, &crops[i], crop_fmt, dst, cw * cbpp);
+        b->samples[r] = bench_ms(b, t0);
+    }
+    free(dst);
+    snprintf(stage, sizeof(stage), "extract_%dx%d", cw, ch);
+    bench_report(b, stage, cw, ch, b->samples, (double)BENCH_EXTRACT_CROPS * cw * ch * cbpp, 0);
+
+    // every encoder (and every PNG profile) on one centered crop
+    int ew = SDL_min(BENCH_ENCODE_SIZE, s->w), eh = SDL_min(BENCH_ENCODE_SIZE, s->h);
+    CropRegion center = { (s->w - ew) / 2, (s->h - eh) / 2, ew, eh };
+    SDL_Surface* px = extract_crop(s, &center);
+    ByteBuf out = {0};
+    Arena scratch = {0};            // reset per encode, as on a save worker
+    for (int e = 0; px && e < (int)SDL_arraysize(encoders); e++)
+    {
+        bool png = encoders[e].encode == encode_png;
+        for (int p = 0; p < (png ? (int)SDL_arraysize(png_profiles) : 1); p++)
+        {
+            EncodeOptions opt = { .encoder = encoders[e].name };
+            encode_options_set_profile(&opt, png ? png_profiles[p].name : "default");
+            bool ok = true;
+            for (int r = 0; ok && r < b->reps; r++) {
+                out.len = 0;
+                t0 = SDL_GetPerformanceCounter();
+                ok = encoders[e].encode(px, &opt, &scratch, &out);
+                b->samples[r] = bench_ms(b, t0);
+                arena_reset(&scratch);
+            }
+            if (!ok) continue;
+            if (png) snprintf(stage, sizeof(stage), "encode_%s_%s", encoders[e].name, png_profiles[p].name);
+            else     snprintf(stage, sizeof(stage), "encode_%s", encoders[e].name);
+            bench_report(b, stage, ew, eh, b->samples, (double)ew * eh * cbpp, (double)out.len);
+        }
+    }
+    bytebuf_free(&out);
+    arena_free(&scratch);
+    SDL_FreeSurface(px);
+
+    // the --batch path: deferred crops on a worker per core into one tar shard
+    char prefix[1024];
+    snprintf(prefix, sizeof(prefix), "%s/cc_bench_%08x_batch", bench_temp_dir(), (unsigned)time(NULL));
+    EncodeOptions batch_opt = { .encoder = "png", .shard_prefix = prefix, .shard_limit = UINT64_MAX };
+    encode_options_set_profile(&batch_opt, "default");
+    int nworkers = 0;
+    for (int r = 0; r < b->reps; r++)
+    {
+        SaveQueue q;
+        if (!save_queue_init(&q, SDL_GetCPUCount(), false, &batch_opt)) {
+            save_queue_shutdown(&q);
+            image_free(s);
+            return false;
+        }
+        q.quiet = true;
+        nworkers = q.nworkers;
+        t0 = SDL_GetPerformanceCounter();
+        for (int i = 0; i < BENCH_BATCH_CROPS; i++) {
+            snprintf(stage, sizeof(stage), "crop_%05d.png", i);
+            save_crop_deferred(&q, s, &crops[i], stage, NULL, NULL);
+        }
+        save_queue_shutdown(&q);
+        b->samples[r] = bench_ms(b, t0);
+
+        char tar[1100];
+        snprintf(tar, sizeof(tar), "%s-%06d.tar", prefix, 0);
+        remove(tar);
+    }
+    snprintf(stage, sizeof(stage), "batch_%d_png_%dw", BENCH_BATCH_CROPS, nworkers);
+    bench_report(b, stage, cw, ch, b->samples, (double)BENCH_BATCH_CROPS * cw * ch * cbpp, 0);
+
+    // pyramid build and a full upload of level 0. The pyramid owns the
+    // image, so every run after the first starts from an untimed decode.
+    double* upload = b->samples + b->reps;
+    for (int r = 0; r < b->reps; r++)
+    {
+        if (!s) s = load_image(path);
+        if (!s) return false;
+        Pyramid pyr;
+        t0 = SDL_GetPerformanceCounter();
+        pyramid_build(&pyr, s, TILE_SIZE);
+        b->samples[r] = bench_ms(b, t0);
+        s = NULL;
+
+        TileCache tc;
+        upload[r] = 0;
+        if (tiles_init(&tc, renderer, &pyr, TILE_SIZE, SIZE_MAX)) {
+            t0 = SDL_GetPerformanceCounter();
+            for (int row = 0; row < tc.levels[0].rows; row++)
+                for (int col = 0; col < tc.levels[0].cols; col++)
+                    tiles_get(&tc, 0, col, row);
+            upload[r] = bench_ms(b, t0);
+            tiles_destroy(&tc);
+        }
+        pyramid_free(&pyr);
+    }
+    bench_report(b, "pyramid", w, h, b->samples, image_bytes, 0);
+    bench_report(b, "upload_level0", w, h, upload, image_bytes, 0);
+    return true;
+}
+
+static int run_bench(const char* out_path, const ImageList* inputs, int reps)
+{
+    Bench b = { .reps = reps, .freq = (double)SDL_GetPerformanceFrequency() };
+    b.samples = calloc((size_t)reps * 2, sizeof(*b.samples));
+    ImageList corpus = {0}, names = {0};
+    bool ok = b.samples != NULL;
+    for (int i = 0; ok && i < inputs->count; i++)
+        ok = image_list_add(&corpus, inputs->paths[i]);
+    bool synthetic = ok && corpus.count == 0;
+    if (synthetic)
+        ok = bench_make_corpus(&corpus, &names);
+
+    // Texture uploads need a renderer but no window or display
+    SDL_Surface* target = ok ? SDL_CreateRGBSurfaceWithFormat(0, 16, 16, 32, SDL_PIXELFORMAT_ARGB8888) : NULL;
+    SDL_Renderer* renderer = target ? SDL_CreateSoftwareRenderer(target) : NULL;
+    b.out = renderer ? fopen(out_path, "w") : NULL;
+    if (!b.out) {
+        fprintf(stderr, "Benchmark setup failed (%s): %s\n", out_path, SDL_GetError());
+        ok = false;
+    }
+
+    if (ok)
+    {
+        SDL_version sdl;
+        SDL_GetVersion(&sdl);
+        printf("Bench: %d image(s), %d runs per stage, %d cores, %s pixel kernels\n",
+               corpus.count, reps, SDL_GetCPUCount(), pixel_kernels.isa);
+        fprintf(b.out, "{\n  \"schema\": 1,\n  \"sdl\": \"%d.%d.%d\",\n  \"zlib\": ",
+                sdl.major, sdl.minor, sdl.patch);
+        bench_json_string(b.out, zlibVersion());
+        fprintf(b.out, ",\n  \"isa\": ");
+        bench_json_string(b.out, pixel_kernels.isa);
+        fprintf(b.out, ",\n  \"cpus\": %d,\n  \"reps\": %d,\n  \"results\": [", SDL_GetCPUCount(), reps);
 
-    SDL_FreeSurface(cropped);
+        for (int i = 0; i < corpus.count; i++)
+            if (!bench_image(&b, corpus.paths[i], synthetic ? names.paths[i] : corpus.paths[i], renderer))
+                ok = false;
+
+        fprintf(b.out, "\n  ]\n}\n");
+        if (fclose(b.out) != 0) ok = false;
+        printf("Wrote %d result(s) to %s\n", b.nresults, out_path);
+    }
+
+    for (int i = 0; synthetic && i < corpus.count; i++)
+        remove(corpus.paths[i]);
+    if (renderer) SDL_DestroyRenderer(renderer);
+    SDL_FreeSurface(target);
+    image_list_free(&names);
+    image_list_free(&corpus);
+    free(b.samples);
+    return ok ? 0 : 1;
 }
 
 int main(int argc, char** argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image.png|jpg>\n", argv[0]);
+    ImageList inputs = {0};
+    const char* batch_path = NULL;
+    const char* worker_dir = NULL;
+    const char* worker_node = NULL;
+    const char* bench_path = NULL;
+    int bench_reps = BENCH_DEFAULT_REPS;
+    size_t vram_mb = DEFAULT_VRAM_MB;
+    int prefetch_ahead = DEFAULT_PREFETCH;
+    int grid_overlap = 0;
+    int suggest_count = SUGGEST_DEFAULT;
+    const char* session_path = NULL;
+    const char* ipc_path = NULL;
+    bool idle_redraw = true;
+    bool watch = false;
+    bool profile_hud = false;
+    bool low_latency = false;
+    const char* trace_path = NULL;
+    bool bad_args = false;
+    EncodeOptions encode = { .encoder = "png", .shard_limit = (Uint64)SHARD_DEFAULT_MB << 20,
+                             .dedup_distance = DEDUP_DEFAULT_DISTANCE };
+    encode_options_set_profile(&encode, "default");
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--vram-mb") == 0 && i + 1 < argc)
+            vram_mb = (size_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--low-latency") == 0)
+            low_latency = true;
+        else if (strcmp(argv[i], "--continuous") == 0)
+            idle_redraw = false;
+        else if (strcmp(argv[i], "--watch") == 0)
+            watch = watch_inputs = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile_hud = true;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            trace_path = argv[++i];
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batch_path = argv[++i];
+        else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc)
+            worker_dir = argv[++i];
+        else if (strcmp(argv[i], "--node") == 0 && i + 1 < argc)
+            worker_node = argv[++i];
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+            bench_path = argv[++i];
+        else if (strcmp(argv[i], "--bench-reps") == 0 && i + 1 < argc)
+            bench_reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc)
+            prefetch_ahead = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--ipc") == 0 && i + 1 < argc)
+            ipc_path = argv[++i];
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            cache_dir = argv[++i];
+        else if (strcmp(argv[i], "--session") == 0 && i + 1 < argc)
+            session_path = argv[++i];
+        else if (strcmp(argv[i], "--grid-overlap") == 0 && i + 1 < argc)
+            grid_overlap = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--suggest") == 0 && i + 1 < argc)
+            suggest_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--png") == 0 && i + 1 < argc)
+            bad_args |= !encode_options_set_profile(&encode, argv[++i]);
+        else if (strcmp(argv[i], "--png-filter") == 0 && i + 1 < argc)
+            bad_args |= !encode_options_set_filter(&encode, argv[++i]);
+        else if (strcmp(argv[i], "--encoder") == 0 && i + 1 < argc)
+            bad_args |= !encoder_find(encode.encoder = argv[++i]);
+        else if (strcmp(argv[i], "--scales") == 0 && i + 1 < argc)
+            bad_args |= !encode_options_set_scales(&encode, argv[++i]);
+        else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc)
+            encode.shard_prefix = argv[++i];
+        else if (strcmp(argv[i], "--shard-mb") == 0 && i + 1 < argc)
+            encode.shard_limit = (Uint64)strtoul(argv[++i], NULL, 10) << 20;
+        else if (strcmp(argv[i], "--dedup") == 0 && i + 1 < argc)
+            bad_args |= !dedup_parse_mode(argv[++i], &encode.dedup);
+        else if (strcmp(argv[i], "--dedup-distance") == 0 && i + 1 < argc)
+            encode.dedup_distance = atoi(argv[++i]);
+        else if (argv[i][0] != '-')
+            bad_args |= !(batch_path || bench_path ? image_list_push(&inputs, argv[i])
+                                                   : image_list_add(&inputs, argv[i]));
+        else
+            bad_args = true;
+    }
+
+    if (bad_args || (inputs.count == 0 && !batch_path && !bench_path && !worker_dir) || (batch_path && inputs.count > 1) ||
+        (batch_path && bench_path) || (worker_dir && (batch_path || bench_path || inputs.count > 0)) || bench_reps < 1 || suggest_count < 1 || suggest_count > SUGGEST_MAX ||
+        encode.dedup_distance < 0 || encode.dedup_distance > DEDUP_DEFAULT_DISTANCE ||
+        vram_mb == 0 || encode.shard_limit == 0 || grid_overlap < 0 || prefetch_ahead < 0 || prefetch_ahead > MAX_PREFETCH)
+    {
+        fprintf(stderr, "Usage: %s [--vram-mb N] [--continuous] [--low-latency] [--prefetch N] [--profile] [--trace file.csv]\n"
+                        "          [--grid-overlap N] [--suggest N] [--watch]\n"
+                        "          [--png realtime|fast|default|max] [--png-filter none|sub|up|avg|paeth|adaptive]\n"
+                        "          [--encoder png|sdl|qoi|npy|npy-chw|webp] [--scales 256,512,native]\n"
+                        "          [--shard prefix [--shard-mb N]]\n"
+                        "          [--dedup flag|skip [--dedup-distance 0-3]]\n"
+                        "          <image|directory>...\n"
+                        "          [--session file.csv] [--ipc socket-path] [--cache dir]\n"
+                        "       %s --batch manifest.csv [--cache dir] [image.png|jpg]\n"
+                        "       %s --bench out.json [--bench-reps N] [image|directory...]\n"
+                        "       %s --worker queue-dir [--node name] [--cache dir] [--shard prefix]\n",
+                argv[0], argv[0], argv[0], argv[0]);
+        image_list_free(&inputs);
         return 1;
     }
 
-    const char* input_path = argv[1];
+    if (batch_path || bench_path || worker_dir) {
+        pixel_kernels_init();
+        if (SDL_Init(0) < 0 || IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG) == 0) {
+            fprintf(stderr, "SDL/IMG init failed\n");
+            return 1;
+        }
+        int rc = bench_path ? run_bench(bench_path, &inputs, bench_reps)
+               : worker_dir ? run_worker(worker_dir, worker_node, &encode)
+                            : run_batch(batch_path, inputs.count ? inputs.paths[0] : NULL, &encode);
+        image_list_free(&inputs);
+        IMG_Quit();
+        SDL_Quit();
+        return rc;
+    }
 
     if (SDL_Init(SDL_INIT_VIDEO) < 0 ||
         IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG) == 0 ||
@@ -69,6 +6487,11 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    pixel_kernels_init();
+
+    if (!prof_init(profile_hud, trace_path))
+        fprintf(stderr, "Warning: cannot write trace %s\n", trace_path);
+
     SDL_Window* window = SDL_CreateWindow(
         "Cookie Cutter - Drag to move, Drag corner to resize, Arrows=1px move, Shift+Arrows=1px resize, Ctrl+Arrows=jump, +/-=16px resize, S=save",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
@@ -78,75 +6501,346 @@ int main(int argc, char** argv)
     if (!window) goto cleanup;
 
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1,
-                                                SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+                                                SDL_RENDERER_ACCELERATED | (low_latency ? 0 : SDL_RENDERER_PRESENTVSYNC));
     if (!renderer) goto cleanup;
 
+    FramePacer pacer;
+    pacer_init(&pacer, window, low_latency);
+    if (low_latency)
+        snprintf(prof.present_mode, sizeof(prof.present_mode), "no vsync, paced %.0f Hz", 1000.0 / pacer.period_ms);
+
     TTF_Font* font = TTF_OpenFont("/usr/share/fonts/TTF/DejaVuSans.ttf", 18);
     if (!font) font = TTF_OpenFont("/Library/Fonts/Arial.ttf", 18);
     if (!font) font = TTF_OpenFont("C:\\Windows\\Fonts\\arial.ttf", 18);
     if (!font) fprintf(stderr, "Warning: font not loaded - no text overlay\n");
 
-    SDL_Surface* surface = IMG_Load(input_path);
-    if (!surface) {
-        fprintf(stderr, "Failed to load %s: %s\n", input_path, IMG_GetError());
-        goto cleanup_font;
+    // The window is up before anything is decoded; images arrive from the prefetcher
+    size_t vram_budget = vram_mb * 1024 * 1024;
+    Prefetcher pf;
+    if (!prefetch_start(&pf, &inputs, tiles_max_size(renderer), prefetch_ahead, tiles_texture_format(renderer))) {
+        fprintf(stderr, "Failed to start image loader: %s\n", SDL_GetError());
+        goto cleanup_prefetch;
     }
 
-    SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
-    if (!texture) goto cleanup_surface;
+    int current = 0;
+    bool image_changed = true;      // re-resolve the current slot after events
+    ImageSlot* image = NULL;        // current image once decoded
+    SDL_Surface* surface = NULL;
+    TileCache* tiles = NULL;
+    int orig_w = 0, orig_h = 0;
+    bool first_image = true;
+    Uint32 watch_next = 0;          // --watch: when to stat() the current file next
+    int watch_index = -1;           // image the recorded mtime/size belong to
+    time_t watch_mtime = 0;
+    long long watch_size = 0;
 
-    int orig_w = surface->w;
-    int orig_h = surface->h;
+    CropRegion crop = { 0, 0, DEFAULT_SQUARE_SIZE, DEFAULT_SQUARE_SIZE };
 
-    CropRegion crop = {
-        .x = (orig_w - DEFAULT_SQUARE_SIZE) / 2,
-        .y = (orig_h - DEFAULT_SQUARE_SIZE) / 2,
-        .w = DEFAULT_SQUARE_SIZE,
-        .h = DEFAULT_SQUARE_SIZE
-    };
-    if (crop.x < 0) crop.x = 0;
-    if (crop.y < 0) crop.y = 0;
-    if (crop.x + crop.w > orig_w) crop.w = orig_w - crop.x;
-    if (crop.y + crop.h > orig_h) crop.h = orig_h - crop.y;
+    // Leave one core for the UI thread
+    SaveQueue saves;
+    if (!save_queue_init(&saves, SDL_min(SDL_GetCPUCount() - 1, SAVE_UI_WORKERS), true, &encode)) {
+        fprintf(stderr, "Failed to start save workers: %s\n", SDL_GetError());
+        save_queue_shutdown(&saves);
+        goto cleanup_prefetch;
+    }
+    RegionSet* parked = calloc((size_t)inputs.count, sizeof(*parked));   // regions of the images not shown
+    if (!parked) {
+        save_queue_shutdown(&saves);
+        goto cleanup_prefetch;
+    }
+
+    GridCut grid = {0};
+    ImageSlot* grid_slot = NULL;    // image a grid cut is running on, pinned until it finishes
 
-    SDL_Texture* preview_tex = NULL;
+    IpcServer ipc;
+    if (!ipc_start(&ipc, ipc_path))
+        fprintf(stderr, "Warning: cannot listen on %s\n", ipc_path);
+
+    CropHistory history = {0};
+    RegionSet regions = {0};
+    int regions_image = -1;         // input `regions` belongs to
+    SaliencyMap saliency = {0};     // built on the first A press per image
+    bool aspect_lock = false;       // L: resizes keep the crop's current ratio
+    float drag_aspect = 0;
+    QuadBatch overlay = {0};        // per-frame overlay quads
+    SessionLog session;
+    if (!session_open(&session, session_path))
+        fprintf(stderr, "Warning: cannot write session %s\n", session_path);
 
     bool running = true;
     bool dragging = false;
     bool resizing = false;
     int drag_offset_x = 0, drag_offset_y = 0;
+    bool motion_pending = false;    // a drag motion is waiting to be applied this frame
+    int motion_x = 0, motion_y = 0;
+    Viewport vp = {0};
+    viewport_fit(&vp, renderer, 0, 0);
+    SDL_Texture* loading_tex = NULL;    // decode preview of the current image until its tiles exist
+    Uint32 loading_version = 0;
+    int loading_index = -1;
+    bool panning = false;
+
+    GlyphAtlas atlas = {0};
+    TextBatch text = {0};
+    bool have_atlas = font && atlas_build(&atlas, renderer, font);
+    if (font && !have_atlas) fprintf(stderr, "Warning: glyph atlas failed - no text overlay\n");
+
+    unsigned dirty = DIRTY_ALL;
 
     SDL_Event event;
     while (running)
     {
         bool crop_changed = false;
+        bool have_event;
+
+        if (idle_redraw && !dirty) {
+            int timeout = save_queue_status_timeout(&saves);
+            bool redraw = timeout >= 0;     // waking up without an event means redraw the overlay
+            if (prof.hud && (timeout < 0 || timeout > PROF_HUD_REFRESH_MS)) {
+                timeout = PROF_HUD_REFRESH_MS;
+                redraw  = true;
+            }
+            if (watch && image) {
+                int due = SDL_max(0, (Sint32)(watch_next - SDL_GetTicks())) + 1;
+                if (timeout < 0 || timeout > due) {
+                    timeout = due;      // just the next poll; nothing on screen changes
+                    redraw  = false;
+                }
+            }
+            have_event = timeout < 0 ? SDL_WaitEvent(&event) : SDL_WaitEventTimeout(&event, timeout);
+            if (!have_event && redraw) dirty |= DIRTY_OVERLAY;  // status message expired
+        } else {
+            have_event = SDL_PollEvent(&event);
+        }
+        pacer_wait(&pacer);         // then the rest of the queue, as late as possible
+        prof_frame_begin();
 
-        while (SDL_PollEvent(&event))
+        bool have_input = false;
+        Uint32 input_ts = 0;
+
+        for (; have_event; have_event = SDL_PollEvent(&event))
         {
+            if (event.type == saves.done_event) {
+                if (grid_slot) grid_feed(&grid, &saves, &session);
+                if (grid_slot && save_batch_finished(&grid.batch)) {
+                    int failed = SDL_AtomicGet(&grid.batch.failed);
+                    save_queue_post_status(&saves, failed > 0, "Grid done: %d tiles saved, %d failed",
+                                           grid.batch.total - failed, failed);
+                    grid_slot->pinned = false;
+                    grid_slot = NULL;
+                    prefetch_set_current(&pf, current);     // release it if it is out of the window now
+                    image_changed = true;                   // a reload may have waited for the cut
+                }
+                dirty |= DIRTY_OVERLAY;
+                continue;
+            }
+            if (event.type == pf.ready_event) {
+                if (event.user.code == PREFETCH_STORED)
+                    prefetch_set_current(&pf, current);     // release a slot its cache write kept
+                else
+                    image_changed = true;
+                continue;
+            }
+            if (ipc_is_event(&ipc, &event))
+                continue;               // commands are read below
+            if (!have_input && (event.type == SDL_KEYDOWN || event.type == SDL_MOUSEMOTION ||
+                                event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP ||
+                                event.type == SDL_MOUSEWHEEL)) {
+                have_input = true;
+                input_ts = event.common.timestamp;
+            }
+
             switch (event.type)
             {
                 case SDL_QUIT:
                     running = false;
                     break;
 
+                case SDL_WINDOWEVENT:
+                    switch (event.window.event) {
+                        case SDL_WINDOWEVENT_SHOWN:
+                        case SDL_WINDOWEVENT_EXPOSED:
+                        case SDL_WINDOWEVENT_SIZE_CHANGED:
+                        case SDL_WINDOWEVENT_MAXIMIZED:
+                        case SDL_WINDOWEVENT_RESTORED:
+                            viewport_fit(&vp, renderer, orig_w, orig_h);
+                            dirty |= DIRTY_VIEW;
+                            break;
+                    }
+                    break;
+
+                case SDL_RENDER_TARGETS_RESET:
+                    viewport_fit(&vp, renderer, orig_w, orig_h);
+                    dirty |= DIRTY_VIEW;
+                    break;
+
                 case SDL_KEYDOWN:
                 {
                     bool ctrl  = (event.key.keysym.mod & KMOD_CTRL)  != 0;
                     bool shift = (event.key.keysym.mod & KMOD_SHIFT) != 0;
+                    SDL_Keycode sym = event.key.keysym.sym;
+
+                    // Crop edits need an image; quitting and switching don't
+                    if (!surface && sym != SDLK_q && sym != SDLK_ESCAPE &&
+                        sym != SDLK_PAGEUP && sym != SDLK_PAGEDOWN && sym != SDLK_F3)
+                        break;
+                    CropRegion before = crop;
 
-                    switch (event.key.keysym.sym)
+                    switch (sym)
                     {
                         case SDLK_q:
                         case SDLK_ESCAPE:
                             running = false;
                             break;
 
+                        case SDLK_F3:
+                            prof.hud = !prof.hud;
+                            dirty |= DIRTY_OVERLAY;
+                            break;
+
+                        case SDLK_HOME:
+                            viewport_reset(&vp);
+                            dirty |= DIRTY_VIEW;
+                            break;
+
+                        case SDLK_PAGEDOWN:
+                        case SDLK_PAGEUP:
+                        {
+                            int next = current + (sym == SDLK_PAGEDOWN ? 1 : -1);
+                            if (next >= 0 && next < inputs.count) {
+                                // The old slot may be released below; drop every pointer into it first
+                                dragging = resizing = panning = false;
+                                image = NULL;
+                                surface = NULL;
+                                tiles = NULL;
+                                current = next;
+                                prefetch_set_current(&pf, current);
+                                image_changed = true;
+                            }
+                        }
+                        break;
+
                         case SDLK_s:
+                        if (shift) {
+                            // Every region of this image, named after the image and the region
+                            regions_update(&regions, regions.active, &crop);
+                            char stem[256];
+                            path_stem(inputs.paths[current], stem, sizeof(stem));
+                            for (int i = 0; i < regions.count; i++) {
+                                const Region* r = &regions.items[i];
+                                char fname[512];
+                                snprintf(fname, sizeof(fname), "%s_%s_%dx%d%s", stem, r->name, r->rect.w, r->rect.h,
+                                         encoder_ext(encode.encoder));
+                                save_crop(&saves, surface, &r->rect, fname);
+                                session_record(&session, inputs.paths[current], &r->rect, fname);
+                            }
+                            dirty |= DIRTY_OVERLAY;
+                        }
+                        else
                         {
-                            static int cnt = 1;
                             char fname[128];
-                            snprintf(fname, sizeof(fname), "crop_%03d_%dx%d.png", cnt++, crop.w, crop.h);
-                            save_crop(surface, &crop, fname);
+                            snprintf(fname, sizeof(fname), "crop_%03d_%dx%d%s", session.next_crop++, crop.w, crop.h,
+                                     encoder_ext(encode.encoder));
+                            save_crop(&saves, surface, &crop, fname);
+                            session_record(&session, inputs.paths[current], &crop, fname);
+                            dirty |= DIRTY_OVERLAY;
+                        }
+                        break;
+
+                        case SDLK_n:
+                        {
+                            // New region: a copy of the active one, nudged so both stay visible
+                            regions_update(&regions, regions.active, &crop);
+                            CropRegion r = crop;
+                            r.x = SDL_min(r.x + 16, orig_w - r.w);
+                            r.y = SDL_min(r.y + 16, orig_h - r.h);
+                            int id = regions_add(&regions, &r);
+                            if (id >= 0) {
+                                regions_select(&regions, id, &crop);
+                                history_clear(&history);
+                                crop_changed = true;
+                            }
+                            before = crop;
+                        }
+                        break;
+
+                        case SDLK_DELETE:
+                        case SDLK_BACKSPACE:
+                            if (regions.count > 1) {
+                                regions_remove(&regions, regions.active);
+                                crop = regions.items[regions.active].rect;
+                                history_clear(&history);
+                                crop_changed = true;
+                            }
+                            before = crop;
+                            break;
+
+                        case SDLK_a:
+                        {
+                            Uint64 t0 = SDL_GetPerformanceCounter();
+                            if (saliency.src != surface && !saliency_build(&saliency, surface)) {
+                                save_queue_post_status(&saves, true, "Suggest: out of memory");
+                                dirty |= DIRTY_OVERLAY;
+                                break;
+                            }
+                            // New suggestions avoid every existing region, so repeated presses add the next best
+                            regions_update(&regions, regions.active, &crop);
+                            CropRegion found[SUGGEST_MAX];
+                            int n = saliency_suggest(&saliency, crop.w, crop.h, &regions, found, suggest_count);
+                            int first = -1;
+                            for (int i = 0; i < n; i++) {
+                                int id = regions_add(&regions, &found[i]);
+                                if (id < 0) break;
+                                snprintf(regions.items[id].name, sizeof(regions.items[id].name),
+                                         "suggest_%03d", regions.next_name);
+                                if (first < 0) first = id;
+                            }
+                            if (first >= 0) {
+                                regions_select(&regions, first, &crop);
+                                history_clear(&history);
+                                crop_changed = true;
+                            }
+                            before = crop;
+                            double ms = (SDL_GetPerformanceCounter() - t0) * 1000.0 / SDL_GetPerformanceFrequency();
+                            save_queue_post_status(&saves, n == 0, "Suggested %d crop(s) in %.1f ms", n, ms);
+                            dirty |= DIRTY_OVERLAY;
+                        }
+                        break;
+
+                        case SDLK_TAB:
+                            if (regions.count > 1) {
+                                int step = shift ? regions.count - 1 : 1;
+                                regions_select(&regions, (regions.active + step) % regions.count, &crop);
+                                history_clear(&history);
+                                crop_changed = true;
+                            }
+                            before = crop;
+                            break;
+
+                        case SDLK_l:
+                            aspect_lock = !aspect_lock;
+                            dirty |= DIRTY_OVERLAY;
+                            break;
+
+                        case SDLK_z:
+                        case SDLK_y:
+                            if (!ctrl) break;
+                            // Ctrl+Z undo; Ctrl+Y or Ctrl+Shift+Z redo
+                            if (sym == SDLK_z && !shift ? history_undo(&history, &crop) : history_redo(&history, &crop))
+                                crop_changed = true;
+                            before = crop;
+                            break;
+
+                        case SDLK_g:
+                        {
+                            if (grid_slot) break;       // one grid cut at a time
+                            if (grid_start(&grid, &saves, surface, crop.w, crop.h, grid_overlap, inputs.paths[current],
+                                           encoder_ext(encode.encoder))) {
+                                grid_slot = image;
+                                grid_slot->pinned = true;
+                                grid_feed(&grid, &saves, &session);
+                            }
+                            dirty |= DIRTY_OVERLAY;
                         }
                         break;
 
@@ -155,13 +6849,9 @@ int main(int argc, char** argv)
                         // ────────────────────────────────────────────────
                         case SDLK_LEFT:
                             if (shift) {
-                                // Shrink width by 1, try to keep center
+                                // Shrink width by 1; the left edge stays
                                 if (crop.w > MIN_SQUARE_SIZE) {
-                                    int old_center = crop.x + crop.w / 2;
                                     crop.w--;
-                                    //crop.x = old_center - crop.w / 2;
-                                    //if (crop.x < 0) crop.x = 0;
-                                    //if (crop.x + crop.w > orig_w) crop.x = orig_w - crop.w;
                                     crop_changed = true;
                                 }
                             }
@@ -175,13 +6865,9 @@ int main(int argc, char** argv)
 
                         case SDLK_RIGHT:
                             if (shift) {
-                                // Grow width by 1, try to keep center
+                                // Grow width by 1; the left edge stays
                                 if (crop.w < orig_w && crop.x + crop.w < orig_w) {
-                                    int old_center = crop.x + crop.w / 2;
                                     crop.w++;
-                                    //crop.x = old_center - crop.w / 2;
-                                    //if (crop.x < 0) crop.x = 0;
-                                    //if (crop.x + crop.w > orig_w) crop.x = orig_w - crop.w;
                                     crop_changed = true;
                                 }
                             }
@@ -195,13 +6881,9 @@ int main(int argc, char** argv)
 
                         case SDLK_UP:
                             if (shift) {
-                                // Shrink height by 1, try to keep center
+                                // Shrink height by 1; the top edge stays
                                 if (crop.h > MIN_SQUARE_SIZE) {
-                                    int old_center = crop.y + crop.h / 2;
                                     crop.h--;
-                                    //crop.y = old_center - crop.h / 2;
-                                    //if (crop.y < 0) crop.y = 0;
-                                    //if (crop.y + crop.h > orig_h) crop.y = orig_h - crop.h;
                                     crop_changed = true;
                                 }
                             }
@@ -215,13 +6897,9 @@ int main(int argc, char** argv)
 
                         case SDLK_DOWN:
                             if (shift) {
-                                // Grow height by 1, try to keep center
+                                // Grow height by 1; the top edge stays
                                 if (crop.h < orig_h && crop.y + crop.h < orig_h) {
-                                    int old_center = crop.y + crop.h / 2;
                                     crop.h++;
-                                    //crop.y = old_center - crop.h / 2;
-                                    //if (crop.y < 0) crop.y = 0;
-                                    //if (crop.y + crop.h > orig_h) crop.y = orig_h - crop.h;
                                     crop_changed = true;
                                 }
                             }
@@ -237,12 +6915,13 @@ int main(int argc, char** argv)
                         case SDLK_KP_PLUS:
                         case SDLK_PLUS:
                             if (crop.w < 2048 && crop.h < 2048) {
-                                int cx = crop.x + crop.w / 2;
-                                int cy = crop.y + crop.h / 2;
                                 crop.w += 16;
                                 crop.h += 16;
-                                //crop.x = cx - crop.w / 2;
-                                //crop.y = cy - crop.h / 2;
+                                // Stay inside the image, like the arrow keys and drags
+                                if (crop.w > orig_w) crop.w = orig_w;
+                                if (crop.h > orig_h) crop.h = orig_h;
+                                if (crop.x + crop.w > orig_w) crop.x = orig_w - crop.w;
+                                if (crop.y + crop.h > orig_h) crop.y = orig_h - crop.h;
                                 crop_changed = true;
                             }
                             break;
@@ -250,42 +6929,50 @@ int main(int argc, char** argv)
                         case SDLK_MINUS:
                         case SDLK_KP_MINUS:
                             if (crop.w > MIN_SQUARE_SIZE && crop.h > MIN_SQUARE_SIZE) {
-                                int cx = crop.x + crop.w / 2;
-                                int cy = crop.y + crop.h / 2;
                                 crop.w -= 16;
                                 crop.h -= 16;
-                                //crop.x = cx - crop.w / 2;
-                                //crop.y = cy - crop.h / 2;
                                 crop_changed = true;
                             }
                             break;
                     }
+                    if (surface) history_record(&history, &before, &crop);
                 }
                 break;
 
+                case SDL_MOUSEWHEEL:
+                    if (surface && event.wheel.y != 0) {
+                        int mx, my;
+                        SDL_GetMouseState(&mx, &my);
+                        viewport_zoom_at(&vp, mx, my, powf(VIEW_WHEEL_STEP, (float)event.wheel.y));
+                        dirty |= DIRTY_VIEW;
+                    }
+                    break;
+
                 case SDL_MOUSEBUTTONDOWN:
-                    if (event.button.button == SDL_BUTTON_LEFT)
+                    if ((event.button.button == SDL_BUTTON_RIGHT || event.button.button == SDL_BUTTON_MIDDLE) && surface)
+                        panning = true;
+                    if (event.button.button == SDL_BUTTON_LEFT && surface)
                     {
-                        int mx = event.button.x, my = event.button.y;
-                        int rw, rh;
-                        SDL_GetRendererOutputSize(renderer, &rw, &rh);
-
-                        float sx = (float)rw / orig_w;
-                        float sy = (float)rh / orig_h;
-                        float s  = fmin(sx, sy);
-
-                        int ox = (rw - (int)(orig_w * s)) / 2;
-                        int oy = (rh - (int)(orig_h * s)) / 2;
+                        float ix, iy;
+                        viewport_to_image(&vp, event.button.x, event.button.y, &ix, &iy);
 
-                        float ix = (mx - ox) / s;
-                        float iy = (my - oy) / s;
+                        // Outside the active region: grab whichever region is under the cursor
+                        bool inside = ix >= crop.x && ix <= crop.x + crop.w && iy >= crop.y && iy <= crop.y + crop.h;
+                        int hit = inside ? -1 : regions_hit(&regions, ix, iy);
+                        if (hit >= 0) {
+                            regions_select(&regions, hit, &crop);
+                            history_clear(&history);
+                            crop_changed = true;
+                        }
 
                         if (ix >= crop.x && ix <= crop.x + crop.w &&
                             iy >= crop.y && iy <= crop.y + crop.h)
                         {
+                            drag_aspect = aspect_lock ? (float)crop.w / crop.h : 0;
                             float dx = fabs(ix - (crop.x + crop.w));
                             float dy = fabs(iy - (crop.y + crop.h));
 
+                            history_begin(&history, &crop);
                             if (dx < 24 && dy < 24) {
                                 resizing = true;
                                 drag_offset_x = (crop.x + crop.w) - ix;
@@ -300,171 +6987,377 @@ int main(int argc, char** argv)
                     break;
 
                 case SDL_MOUSEBUTTONUP:
-                    if (event.button.button == SDL_BUTTON_LEFT)
+                    if (event.button.button == SDL_BUTTON_RIGHT || event.button.button == SDL_BUTTON_MIDDLE)
+                        panning = false;
+                    if (event.button.button == SDL_BUTTON_LEFT) {
+                        // The release position ends the gesture, superseding queued motion
+                        if (surface && (dragging || resizing)) {
+                            float ix, iy;
+                            viewport_to_image(&vp, event.button.x, event.button.y, &ix, &iy);
+                            drag_apply(&crop, resizing, ix, iy, drag_offset_x, drag_offset_y, drag_aspect, orig_w, orig_h);
+                            crop_changed = true;
+                        }
+                        motion_pending = false;
                         dragging = resizing = false;
+                        history_end(&history, &crop);
+                    }
                     break;
 
                 case SDL_MOUSEMOTION:
-                    if (dragging || resizing)
-                    {
-                        int mx = event.motion.x, my = event.motion.y;
-                        int rw, rh;
-                        SDL_GetRendererOutputSize(renderer, &rw, &rh);
+                    if (panning) {
+                        viewport_pan(&vp, event.motion.xrel, event.motion.yrel);
+                        dirty |= DIRTY_VIEW;
+                    }
+                    // Only the latest position matters; applied once after the event loop
+                    if (dragging || resizing) {
+                        motion_x = event.motion.x;
+                        motion_y = event.motion.y;
+                        motion_pending = true;
+                    }
+                    break;
+            }
+        }
 
-                        float sx = (float)rw / orig_w;
-                        float sy = (float)rh / orig_h;
-                        float s  = fmin(sx, sy);
+        // Control socket commands, between input and drawing
+        ipc_poll(&ipc);
+        int client;
+        char line[IPC_LINE_MAX];
+        while (ipc_next_command(&ipc, &client, line, sizeof(line)))
+        {
+            char cmd[16] = "";
+            int used = 0;
+            sscanf(line, "%15s%n", cmd, &used);
+            const char* args = line + used;
+            while (*args == ' ') args++;
 
-                        int ox = (rw - (int)(orig_w * s)) / 2;
-                        int oy = (rh - (int)(orig_h * s)) / 2;
+            if (!surface) {
+                ipc_reply(&ipc, client, "error no image loaded (%s)", inputs.paths[current]);
+            }
+            else if (strcmp(cmd, "get") == 0) {
+                ipc_reply(&ipc, client, "crop %d %d %d %d %s", crop.x, crop.y, crop.w, crop.h, inputs.paths[current]);
+            }
+            else if (strcmp(cmd, "crop") == 0) {
+                CropRegion c;
+                if (sscanf(args, "%d %d %d %d", &c.x, &c.y, &c.w, &c.h) != 4 || c.w <= 0 || c.h <= 0 ||
+                    c.x < 0 || c.y < 0 || c.x + c.w > orig_w || c.y + c.h > orig_h) {
+                    ipc_reply(&ipc, client, "error expected crop X Y W H inside %dx%d", orig_w, orig_h);
+                } else if (dragging || resizing) {
+                    ipc_reply(&ipc, client, "error crop is being dragged");
+                } else {
+                    history_record(&history, &crop, &c);
+                    crop = c;
+                    crop_changed = true;
+                    ipc_reply(&ipc, client, "ok");
+                }
+            }
+            else if (strcmp(cmd, "save") == 0) {
+                char fname[512];
+                if (*args && (!session_name_ok(args) || strlen(args) >= sizeof(fname))) {
+                    ipc_reply(&ipc, client, "error bad file name (no commas, control characters or edge spaces)");
+                } else {
+                    if (*args) snprintf(fname, sizeof(fname), "%s", args);
+                    else       snprintf(fname, sizeof(fname), "ipc_%03d_%dx%d%s", session.next_ipc++, crop.w, crop.h,
+                                        encoder_ext(encode.encoder));
+                    save_crop(&saves, surface, &crop, fname);
+                    session_record(&session, inputs.paths[current], &crop, fname);
+                    ipc_reply(&ipc, client, "ok %s", fname);
+                    dirty |= DIRTY_OVERLAY;
+                }
+            }
+            else if (strcmp(cmd, "batch") == 0) {
+                int count = 0;
+                ImageList ignored = {0};    // rows apply to the current image
+                BatchEntry* entries = load_manifest(args, encoder_ext(encode.encoder), &count, &ignored);
+                image_list_free(&ignored);
+                if (!entries) {
+                    ipc_reply(&ipc, client, "error cannot read manifest %s", args);
+                } else {
+                    for (int i = 0; i < count; i++) {
+                        save_crop(&saves, surface, &entries[i].crop, entries[i].filename);
+                        session_record(&session, inputs.paths[current], &entries[i].crop, entries[i].filename);
+                    }
+                    free(entries);
+                    ipc_reply(&ipc, client, "ok queued %d", count);
+                    dirty |= DIRTY_OVERLAY;
+                }
+            }
+            else if (strcmp(cmd, "grab") == 0) {
+                ipc_grab(&ipc, client, surface, &crop);
+            }
+            else {
+                ipc_reply(&ipc, client, "error unknown command '%s' (get, crop, save, batch, grab)", cmd);
+            }
+        }
 
-                        float ix = (mx - ox) / s;
-                        float iy = (my - oy) / s;
+        if (motion_pending)
+        {
+            if (surface && (dragging || resizing)) {
+                float ix, iy;
+                viewport_to_image(&vp, motion_x, motion_y, &ix, &iy);
+                drag_apply(&crop, resizing, ix, iy, drag_offset_x, drag_offset_y, drag_aspect, orig_w, orig_h);
+                crop_changed = true;
+            }
+            motion_pending = false;
+        }
 
-                        if (dragging)
-                        {
-                            crop.x = (int)(ix - drag_offset_x + 0.5f);
-                            crop.y = (int)(iy - drag_offset_y + 0.5f);
-                            if (crop.x < 0) crop.x = 0;
-                            if (crop.y < 0) crop.y = 0;
-                            if (crop.x + crop.w > orig_w) crop.x = orig_w - crop.w;
-                            if (crop.y + crop.h > orig_h) crop.y = orig_h - crop.h;
-                            crop_changed = true;
-                        }
-                        else if (resizing)
-                        {
-                            int brx = (int)(ix + drag_offset_x + 0.5f);
-                            int bry = (int)(iy + drag_offset_y + 0.5f);
-                            int nw = brx - crop.x;
-                            int nh = bry - crop.y;
-                            nw = fmax(nw, MIN_SQUARE_SIZE);
-                            nh = fmax(nh, MIN_SQUARE_SIZE);
-                            nw = fmin(nw, orig_w - crop.x);
-                            nh = fmin(nh, orig_h - crop.y);
-                            // force square — comment next line for free aspect ratio
-                            nw = nh = fmin(nw, nh);
-                            crop.w = nw;
-                            crop.h = nh;
-                            crop_changed = true;
-                        }
-                    }
-                    break;
+        // --watch: ask for a reload once the current file's mtime or size moves
+        if (watch && image && SDL_TICKS_PASSED(SDL_GetTicks(), watch_next)) {
+            watch_next = SDL_GetTicks() + WATCH_INTERVAL_MS;
+            struct stat st;
+            if (stat(inputs.paths[current], &st) == 0) {
+                if (watch_index == current && (st.st_mtime != watch_mtime || (long long)st.st_size != watch_size))
+                    prefetch_reload(&pf, image);
+                watch_index = current;
+                watch_mtime = st.st_mtime;
+                watch_size  = (long long)st.st_size;
             }
         }
 
-        // Update preview
-        if (crop_changed || !preview_tex)
+        if (image_changed)
         {
-            if (preview_tex) SDL_DestroyTexture(preview_tex);
-            preview_tex = NULL;
-            if (crop.w > 0 && crop.h > 0)
+            image_changed = false;
+
+            // A finished reload replaces the current pyramid; unless the size
+            // changed the view, crop and regions stay as they are. Not while a
+            // grid cut still reads the old level 0.
+            Sint64 changed;
+            int reloaded = image && !image->pinned ? prefetch_apply_reload(&pf, image, &changed) : RELOAD_NONE;
+            if (reloaded == RELOAD_FAILED) {
+                save_queue_post_status(&saves, true, "Reload failed: %s", inputs.paths[current]);
+            } else if (reloaded == RELOAD_DONE) {
+                SDL_Surface* level0 = image->pyr.levels[0];
+                saliency_free(&saliency);
+                if (level0->w != orig_w || level0->h != orig_h) {
+                    image   = NULL;         // set up again below as a new image
+                    surface = NULL;
+                    tiles   = NULL;
+                } else {
+                    surface = level0;
+                }
+                if (changed < 0)
+                    save_queue_post_status(&saves, false, "Reloaded %dx%d", level0->w, level0->h);
+                else
+                    save_queue_post_status(&saves, false, "Reloaded: re-uploaded %lld of %lld pixels", (long long)changed,
+                                           (long long)level0->w * level0->h);
+            }
+            prefetch_sync_tiles(&pf, renderer, vram_budget);
+
+            ImageSlot* slot;
+            bool ready = prefetch_state(&pf, current, &slot) == SLOT_READY && slot->has_tiles;
+            ImageSlot* shown = ready ? slot : NULL;
+            if (shown != image)
             {
-                SDL_Rect r = {crop.x, crop.y, crop.w, crop.h};
-                SDL_Surface* cs = SDL_CreateRGBSurfaceWithFormat(0, crop.w, crop.h, 32, SDL_PIXELFORMAT_RGBA32);
-                if (cs)
-                {
-                    SDL_BlitSurface(surface, &r, cs, NULL);
-                    preview_tex = SDL_CreateTextureFromSurface(renderer, cs);
-                    SDL_FreeSurface(cs);
+                image   = shown;
+                if (regions_image >= 0) regions_stash(&regions, &parked[regions_image], &crop);
+                regions_image = -1;
+                history_clear(&history);    // deltas are relative to the previous image's bounds
+                saliency_free(&saliency);
+                surface = image ? image->pyr.levels[0] : NULL;
+                tiles   = image ? &image->tiles : NULL;
+                orig_w  = surface ? surface->w : 0;
+                orig_h  = surface ? surface->h : 0;
+                viewport_fit(&vp, renderer, orig_w, orig_h);
+
+                if (surface) {
+                    // Keep the crop size across images; center it on the first one
+                    if (first_image) {
+                        crop.x = (orig_w - crop.w) / 2;
+                        crop.y = (orig_h - crop.h) / 2;
+                        first_image = false;
+                    }
+                    if (crop.w > orig_w) crop.w = orig_w;
+                    if (crop.h > orig_h) crop.h = orig_h;
+                    if (crop.x < 0) crop.x = 0;
+                    if (crop.y < 0) crop.y = 0;
+                    if (crop.x + crop.w > orig_w) crop.x = orig_w - crop.w;
+                    if (crop.y + crop.h > orig_h) crop.y = orig_h - crop.h;
+
+                    // Regions belong to one image: the ones marked on it before, or just the crop
+                    if (regions_unstash(&regions, &parked[current], orig_w, orig_h, &crop))
+                        regions_image = current;
+                    else if (regions_init(&regions, orig_w, orig_h)) {
+                        regions.active = regions_add(&regions, &crop);
+                        regions_image = current;
+                    }
                 }
+                crop_changed = true;
             }
+
+            // Until the pyramid is ready, show what the decoder has so far
+            int pw, ph;
+            if (!image && prefetch_preview(&pf, renderer, current, &loading_tex, &loading_version, &pw, &ph)) {
+                loading_index = current;
+                if (pw != vp.img_w || ph != vp.img_h) viewport_fit(&vp, renderer, pw, ph);
+            } else if (image || loading_index != current) {
+                if (loading_tex) SDL_DestroyTexture(loading_tex);
+                loading_tex = NULL;
+                loading_index = -1;
+            }
+
+            const char* path = inputs.paths[current];
+            const char* base = strrchr(path, '/');
+            char title[512];
+            snprintf(title, sizeof(title),
+                     "Cookie Cutter - %s [%d/%d] - Drag to move, Drag corner to resize, Arrows=1px move, "
+                     "Shift+Arrows=1px resize, Ctrl+Arrows=jump, +/-=16px resize, S=save, PgUp/PgDn=image",
+                     base ? base + 1 : path, current + 1, inputs.count);
+            SDL_SetWindowTitle(window, title);
+            dirty |= DIRTY_VIEW;
+        }
+
+        if (crop_changed) {
+            if (surface && regions.count) regions_update(&regions, regions.active, &crop);
+            dirty |= DIRTY_CROP;
         }
+        if (have_input && (dirty || !idle_redraw)) prof_input(input_ts);
+        if (idle_redraw && !dirty) continue;
+        dirty = 0;
+        prof_mark(PROF_EVENTS);
 
         // ──────────────────────────────────────────────── Render ────────────────────────────────────────────────
         SDL_SetRenderDrawColor(renderer, 30, 30, 40, 255);
         SDL_RenderClear(renderer);
 
-        int rw, rh;
-        SDL_GetRendererOutputSize(renderer, &rw, &rh);
-
-        float sx = (float)rw / orig_w;
-        float sy = (float)rh / orig_h;
-        float s  = fmin(sx, sy);
-
-        int ox = (rw - (int)(orig_w * s)) / 2;
-        int oy = (rh - (int)(orig_h * s)) / 2;
-
-        SDL_Rect imgdst = {ox, oy, (int)(orig_w * s), (int)(orig_h * s)};
-        SDL_RenderCopy(renderer, texture, NULL, &imgdst);
+        int rw = vp.rw, rh = vp.rh;
+        float s = vp.s;
+        float ox = vp.ox, oy = vp.oy;
+        if (surface)
+        {
+            // Only the part of the image inside the window, from the mip level matching the zoom
+            SDL_Rect visible = viewport_visible(&vp);
+            tiles_draw(tiles, tiles_pick_level(tiles, s), &visible, s, s, ox, oy);
+        }
+        else if (loading_tex)
+        {
+            SDL_FRect dst = { ox, oy, vp.img_w * s, vp.img_h * s };
+            SDL_RenderCopyF(renderer, loading_tex, NULL, &dst);
+        }
 
-        if (crop.w > 0 && crop.h > 0)
+        if (surface && crop.w > 0 && crop.h > 0)
         {
             SDL_Rect cdst = {
-                (int)(crop.x * s) + ox,
-                (int)(crop.y * s) + oy,
+                (int)(crop.x * s + ox),
+                (int)(crop.y * s + oy),
                 (int)(crop.w * s),
                 (int)(crop.h * s)
             };
 
             // Dim outside
-            SDL_SetRenderDrawColor(renderer, 0,0,0,140);
-            SDL_Rect sh[4] = {
-                {0, 0, rw, cdst.y},
-                {0, cdst.y + cdst.h, rw, rh},
-                {0, cdst.y, cdst.x, cdst.h},
-                {cdst.x + cdst.w, cdst.y, rw - (cdst.x + cdst.w), cdst.h}
-            };
-            SDL_RenderFillRects(renderer, sh, 4);
+            SDL_Color dim = {0, 0, 0, 140};
+            quad_batch_rect(&overlay, 0, 0, rw, cdst.y, dim);
+            quad_batch_rect(&overlay, 0, cdst.y + cdst.h, rw, rh - (cdst.y + cdst.h), dim);
+            quad_batch_rect(&overlay, 0, cdst.y, cdst.x, cdst.h, dim);
+            quad_batch_rect(&overlay, cdst.x + cdst.w, cdst.y, rw - (cdst.x + cdst.w), cdst.h, dim);
 
-            // Border
-            SDL_SetRenderDrawColor(renderer, 80, 255, 120, 220);
-            //SDL_RenderDrawRect(renderer, &cdst);
+            // Outlines of the other regions in view
+            SDL_Rect view = viewport_visible(&vp);
+            int nfound = regions_query(&regions, &view);
+            for (int i = 0; i < nfound; i++)
+            {
+                if (regions.found[i] == regions.active) continue;
+                const CropRegion* r = &regions.items[regions.found[i]].rect;
+                quad_batch_frame(&overlay, floorf(r->x * s + ox), floorf(r->y * s + oy),
+                                 floorf(r->w * s), floorf(r->h * s), 2, (SDL_Color){90, 200, 255, 200});
+            }
 
             // Corner handles
             int csz = 14;
-            SDL_SetRenderDrawColor(renderer, 255, 240, 60, 220);
-            SDL_Rect corners[4] = {
-                {cdst.x - csz/2, cdst.y - csz/2, csz, csz},
-                {cdst.x + cdst.w - csz/2, cdst.y - csz/2, csz, csz},
-                {cdst.x - csz/2, cdst.y + cdst.h - csz/2, csz, csz},
-                {cdst.x + cdst.w - csz/2, cdst.y + cdst.h - csz/2, csz, csz}
-            };
-            for (int i = 0; i < 4; i++) SDL_RenderFillRect(renderer, &corners[i]);
+            SDL_Color handle = {255, 240, 60, 220};
+            quad_batch_rect(&overlay, cdst.x - csz/2, cdst.y - csz/2, csz, csz, handle);
+            quad_batch_rect(&overlay, cdst.x + cdst.w - csz/2, cdst.y - csz/2, csz, csz, handle);
+            quad_batch_rect(&overlay, cdst.x - csz/2, cdst.y + cdst.h - csz/2, csz, csz, handle);
+            quad_batch_rect(&overlay, cdst.x + cdst.w - csz/2, cdst.y + cdst.h - csz/2, csz, csz, handle);
+
+            quad_batch_draw(&overlay, renderer);
         }
 
+        prof_mark(PROF_IMAGE);
+
         // 1:1 preview
         int px = rw - PREVIEW_SIZE - 20;
         int py = rh - PREVIEW_SIZE - 20;
-        if (preview_tex)
+        if (surface && crop.w > 0 && crop.h > 0)
         {
+            // Sampled straight from the image tiles: no per-change surface or texture
             SDL_Rect prect = {px, py, PREVIEW_SIZE, PREVIEW_SIZE};
-            SDL_RenderCopy(renderer, preview_tex, NULL, &prect);
+            SDL_Rect csrc  = {crop.x, crop.y, crop.w, crop.h};
+            float psx = (float)PREVIEW_SIZE / crop.w;
+            float psy = (float)PREVIEW_SIZE / crop.h;
+            SDL_RenderSetClipRect(renderer, &prect);
+            tiles_draw(tiles, tiles_pick_level(tiles, fmaxf(psx, psy)), &csrc,
+                       psx, psy, px - crop.x * psx, py - crop.y * psy);
+            SDL_RenderSetClipRect(renderer, NULL);
             SDL_SetRenderDrawColor(renderer, 200,200,220,220);
             //SDL_RenderDrawRect(renderer, &prect);
         }
 
+        prof_mark(PROF_PREVIEW);
+
         // Text overlay
-        if (font)
+        if (have_atlas)
         {
-            char buf[180];
-            snprintf(buf, sizeof(buf),
-                     "X: %d  Y: %d   W: %d  H: %d   (S=save  Arrows=move 1px  Shift+Arrows=resize 1px  Ctrl+Arrows=jump  +/-=16px)",
-                     crop.x, crop.y, crop.w, crop.h);
-
-            SDL_Color col = {240,240,255,255};
-            SDL_Surface* ts = TTF_RenderUTF8_Blended(font, buf, col);
-            if (ts)
-            {
-                SDL_Texture* tt = SDL_CreateTextureFromSurface(renderer, ts);
-                if (tt)
-                {
-                    int tw = ts->w, th = ts->h;
-                    SDL_Rect tdst = {16, 16, tw, th};
-                    SDL_RenderCopy(renderer, tt, NULL, &tdst);
-                    SDL_DestroyTexture(tt);
-                }
-                SDL_FreeSurface(ts);
+            char buf[400];
+            ImageSlot* slot;
+            if (surface)
+                snprintf(buf, sizeof(buf),
+                         "%s %d/%d  X: %d  Y: %d   W: %d  H: %d%s   (S=save  Shift+S=save all  N=new  Tab=next  Del=remove  L=lock aspect  G=grid  Wheel=zoom  RMB=pan  Home=fit  PgUp/PgDn=image)",
+                         regions.count ? regions.items[regions.active].name : "crop", regions.active + 1, regions.count,
+                         crop.x, crop.y, crop.w, crop.h, aspect_lock ? "  [aspect locked]" : "");
+            else if (prefetch_state(&pf, current, &slot) == SLOT_FAILED)
+                snprintf(buf, sizeof(buf), "Failed to load %s: %s", inputs.paths[current], slot->error);
+            else
+                snprintf(buf, sizeof(buf), "Loading %s ...", inputs.paths[current]);
+
+            // Save status line (pending count, last result)
+            char sbuf[200] = "";
+            SDL_Color scol = {170, 255, 170, 255};
+            SDL_LockMutex(saves.lock);
+            if (grid_slot)
+                snprintf(sbuf, sizeof(sbuf), "Cutting grid: %d/%d tiles", SDL_AtomicGet(&grid.batch.done), grid.batch.total);
+            else if (saves.pending > 0)
+                snprintf(sbuf, sizeof(sbuf), "Saving... %d pending", saves.pending);
+            else if (saves.status[0] && SDL_GetTicks() - saves.status_ticks < SAVE_STATUS_SHOW_MS) {
+                snprintf(sbuf, sizeof(sbuf), "%s", saves.status);
+                if (saves.status_error) scol = (SDL_Color){255, 120, 120, 255};
+            }
+            SDL_UnlockMutex(saves.lock);
+
+            TextLine lines[TEXT_MAX_LINES] = {
+                { buf,  {240, 240, 255, 255}, 16, 16 },
+                { sbuf, scol,                 16, 16 + TTF_FontLineSkip(font) },
+            };
+            int nlines = 2;
+            if (prof.hud) {
+                int skip = TTF_FontLineSkip(font);
+                lines[nlines++] = (TextLine){ prof.hud_line[0], {255, 220, 120, 255}, 16, rh - 16 - 2 * skip };
+                lines[nlines++] = (TextLine){ prof.hud_line[1], {255, 220, 120, 255}, 16, rh - 16 - skip };
             }
+            text_batch_layout(&text, &atlas, lines, nlines);
+            text_batch_draw(&text, renderer, &atlas);
         }
+        prof_mark(PROF_TEXT);
 
         SDL_RenderPresent(renderer);
+        pacer_presented(&pacer);
+        prof_mark(PROF_PRESENT);
+        prof_frame_end();
+        if (tiles) tiles_end_frame(tiles);
     }
 
-    if (preview_tex) SDL_DestroyTexture(preview_tex);
-    SDL_DestroyTexture(texture);
-cleanup_surface:
-    SDL_FreeSurface(surface);
-cleanup_font:
+    save_queue_shutdown(&saves);
+    session_close(&session);
+    ipc_stop(&ipc);
+
+    regions_free(&regions);
+    for (int i = 0; i < inputs.count; i++) regions_free(&parked[i]);
+    free(parked);
+    saliency_free(&saliency);
+    quad_batch_free(&overlay);
+    if (loading_tex) SDL_DestroyTexture(loading_tex);
+    text_batch_free(&text);
+    atlas_destroy(&atlas);
+cleanup_prefetch:
+    prefetch_stop(&pf);
     if (font) TTF_CloseFont(font);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
@@ -472,5 +7365,7 @@ cleanup:
     TTF_Quit();
     IMG_Quit();
     SDL_Quit();
+    image_list_free(&inputs);
+    prof_shutdown();
     return 0;
 }